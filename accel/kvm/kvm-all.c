@@ -51,6 +51,7 @@
 #include "pt.h"
 #include "pt/hypercall.h"
 #include "pt/synchronization.h"
+#include "pt/memory_access.h"
 #endif
 
 
@@ -344,6 +345,10 @@ int kvm_destroy_vcpu(CPUState *cpu)
 
     DPRINTF("kvm_destroy_vcpu\n");
 
+#ifdef CONFIG_PROCESSOR_TRACE
+    pt_kvm_destroy(cpu);
+#endif
+
     ret = kvm_arch_destroy_vcpu(cpu);
     if (ret < 0) {
         goto err;
@@ -2114,6 +2119,9 @@ static int kvm_init(MachineState *ms)
                              &address_space_io);
     memory_listener_register(&kvm_coalesced_pio_listener,
                              &address_space_io);
+#ifdef CONFIG_PROCESSOR_TRACE
+    mem_tlb_setup();
+#endif
 
     s->many_ioeventfds = kvm_check_many_ioeventfds();
 
@@ -71,5 +71,26 @@ HXCOMM HXCOMM can be used for comments, discarded from both texi and C
     .help       = "set output file for all specified vcpu (postfix: _cpuid)",
     .cmd  = hmp_pt_set_file,
 },
+{
+    .name       = "decode_bench",
+    .args_type  = "id:i,addrn:i,file:s,iterations:i?",
+    .params     = "id addrn (0-3) file [iterations]",
+    .help       = "replay a raw trace dump through the decoder of the specified vcpu and report its throughput",
+    .cmd  = hmp_pt_decode_bench,
+},
+{
+    .name       = "disasm_bench",
+    .args_type  = "file:s,width:i?,iterations:i?",
+    .params     = "file [width (32/64)] [iterations]",
+    .help       = "compare capstone with the table-driven cofi decoder on a raw code image",
+    .cmd  = hmp_pt_disasm_bench,
+},
+{
+    .name       = "doorbell_bench",
+    .args_type  = "iterations:i?,spin:i?",
+    .params     = "[iterations] [spin]",
+    .help       = "compare the round trip rate of the chardev handshake with the shared memory doorbell",
+    .cmd  = hmp_pt_doorbell_bench,
+},
         
 #endif
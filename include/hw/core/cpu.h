@@ -418,6 +418,7 @@ struct CPUState {
     void* pt_mmap;
 
     volatile uint32_t overflow_counter;
+    volatile uint32_t ovf_gap_counter;
     volatile uint64_t trace_size;
 
     uint64_t pt_features;
@@ -426,6 +427,8 @@ struct CPUState {
     uint64_t pt_ip_filter_a[INTEL_PT_MAX_RANGES];
     uint64_t pt_ip_filter_b[INTEL_PT_MAX_RANGES];
     void* pt_decoder_state[INTEL_PT_MAX_RANGES];
+    void* pt_state;
+    void* pt_tlb;
     uint64_t pt_c3_filter;
 
     FILE *pt_target_file;
@@ -433,6 +436,7 @@ struct CPUState {
     bool executing;
     int disassembler_word_width;
     bool intel_pt_run_trashed;
+    uint32_t intel_pt_run_gaps;
 #endif
 
     int kvm_fd;
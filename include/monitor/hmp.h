@@ -27,6 +27,9 @@ void hmp_pt_status(Monitor *mon, const QDict *qdict);
 void hmp_pt_status_all(Monitor *mon, const QDict *qdict);
 void hmp_pt_ip_filtering(Monitor *mon, const QDict *qdict);
 void hmp_pt_set_file(Monitor *mon, const QDict *qdict);
+void hmp_pt_decode_bench(Monitor *mon, const QDict *qdict);
+void hmp_pt_disasm_bench(Monitor *mon, const QDict *qdict);
+void hmp_pt_doorbell_bench(Monitor *mon, const QDict *qdict);
 #endif
 
 void hmp_info_name(Monitor *mon, const QDict *qdict);
@@ -61,6 +61,9 @@
 
 #ifdef CONFIG_PROCESSOR_TRACE
 #include "pt.h"
+#include "pt/doorbell.h"
+#include "pt/memory_access.h"
+#include "pt/fast_snapshot.h"
 #include "hw/core/cpu.h"
 #include "qapi/qapi-commands-machine.h"
 
@@ -122,6 +125,10 @@ static inline void hmp_pt_enable_ip_filtering_cpu(Monitor *mon, int cpuid, int a
 
 static inline void hmp_pt_status_cpu(Monitor *mon, int cpuid){
         int i;
+        pt_decoder_stats_t stats;
+        uint64_t bitmap_bytes, coverage_map_bytes;
+        uint64_t tlb_hits, tlb_misses;
+        fast_snapshot_stats_t snapshot;
         CPUState *cpu = qemu_get_cpu(cpuid);
         monitor_printf(mon, "Processor Trace Status (CPU %d)\n", cpuid);
         if (cpu->pt_enabled){
@@ -131,7 +138,19 @@ static inline void hmp_pt_status_cpu(Monitor *mon, int cpuid){
                 monitor_printf(mon, "\tenabled:\t\tno\n");
         }
         monitor_printf(mon, "\tToPA overflows:\t\t%u\n", cpu->overflow_counter);
+        monitor_printf(mon, "\tOVF gaps (resynced):\t%u\n", cpu->ovf_gap_counter);
         monitor_printf(mon, "\ttrace data size:\t%lu (%luMB)\n", cpu->trace_size, cpu->trace_size >> 20);
+        pt_dirty_stats(&bitmap_bytes, &coverage_map_bytes);
+        monitor_printf(mon, "\tbitmap touched:\t\t%lu bytes (last run)\n", bitmap_bytes);
+        monitor_printf(mon, "\tcoverage map touched:\t%lu bytes (last run)\n", coverage_map_bytes);
+        mem_tlb_stats(cpu, &tlb_hits, &tlb_misses);
+        monitor_printf(mon, "\tsoft-TLB:\t\t%lu hits / %lu misses (%.1f%%)\n", tlb_hits, tlb_misses,
+                (tlb_hits + tlb_misses) ? (100.0 * tlb_hits) / (tlb_hits + tlb_misses) : 0.0);
+        if (fast_snapshot_exists()){
+                fast_snapshot_stats(&snapshot);
+                monitor_printf(mon, "\tfast reload:\t\t%lu restores, last %lu pages in %lu us\n",
+                        snapshot.restores, snapshot.pages, snapshot.nsec / 1000);
+        }
 
         for(i = 0; i < 4; i++){
                 if (cpu->pt_ip_filter_enabled[i]){
@@ -142,6 +161,11 @@ static inline void hmp_pt_status_cpu(Monitor *mon, int cpuid){
                                 case 3:
                                         monitor_printf(mon, "\tpt_ip_filter_%d_a:\t0x%016lx\n", i, cpu->pt_ip_filter_a[i]);
                                         monitor_printf(mon, "\tpt_ip_filter_%d_b:\t0x%016lx\n", i, cpu->pt_ip_filter_b[i]);
+                                        if (pt_decoder_stats(cpu, i, &stats)){
+                                                monitor_printf(mon, "\tpt_ip_filter_%d_cfg:\t%lu nodes (cofi: %luKB, lookup: %luKB, cache: %luKB)\n", i,
+                                                        stats.cofi_nodes, stats.cofi_bytes >> 10, stats.lookup_bytes >> 10, stats.cache_bytes >> 10);
+                                                monitor_printf(mon, "\tpt_ip_filter_%d_unknown:\t%lu packets\n", i, stats.unknown_packets);
+                                        }
                                         break;
                         }
                 }
@@ -266,6 +290,90 @@ void hmp_pt_set_file(Monitor *mon, const QDict *qdict){
         free(new_filename);
         qapi_free_CpuInfoList(cpu_list);
 }
+
+void hmp_pt_decode_bench(Monitor *mon, const QDict *qdict)
+{
+        int cpuid, addrn, iterations;
+        pt_bench_t res;
+        double sec;
+        const char *filename = qdict_get_str(qdict, "file");
+
+        cpuid = hmp_pt_get_cpuid(mon, qdict);
+        if (!hmp_pt_check_kvm(mon) || (cpuid < 0))
+                return;
+
+        addrn = qdict_get_int(qdict, "addrn");
+        if(addrn < 0 || addrn >= 4){
+                monitor_printf(mon, "invalid addrn value (0-3)\n");
+                return;
+        }
+
+        iterations = qdict_get_try_int(qdict, "iterations", 100);
+        if(iterations <= 0){
+                monitor_printf(mon, "invalid iterations value\n");
+                return;
+        }
+
+        if(pt_decoder_bench(qemu_get_cpu(cpuid), addrn, filename, iterations, &res)){
+                monitor_printf(mon, "CPU %d: failed (tracing active, no filter range or invalid trace)...\n", cpuid);
+                return;
+        }
+
+        sec = res.nsec / 1000000000.0;
+        monitor_printf(mon, "Decoder Benchmark (CPU %d, addr%d, %d iterations)\n", cpuid, addrn, iterations);
+        monitor_printf(mon, "\ttrace data:\t\t%lu bytes / %lu packets\n", res.bytes, res.packets);
+        monitor_printf(mon, "\ttime:\t\t\t%.3f ms\n", sec * 1000.0);
+        monitor_printf(mon, "\tthroughput:\t\t%.2f MB/s\n", (res.bytes / (1024.0 * 1024.0)) / sec);
+        monitor_printf(mon, "\tpacket rate:\t\t%.2f Mpackets/s\n", (res.packets / 1000000.0) / sec);
+}
+
+void hmp_pt_disasm_bench(Monitor *mon, const QDict *qdict)
+{
+        int width, iterations;
+        pt_disasm_bench_t res;
+        const char *filename = qdict_get_str(qdict, "file");
+
+        width = qdict_get_try_int(qdict, "width", 64);
+        iterations = qdict_get_try_int(qdict, "iterations", 10);
+        if(iterations <= 0){
+                monitor_printf(mon, "invalid iterations value\n");
+                return;
+        }
+
+        if(pt_disassembler_bench(filename, width, iterations, &res)){
+                monitor_printf(mon, "failed (invalid width or file)...\n");
+                return;
+        }
+
+        monitor_printf(mon, "Disassembler Benchmark (%d bit, %lu bytes, %d iterations)\n", width, res.bytes, iterations);
+        monitor_printf(mon, "\tinstructions:\t\t%lu\n", res.instructions / iterations);
+        monitor_printf(mon, "\tcapstone:\t\t%.2f Minstructions/s\n", (res.instructions / 1000.0) / (res.capstone_nsec / 1000000.0));
+        monitor_printf(mon, "\ttable decoder:\t\t%.2f Minstructions/s (%lu capstone fallbacks)\n", (res.instructions / 1000.0) / (res.table_nsec / 1000000.0), res.fallbacks);
+        monitor_printf(mon, "\tmismatches:\t\t%lu\n", res.mismatches);
+}
+
+void hmp_pt_doorbell_bench(Monitor *mon, const QDict *qdict)
+{
+        int iterations, spin;
+        doorbell_bench_t res;
+
+        iterations = qdict_get_try_int(qdict, "iterations", 100000);
+        spin = qdict_get_try_int(qdict, "spin", DOORBELL_SPIN_DEFAULT);
+        if(iterations <= 0 || spin < 0){
+                monitor_printf(mon, "invalid iterations or spin value\n");
+                return;
+        }
+
+        if(doorbell_bench(iterations, spin, &res)){
+                monitor_printf(mon, "failed...\n");
+                return;
+        }
+
+        monitor_printf(mon, "Doorbell Benchmark (%d round trips)\n", iterations);
+        monitor_printf(mon, "\tchardev:\t\t%.0f execs/s\n", iterations / (res.chardev_nsec / 1000000000.0));
+        monitor_printf(mon, "\tdoorbell (futex):\t%.0f execs/s\n", iterations / (res.futex_nsec / 1000000000.0));
+        monitor_printf(mon, "\tdoorbell (spin %d):\t%.0f execs/s\n", spin, iterations / (res.spin_nsec / 1000000000.0));
+}
 #endif
 
 void hmp_handle_error(Monitor *mon, Error *err)
@@ -11,13 +11,19 @@
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 #include "qemu-common.h"
+#include "qemu/timer.h"
+#include "qemu/rcu.h"
+#include "qemu/host-utils.h"
+#include "qemu/atomic.h"
 #include "cpu.h"
 #include "pt.h"
 #include "pt/decoder.h"
+#include "pt/novelty.h"
 #include "exec/memory.h"
 #include "sysemu/kvm_int.h"
 #include "sysemu/kvm.h"
 #include "sysemu/cpus.h"
+#include "sysemu/sysemu.h"
 #include "pt/hypercall.h"
 #include "pt/logger.h"
 #include "pt/memory_access.h"
@@ -29,18 +35,228 @@ extern uint32_t irpt_coverage_map_size;
 
 uint8_t* bitmap = NULL;
 
-uint16_t coverage_id = 0;
 bool is_coveraged = false;
 uint16_t* coverage_map = NULL;
 
-uint64_t last_ip = 0ULL;
-uint64_t module_base_address = 0ULL;
+/* cache lines written since the last reset, see pt_dirty_clear() */
+static uint64_t* bitmap_dirty = NULL;
+static uint64_t* coverage_map_dirty = NULL;
+static uint64_t bitmap_touched = 0;			/* bytes, last iteration */
+static uint64_t coverage_map_touched = 0;
+
+/* buckets seen by any run so far, see pt_setup_virgin_map() */
+static uint8_t* virgin_map = NULL;
+static uint8_t novelty_verdict = NOVELTY_NONE;
+static bool novelty_pending = false;		/* the run since the last reset was not compared yet */
+
+/* maps are plain shared memory (memfd, tmpfs, hugetlbfs): no writeback needed */
+static bool maps_shared_memory = false;
+
+#define CFG_CACHE_SYNC_INTERVAL	(60 * NANOSECONDS_PER_SECOND)
+#define PROFILE_SYNC_INTERVAL	(10 * NANOSECONDS_PER_SECOND)
+
+char* cfg_cache_dir = NULL;
+char* profile_dir = NULL;
+
+/* guest image snapshot of the trace region configured next (see pt_setup_trace_image) */
+struct {
+	uint64_t ip_a;
+	uint64_t ip_b;
+	uint64_t hash;
+	uint8_t* data;
+	uint64_t size;
+} trace_image = {0, 0, 0, NULL, 0};
+
+typedef struct predisasm_state_s{
+	CPUState *cpu;
+	uint8_t addrn;
+	uint8_t* image;
+	uint64_t image_size;
+	pthread_t thread;
+	volatile bool abort;
+	bool running;
+} predisasm_state_t;
+
+uint32_t predisasm_threads = 0;
+uint32_t decode_threads = 0;
+
+#define PT_DECODE_RING_SLOTS	4
+
+typedef struct pt_decode_chunk_s{
+	CPUState *cpu;
+	uint8_t* data;
+	int size;
+	int capacity;
+} pt_decode_chunk_t;
+
+bool pt_decode_async = false;
+bool pt_ovf_resync = false;
+
+/* 
+ * Trace state owned by a single vCPU. Each vCPU decodes into its own edge hash
+ * state and bitmap shard under its own dump_mutex, so SMP guests neither
+ * contend on one lock nor mix up each other's last edge. The shards are folded
+ * into the shared bitmap by pt_sync().
+ */
+/* handler opaque of one trace range: pt_bitmap() needs the range its edge came from */
+typedef struct pt_range_handler_s{
+	struct pt_vcpu_state_s* state;
+	uint64_t base;				/* min_addr of the range's disassembler, as in edge_id() */
+} pt_range_handler_t;
+
+typedef struct pt_vcpu_state_s{
+	CPUState *cpu;
+	pthread_mutex_t dump_mutex;	/* ToPA dumps, decoder and shard of this vCPU */
+	edge_sink_t edges;			/* bitmap shard (irpt_bitmap_size bytes) and last edge */
+	pt_range_handler_t ranges[INTEL_PT_MAX_RANGES];
+	uint16_t coverage_id;
+	int64_t cfg_cache_last_sync;
+	int64_t profile_last_sync;
+	predisasm_state_t predisasm[INTEL_PT_MAX_RANGES];
+
+	/* asynchronous decoding, see pt_decode_thread_fn() */
+	bool decode_running;
+	bool decode_stop;			/* the thread exits once the ring is drained */
+	pthread_t decode_thread;
+	pthread_mutex_t decode_mutex;
+	pthread_cond_t decode_cond_pushed;
+	pthread_cond_t decode_cond_decoded;
+	pt_decode_chunk_t decode_ring[PT_DECODE_RING_SLOTS];
+	uint64_t decode_pushed;
+	uint64_t decode_decoded;
+} pt_vcpu_state_t;
+
+static pt_vcpu_state_t* pt_vcpu_state_new(CPUState *cpu){
+	pt_vcpu_state_t* state = malloc(sizeof(pt_vcpu_state_t));
+	memset(state, 0x00, sizeof(pt_vcpu_state_t));
+	state->cpu = cpu;
+	for(uint8_t i = 0; i < INTEL_PT_MAX_RANGES; i++){
+		state->ranges[i].state = state;
+	}
+	pthread_mutex_init(&state->dump_mutex, NULL);
+	pthread_mutex_init(&state->decode_mutex, NULL);
+	pthread_cond_init(&state->decode_cond_pushed, NULL);
+	pthread_cond_init(&state->decode_cond_decoded, NULL);
+	return state;
+}
+
+/* all lines dirty: the mapped file may still hold the contents of an earlier run */
+static uint64_t* pt_dirty_new(uint32_t size){
+	uint64_t* dirty = malloc(edge_dirty_words(size) * sizeof(uint64_t));
+	memset(dirty, 0xff, edge_dirty_words(size) * sizeof(uint64_t));
+	return dirty;
+}
+
+/* clears the dirty lines of map and the dirty set, returns the number of bytes cleared */
+static uint64_t pt_dirty_clear(uint8_t* map, uint64_t* dirty, uint32_t size){
+	uint64_t bytes = 0;
+
+	for(uint32_t i = 0; i < edge_dirty_words(size); i++){
+		uint64_t lines = dirty[i];
+		uint32_t base = i << (EDGE_LINE_BITS + 6);
+
+		dirty[i] = 0;
+		if(lines == ~0ULL && base + (EDGE_LINE_SIZE << 6) <= size){
+			memset(map + base, 0x00, EDGE_LINE_SIZE << 6);
+			bytes += EDGE_LINE_SIZE << 6;
+			continue;
+		}
+		while(lines){
+			uint32_t offset = base + (ctz64(lines) << EDGE_LINE_BITS);
+			if(offset < size){
+				memset(map + offset, 0x00, MIN(EDGE_LINE_SIZE, size - offset));
+				bytes += MIN(EDGE_LINE_SIZE, size - offset);
+			}
+			lines &= lines - 1;
+		}
+	}
+	return bytes;
+}
+
+/* writes back the pages between the first and the last dirty line */
+static void pt_dirty_msync(uint8_t* map, uint64_t* dirty, uint32_t size){
+	int64_t first = -1, last = -1;
+	uint64_t start, end;
+
+	for(uint32_t i = 0; i < edge_dirty_words(size); i++){
+		if(dirty[i]){
+			if(first < 0){
+				first = (i << 6) + ctz64(dirty[i]);
+			}
+			last = (i << 6) + 63 - clz64(dirty[i]);
+		}
+	}
+	if(first < 0){
+		return;
+	}
+	start = (first << EDGE_LINE_BITS) & ~((uint64_t)qemu_real_host_page_size - 1);
+	end = MIN(size, (last + 1) << EDGE_LINE_BITS);
+	msync(map + start, end - start, MS_SYNC);
+}
+
+/* adds the dirty lines of the shard to the shared bitmap and clears them */
+static void pt_merge_shard(pt_vcpu_state_t* state){
+	edge_sink_t* shard = &state->edges;
+
+	for(uint32_t i = 0; i < edge_dirty_words(irpt_bitmap_size); i++){
+		uint64_t lines = shard->dirty[i];
+		if(!lines){
+			continue;
+		}
+		shard->dirty[i] = 0;
+		bitmap_dirty[i] |= lines;
+		while(lines){
+			uint32_t offset = ((i << 6) + ctz64(lines)) << EDGE_LINE_BITS;
+			for(uint32_t j = offset; j < MIN(offset + EDGE_LINE_SIZE, irpt_bitmap_size); j++){
+				bitmap[j] += shard->bitmap[j];
+				shard->bitmap[j] = 0;
+			}
+			lines &= lines - 1;
+		}
+	}
+}
+
+/* 
+ * Only the lines touched by this run are compared. Trashed runs are left out,
+ * their bitmap might hold edges which were never taken.
+ */
+static void pt_compare_virgin_map(void){
+	CPUState *cpu;
+
+	novelty_pending = false;
+	novelty_verdict = NOVELTY_NONE;
+	CPU_FOREACH(cpu){
+		if(cpu->intel_pt_run_trashed){
+			return;
+		}
+	}
+	novelty_verdict = novelty_compare(virgin_map, bitmap, bitmap_dirty, irpt_bitmap_size);
+}
 
 void pt_sync(void){
+	CPUState *cpu;
+
 	if(bitmap){
-		msync(bitmap, irpt_bitmap_size, MS_SYNC);
+		CPU_FOREACH(cpu){
+			pt_vcpu_state_t* state = cpu->pt_state;
+			if(state && state->edges.bitmap){
+				pthread_mutex_lock(&state->dump_mutex);
+				pt_decode_fence(cpu);
+				pt_merge_shard(state);
+				pthread_mutex_unlock(&state->dump_mutex);
+			}
+		}
+		if(virgin_map && novelty_pending){
+			pt_compare_virgin_map();
+		}
+		if(maps_shared_memory){
+			/* pairs with the acquire of the fuzzer after it got our reply */
+			smp_mb_release();
+			return;
+		}
+		pt_dirty_msync(bitmap, bitmap_dirty, irpt_bitmap_size);
 		if (is_coveraged)
-			msync(coverage_map, irpt_coverage_map_size, MS_SYNC);
+			pt_dirty_msync((uint8_t*)coverage_map, coverage_map_dirty, irpt_coverage_map_size);
 	}
 }
 
@@ -73,85 +289,628 @@ static inline int pt_ioctl(int fd, unsigned long request, unsigned long arg){
 
 void pt_setup_bitmap(void* ptr){
 	bitmap = (uint8_t*)ptr;
+	free(bitmap_dirty);
+	bitmap_dirty = pt_dirty_new(irpt_bitmap_size);
 }
 
 void pt_setup_coverage_map(void* ptr){
 	coverage_map = (uint16_t*)ptr;
+	free(coverage_map_dirty);
+	coverage_map_dirty = pt_dirty_new(irpt_coverage_map_size);
+}
+
+void pt_setup_shared_memory(void){
+	maps_shared_memory = true;
+}
+
+void pt_setup_virgin_map(void){
+	g_free(virgin_map);
+	virgin_map = novelty_virgin_new(irpt_bitmap_size);
+}
+
+/* verdict of the last synced run, false without a virgin map */
+bool pt_novelty(uint8_t* verdict){
+	*verdict = novelty_verdict;
+	return virgin_map != NULL;
+}
+
+/* non-zero bytes of the bitmap lines touched since the last reset, call after pt_sync() */
+void pt_bitmap_foreach(void (*fn)(void* opaque, uint32_t index, uint8_t count), void* opaque){
+	if(!bitmap){
+		return;
+	}
+	for(uint32_t i = 0; i < edge_dirty_words(irpt_bitmap_size); i++){
+		uint64_t lines = bitmap_dirty[i];
+		while(lines){
+			uint32_t offset = ((i << 6) + ctz64(lines)) << EDGE_LINE_BITS;
+			for(uint32_t j = offset; j < MIN(offset + EDGE_LINE_SIZE, irpt_bitmap_size); j++){
+				if(bitmap[j]){
+					fn(opaque, j, bitmap[j]);
+				}
+			}
+			lines &= lines - 1;
+		}
+	}
+}
+
+/* bytes of the bitmap / coverage map touched by the last iteration */
+void pt_dirty_stats(uint64_t* bitmap_bytes, uint64_t* coverage_map_bytes){
+	*bitmap_bytes = bitmap_touched;
+	*coverage_map_bytes = coverage_map_touched;
+}
+
+void pt_setup_cfg_cache(const char* dir){
+	free(cfg_cache_dir);
+	cfg_cache_dir = strdup(dir);
+}
+
+void pt_setup_timing_profile(const char* dir){
+	free(profile_dir);
+	profile_dir = strdup(dir);
+}
+
+void pt_setup_predisassembly(uint32_t threads){
+	predisasm_threads = threads;
+}
+
+void pt_setup_parallel_decode(uint32_t threads){
+	decode_threads = threads;
+}
+
+/* FNV-1a, used as key of the on-disk CFG cache */
+static uint64_t hash_image(uint8_t* image, uint64_t size){
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	for(uint64_t i = 0; i < size; i++){
+		hash = (hash ^ image[i]) * 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+/* 
+ * Guest image which is about to be configured as trace region ip_a-ip_b, the
+ * buffer is owned by the caller and has to stay valid until the next call.
+ */
+void pt_setup_trace_image(uint64_t ip_a, uint64_t ip_b, uint8_t* image, uint64_t size){
+	trace_image.ip_a = ip_a;
+	trace_image.ip_b = ip_b;
+	trace_image.data = image;
+	trace_image.size = size;
+	trace_image.hash = (cfg_cache_dir && image) ? hash_image(image, size) : 0;
+}
+
+static inline bool pt_trace_image_matches(CPUState *cpu, uint8_t addrn){
+	return trace_image.data && trace_image.ip_a == cpu->pt_ip_filter_a[addrn] && trace_image.ip_b == cpu->pt_ip_filter_b[addrn];
+}
+
+static void pt_cfg_cache_attach(CPUState *cpu, uint8_t addrn){
+	char file_name[256];
+	decoder_t* decoder = cpu->pt_decoder_state[addrn];
+	disassembler_t* disassembler = decoder->disassembler_state;
+
+	if(!cfg_cache_dir || !trace_image.hash || !pt_trace_image_matches(cpu, addrn)){
+		return;
+	}
+	snprintf(file_name, 256, "%s/cfg_%016lx_%lx-%lx", cfg_cache_dir, trace_image.hash, trace_image.ip_a, trace_image.ip_b);
+	if(disassembler_attach_cache(disassembler, file_name, trace_image.hash)){
+		QEMU_PT_PRINTF(PT_PREFIX, "Loaded CFG cache %s (%u nodes)", file_name, disassembler->cofi_arena_used - 1);
+	}
+}
+
+/* writes back grown CFGs, at most every CFG_CACHE_SYNC_INTERVAL unless forced */
+static void pt_cfg_cache_sync(CPUState *cpu, bool force){
+	pt_vcpu_state_t* state = cpu->pt_state;
+	int64_t now = get_clock();
+
+	if(!cfg_cache_dir || (!force && now - state->cfg_cache_last_sync < CFG_CACHE_SYNC_INTERVAL)){
+		return;
+	}
+	state->cfg_cache_last_sync = now;
+
+	pthread_mutex_lock(&state->dump_mutex);
+	pt_decode_fence(cpu);
+	for(uint8_t i = 0; i < INTEL_PT_MAX_RANGES; i++){
+		if(cpu->pt_ip_filter_enabled[i]){
+			decoder_t* decoder = cpu->pt_decoder_state[i];
+			disassembler_sync_cache(decoder->disassembler_state);
+		}
+	}
+	pthread_mutex_unlock(&state->dump_mutex);
+}
+
+static void pt_profile_write(CPUState *cpu, uint8_t addrn){
+	char file_name[256];
+
+	snprintf(file_name, 256, "%s/profile_cpu%d_%lx-%lx.txt", profile_dir, cpu->cpu_index, cpu->pt_ip_filter_a[addrn], cpu->pt_ip_filter_b[addrn]);
+	if(!pt_decoder_write_profile(cpu->pt_decoder_state[addrn], file_name)){
+		QEMU_PT_ERROR(PT_PREFIX, "Error writing block profile %s", file_name);
+	}
+}
+
+/* writes the per-block timing histograms, at most every PROFILE_SYNC_INTERVAL unless forced */
+static void pt_profile_sync(CPUState *cpu, bool force){
+	pt_vcpu_state_t* state = cpu->pt_state;
+	int64_t now = get_clock();
+
+	if(!profile_dir || (!force && now - state->profile_last_sync < PROFILE_SYNC_INTERVAL)){
+		return;
+	}
+	state->profile_last_sync = now;
+
+	pthread_mutex_lock(&state->dump_mutex);
+	pt_decode_fence(cpu);
+	for(uint8_t i = 0; i < INTEL_PT_MAX_RANGES; i++){
+		if(cpu->pt_ip_filter_enabled[i]){
+			pt_profile_write(cpu, i);
+		}
+	}
+	pthread_mutex_unlock(&state->dump_mutex);
+}
+
+static void* pt_predisasm_thread(void* arg){
+	predisasm_state_t* state = arg;
+	CPUState *cpu = state->cpu;
+	pt_vcpu_state_t* vcpu_state = cpu->pt_state;
+	decoder_t* decoder;
+	disassembler_t* res;
+
+	res = predisassemble(cpu, cpu->pt_ip_filter_a[state->addrn], cpu->pt_ip_filter_b[state->addrn], &pt_bitmap, &vcpu_state->ranges[state->addrn],
+						 state->image, state->image_size, predisasm_threads, &state->abort);
+
+	/* publish: the decoder only ever sees the lazy or the complete CFG */
+	pthread_mutex_lock(&vcpu_state->dump_mutex);
+	pt_decode_fence(cpu);
+	if(res && !state->abort){
+		decoder = cpu->pt_decoder_state[state->addrn];
+		res->cache_file = decoder->disassembler_state->cache_file;
+		decoder->disassembler_state->cache_file = NULL;
+		pt_decoder_replace_disassembler(decoder, res);
+		QEMU_PT_PRINTF(PT_PREFIX, "Pre-disassembled trace region %d (%u nodes)", state->addrn, res->cofi_arena_used - 1);
+	} else if(res){
+		destroy_disassembler(res);
+	}
+	pthread_mutex_unlock(&vcpu_state->dump_mutex);
+
+	free(state->image);
+	state->image = NULL;
+	return NULL;
+}
+
+static void pt_predisasm_start(CPUState *cpu, uint8_t addrn){
+	predisasm_state_t* state = &((pt_vcpu_state_t*)cpu->pt_state)->predisasm[addrn];
+	decoder_t* decoder = cpu->pt_decoder_state[addrn];
+
+	/* nothing to do if the CFG cache was loaded */
+	if(!predisasm_threads || !pt_trace_image_matches(cpu, addrn) || !cpu->disassembler_word_width ||
+		decoder->disassembler_state->cofi_arena_used > 1){
+		return;
+	}
+
+	/* private copy, the hypercall handler frees its image on reconfiguration */
+	state->image = malloc(trace_image.size);
+	memcpy(state->image, trace_image.data, trace_image.size);
+	state->image_size = trace_image.size;
+	state->cpu = cpu;
+	state->addrn = addrn;
+	state->abort = false;
+	state->running = !pthread_create(&state->thread, NULL, pt_predisasm_thread, state);
+	if(!state->running){
+		free(state->image);
+		state->image = NULL;
+	}
+}
+
+static void pt_predisasm_stop(CPUState *cpu, uint8_t addrn){
+	predisasm_state_t* state = &((pt_vcpu_state_t*)cpu->pt_state)->predisasm[addrn];
+
+	if(state->running){
+		state->abort = true;
+		pthread_join(state->thread, NULL);
+		state->running = false;
+	}
+}
+
+/* edge ids go straight into the shard unless the handler needs the addresses */
+static edge_sink_t* pt_edge_sink(pt_vcpu_state_t* state){
+#ifdef SAMPLE_DECODED
+	return NULL;
+#else
+	return is_coveraged ? NULL : &state->edges;
+#endif
+}
+
+/* the coverage map is filled by pt_bitmap(), which the edge sink bypasses */
+static void pt_update_edge_sinks(void){
+	CPUState *cpu;
+
+	CPU_FOREACH(cpu){
+		pt_vcpu_state_t* state = cpu->pt_state;
+		if(!state){
+			continue;
+		}
+		pthread_mutex_lock(&state->dump_mutex);
+		pt_decode_fence(cpu);
+		for(uint8_t i = 0; i < INTEL_PT_MAX_RANGES; i++){
+			if(cpu->pt_ip_filter_enabled[i]){
+				decoder_t* decoder = cpu->pt_decoder_state[i];
+				/* also drops the transition cache, which holds ids in one mode and addresses in the other */
+				disassembler_set_edge_sink(decoder->disassembler_state, pt_edge_sink(state));
+			}
+		}
+		pthread_mutex_unlock(&state->dump_mutex);
+	}
 }
 
 void pt_turn_on_coverage_map(void) {
-	is_coveraged = true;
+	if(!is_coveraged){
+		is_coveraged = true;
+		pt_update_edge_sinks();
+	}
 }
 
 void pt_turn_off_coverage_map(void) {
-	is_coveraged = false;
+	if(is_coveraged){
+		is_coveraged = false;
+		pt_update_edge_sinks();
+	}
+}
+
+static void pt_reset_vcpu_states(bool reset_shards, bool reset_coverage_id){
+	CPUState *cpu;
+
+	CPU_FOREACH(cpu){
+		pt_vcpu_state_t* state = cpu->pt_state;
+		if(!state){
+			continue;
+		}
+		pthread_mutex_lock(&state->dump_mutex);
+		pt_decode_fence(cpu);
+		state->edges.last_id = 0ULL;
+		if(reset_shards && state->edges.bitmap){
+			pt_dirty_clear(state->edges.bitmap, state->edges.dirty, irpt_bitmap_size);
+		}
+		if(reset_coverage_id){
+			state->coverage_id = 0;
+		}
+		pthread_mutex_unlock(&state->dump_mutex);
+	}
 }
 
 void pt_reset_bitmap(void){
 	if(bitmap){
-		last_ip = 0ULL;
-		memset(bitmap, 0x00, irpt_bitmap_size);
+		pt_reset_vcpu_states(true, false);
+		bitmap_touched = pt_dirty_clear(bitmap, bitmap_dirty, irpt_bitmap_size);
+		novelty_pending = true;
+		novelty_verdict = NOVELTY_NONE;
 	}
 }
 
 void pt_reset_coverage_map(void){
 	if(is_coveraged && coverage_map){
-		last_ip = 0ULL;
-		coverage_id = 0;
-		memset(coverage_map, 0x00, irpt_coverage_map_size);
+		pt_reset_vcpu_states(false, true);
+		coverage_map_touched = pt_dirty_clear((uint8_t*)coverage_map, coverage_map_dirty, irpt_coverage_map_size);
 	}
 }
 
-static inline uint64_t mix_bits(uint64_t v) {
-  v ^= (v >> 31);
-  v *= 0x7fb5d329728ea185;
-  v ^= (v >> 27);
-  v *= 0x81dadef4bc2dd44d;
-  v ^= (v >> 33);
-  return v;
-}
-
-void pt_bitmap(uint64_t addr){
-	uint32_t transition_value = 0;
+void pt_bitmap(void* opaque, uint64_t addr){
+	pt_range_handler_t* range = opaque;
+	pt_vcpu_state_t* state = range->state;
 	#ifdef SAMPLE_DECODED
 	sample_decoded(addr);
 	#endif
-	if(bitmap){
-		addr -= module_base_address;
-		if (is_coveraged && coverage_map) {
-			coverage_map[addr % (irpt_coverage_map_size/sizeof(uint16_t))] = ++coverage_id;
-		}
-		addr = mix_bits(addr);
-		transition_value = (addr ^ (last_ip >> 1)) & 0xffffff;
-		bitmap[transition_value & (irpt_bitmap_size-1)]++;
+	addr -= range->base;
+	if (state->edges.bitmap && is_coveraged && coverage_map) {
+		uint32_t offset = (addr % (irpt_coverage_map_size/sizeof(uint16_t))) * sizeof(uint16_t);
+		coverage_map[offset / sizeof(uint16_t)] = ++state->coverage_id;
+		/* shared by all vCPUs */
+		atomic_or(&coverage_map_dirty[offset >> (EDGE_LINE_BITS + 6)], 1ULL << ((offset >> EDGE_LINE_BITS) & 63));
 	}
-	last_ip = addr; 
+	edge_sink_add(&state->edges, mix_bits(addr));
 }
 
-void pt_dump(CPUState *cpu, int bytes){
-#ifdef SAMPLE_RAW
-	sample_raw(cpu->pt_mmap, bytes);
-#endif
-#ifdef SAMPLE_RAW_SINGLE
-	sample_raw_single(cpu->pt_mmap, bytes);
-#endif
+/* 
+ * The decoder of the first enabled range decodes for all of them, see
+ * pt_link_ranges(). Synchronous and asynchronous dumps both end up here, so
+ * every enabled range is fed either way.
+ */
+static void pt_decode_chunk(CPUState *cpu, uint8_t* data, int bytes){
 	for(uint8_t i = 0; i < INTEL_PT_MAX_RANGES; i++){
 		if(cpu->pt_ip_filter_enabled[i]){			
 			if (cpu->pt_target_file){
-				fwrite(cpu->pt_mmap, sizeof(char), bytes, cpu->pt_target_file);
+				fwrite(data, sizeof(char), bytes, cpu->pt_target_file);
 			}
 			if (!cpu->intel_pt_run_trashed){
-				if(!decode_buffer(cpu->pt_decoder_state[i], cpu->pt_mmap, bytes)){
+				decoder_t* decoder = cpu->pt_decoder_state[i];
+				if(!decode_buffer(decoder, data, bytes)){
 					cpu->intel_pt_run_trashed = true;
 				}
+				cpu->intel_pt_run_gaps += decoder->ovf_gaps;
+				cpu->ovf_gap_counter += decoder->ovf_gaps;
+				decoder->ovf_gaps = 0;
 			}
+			break;
 		}
 	}
+}
+
+/* 
+ * Has to follow every change of the enabled ranges: the first enabled range
+ * dispatches the segments of all ranges to their CFGs in a single pass.
+ */
+static void pt_link_ranges(CPUState *cpu){
+	decoder_t* ranges[INTEL_PT_MAX_RANGES];
+	decoder_t* primary = NULL;
+
+	for(uint8_t i = 0; i < INTEL_PT_MAX_RANGES; i++){
+		ranges[i] = cpu->pt_ip_filter_enabled[i] ? cpu->pt_decoder_state[i] : NULL;
+		if(ranges[i]){
+			pt_decoder_set_ranges(ranges[i], NULL, 0);
+			if(!primary){
+				primary = ranges[i];
+			}
+		}
+	}
+	if(primary){
+		pt_decoder_set_ranges(primary, ranges, INTEL_PT_MAX_RANGES);
+	}
+}
+
+/* 
+ * Asynchronous decoding: pt_dump() copies the ToPA contents into a ring slot
+ * of the vCPU and returns, the vCPU's decoder thread works on the previous
+ * chunks meanwhile. pt_decode_fence() has to be called before the decoder
+ * state, the bitmap shard or intel_pt_run_trashed are looked at.
+ *
+ * The disassembler reads guest code while the vCPU keeps running, which is
+ * what the synchronous path does on ToPA overflows as well. Chunks never
+ * outlive a run: pt_disable() fences, so everything is decoded before the
+ * vCPU parks in the hypercall handler and the VM is reset or reloaded.
+ */
+static void* pt_decode_thread_fn(void* arg){
+	pt_vcpu_state_t* state = arg;
+	pt_decode_chunk_t* chunk;
+
+	/* the disassembler may have to read guest memory */
+	rcu_register_thread();
+
+	while(true){
+		pthread_mutex_lock(&state->decode_mutex);
+		while(state->decode_decoded == state->decode_pushed && !state->decode_stop){
+			pthread_cond_wait(&state->decode_cond_pushed, &state->decode_mutex);
+		}
+		if(state->decode_decoded == state->decode_pushed){
+			pthread_mutex_unlock(&state->decode_mutex);
+			break;
+		}
+		chunk = &state->decode_ring[state->decode_decoded % PT_DECODE_RING_SLOTS];
+		pthread_mutex_unlock(&state->decode_mutex);
+
+		pt_decode_chunk(chunk->cpu, chunk->data, chunk->size);
+
+		pthread_mutex_lock(&state->decode_mutex);
+		state->decode_decoded++;
+		pthread_cond_broadcast(&state->decode_cond_decoded);
+		pthread_mutex_unlock(&state->decode_mutex);
+	}
+
+	rcu_unregister_thread();
+	return NULL;
+}
+
+/* drains the ring and joins the decoder thread, the next dump starts a new one */
+static void pt_decode_stop(pt_vcpu_state_t* state){
+	if(!state->decode_running){
+		return;
+	}
+	pthread_mutex_lock(&state->decode_mutex);
+	state->decode_stop = true;
+	pthread_cond_signal(&state->decode_cond_pushed);
+	pthread_mutex_unlock(&state->decode_mutex);
+
+	pthread_join(state->decode_thread, NULL);
+	state->decode_running = false;
+	state->decode_stop = false;
+}
+
+static void pt_decode_exit(Notifier *n, void *data){
+	CPUState *cpu;
+
+	CPU_FOREACH(cpu){
+		if(cpu->pt_state){
+			pt_decode_stop(cpu->pt_state);
+		}
+	}
+}
+
+static Notifier pt_decode_exit_notifier = { .notify = pt_decode_exit };
+
+/* returns false if there is no decoder thread to hand the chunk to */
+static bool pt_decode_push(CPUState *cpu, uint8_t* data, int bytes){
+	pt_vcpu_state_t* state = cpu->pt_state;
+	pt_decode_chunk_t* chunk;
+
+	if(!state->decode_running){
+		state->decode_running = !pthread_create(&state->decode_thread, NULL, pt_decode_thread_fn, state);
+		if(!state->decode_running){
+			return false;
+		}
+	}
+
+	/* single producer (dump_mutex of this vCPU), the slot is ours once it is free */
+	pthread_mutex_lock(&state->decode_mutex);
+	while(state->decode_pushed - state->decode_decoded == PT_DECODE_RING_SLOTS){
+		pthread_cond_wait(&state->decode_cond_decoded, &state->decode_mutex);
+	}
+	chunk = &state->decode_ring[state->decode_pushed % PT_DECODE_RING_SLOTS];
+	pthread_mutex_unlock(&state->decode_mutex);
+
+	if(chunk->capacity < bytes){
+		chunk->data = realloc(chunk->data, bytes);
+		chunk->capacity = bytes;
+	}
+	memcpy(chunk->data, data, bytes);
+	chunk->cpu = cpu;
+	chunk->size = bytes;
+
+	pthread_mutex_lock(&state->decode_mutex);
+	state->decode_pushed++;
+	pthread_cond_signal(&state->decode_cond_pushed);
+	pthread_mutex_unlock(&state->decode_mutex);
+	return true;
+}
+
+void pt_decode_fence(CPUState *cpu){
+	pt_vcpu_state_t* state = cpu->pt_state;
+
+	if(!state || !state->decode_running){
+		return;
+	}
+	pthread_mutex_lock(&state->decode_mutex);
+	while(state->decode_decoded != state->decode_pushed){
+		pthread_cond_wait(&state->decode_cond_decoded, &state->decode_mutex);
+	}
+	pthread_mutex_unlock(&state->decode_mutex);
+}
+
+/* decoder threads are started by the first dump of each vCPU and joined on exit */
+void pt_setup_async_decode(void){
+	if(!pt_decode_async){
+		qemu_add_exit_notifier(&pt_decode_exit_notifier);
+	}
+	pt_decode_async = true;
+}
+
+/* applies to trace regions configured afterwards */
+void pt_setup_ovf_resync(void){
+	pt_ovf_resync = true;
+}
+
+void pt_dump(CPUState *cpu, int bytes){
+#ifdef SAMPLE_RAW
+	sample_raw(cpu->pt_mmap, bytes);
+#endif
+#ifdef SAMPLE_RAW_SINGLE
+	sample_raw_single(cpu->pt_mmap, bytes);
+#endif
+	if(!pt_decode_async || !pt_decode_push(cpu, cpu->pt_mmap, bytes)){
+		pt_decode_chunk(cpu, cpu->pt_mmap, bytes);
+	}
 	cpu->trace_size += bytes;
 }
 
 
+/* memory used by the CFG of one trace region */
+bool pt_decoder_stats(CPUState *cpu, uint8_t addrn, pt_decoder_stats_t* stats){
+	pt_vcpu_state_t* state = cpu->pt_state;
+	decoder_t* decoder;
+
+	if(addrn >= INTEL_PT_MAX_RANGES || !cpu->pt_ip_filter_enabled[addrn]){
+		return false;
+	}
+
+	pthread_mutex_lock(&state->dump_mutex);
+	pt_decode_fence(cpu);
+	decoder = cpu->pt_decoder_state[addrn];
+	disassembler_get_stats(decoder->disassembler_state, &stats->cofi_nodes, &stats->cofi_bytes, &stats->lookup_bytes, &stats->cache_bytes);
+	stats->unknown_packets = decoder->unknown_packets;
+	pthread_mutex_unlock(&state->dump_mutex);
+	return true;
+}
+
+static int pt_read_file(const char* file, uint8_t** buf, long* size){
+	FILE* fd;
+
+	fd = fopen(file, "rb");
+	if(!fd){
+		return -ENOENT;
+	}
+	fseek(fd, 0, SEEK_END);
+	*size = ftell(fd);
+	fseek(fd, 0, SEEK_SET);
+	if(*size <= 0){
+		fclose(fd);
+		return -EIO;
+	}
+	*buf = malloc(*size);
+	if(fread(*buf, sizeof(uint8_t), *size, fd) != (size_t)*size){
+		fclose(fd);
+		free(*buf);
+		return -EIO;
+	}
+	fclose(fd);
+	return 0;
+}
+
+/* 
+ * Replays a raw ToPA dump (e.g. written by "pt set_file" or SAMPLE_RAW) through
+ * the decoder of an already configured IP filter range. The CFG of the live
+ * decoder is reused, so the first iteration includes disassembly costs.
+ */
+int pt_decoder_bench(CPUState *cpu, uint8_t addrn, const char* file, uint32_t iterations, pt_bench_t* res){
+	pt_vcpu_state_t* state = cpu->pt_state;
+	long size;
+	uint8_t* buf;
+	decoder_t* decoder;
+	int64_t start;
+	int r = 0;
+
+	if(addrn >= INTEL_PT_MAX_RANGES || !cpu->pt_ip_filter_enabled[addrn] || cpu->pt_enabled){
+		return -EINVAL;
+	}
+
+	r = pt_read_file(file, &buf, &size);
+	if(r){
+		return r;
+	}
+
+	memset(res, 0x00, sizeof(pt_bench_t));
+
+	pthread_mutex_lock(&state->dump_mutex);
+	pt_decode_fence(cpu);
+	decoder = cpu->pt_decoder_state[addrn];
+	start = get_clock();
+	for(uint32_t i = 0; i < iterations; i++){
+		pt_decoder_flush(decoder);
+		if(!decode_buffer(decoder, buf, size)){
+			r = -EINVAL;
+		}
+		res->bytes += size;
+		res->packets += decoder->packet_count;
+	}
+	res->nsec = get_clock() - start;
+	pt_decoder_flush(decoder);
+	pthread_mutex_unlock(&state->dump_mutex);
+
+	pt_reset_bitmap();
+	pt_reset_coverage_map();
+	free(buf);
+	return r;
+}
+
+/* 
+ * Compares capstone with the table-driven cofi decoder on a raw code image
+ * (e.g. a driver dumped with CREATE_VM_IMAGE), no vcpu state is involved.
+ */
+int pt_disassembler_bench(const char* file, uint8_t word_width, uint32_t iterations, pt_disasm_bench_t* res){
+	long size;
+	uint8_t* buf;
+	int r;
+
+	if(word_width != 32 && word_width != 64){
+		return -EINVAL;
+	}
+	r = pt_read_file(file, &buf, &size);
+	if(r){
+		return r;
+	}
+	res->bytes = size;
+	disassembler_bench(buf, size, word_width == 64, iterations, &res->instructions, &res->capstone_nsec, &res->table_nsec, &res->fallbacks, &res->mismatches);
+	free(buf);
+	return 0;
+}
+
 int pt_enable(CPUState *cpu, bool hmp_mode){
+	pt_vcpu_state_t* state = cpu->pt_state;
+
 #ifdef SAMPLE_RAW
 	init_sample_raw();
 #endif
@@ -164,6 +923,13 @@ int pt_enable(CPUState *cpu, bool hmp_mode){
 #ifdef SAMPLE_DECODED_DETAILED
 	init_sample_decoded_detailed();
 #endif
+	if(bitmap && !state->edges.bitmap){
+		state->edges.bitmap = malloc(irpt_bitmap_size);
+		memset(state->edges.bitmap, 0x00, irpt_bitmap_size);
+		state->edges.dirty = malloc(edge_dirty_words(irpt_bitmap_size) * sizeof(uint64_t));
+		memset(state->edges.dirty, 0x00, edge_dirty_words(irpt_bitmap_size) * sizeof(uint64_t));
+		state->edges.mask = (irpt_bitmap_size - 1) & 0xffffff;
+	}
 	pt_reset_bitmap();
 	pt_reset_coverage_map();
 	return pt_cmd(cpu, KVM_VMX_PT_ENABLE, hmp_mode);
@@ -171,11 +937,14 @@ int pt_enable(CPUState *cpu, bool hmp_mode){
 	
 int pt_disable(CPUState *cpu, bool hmp_mode){
 	int r = pt_cmd(cpu, KVM_VMX_PT_DISABLE, hmp_mode);
+	pt_decode_fence(cpu);
 	for(uint8_t i = 0; i < INTEL_PT_MAX_RANGES; i++){
 		if(cpu->pt_ip_filter_enabled[i]){
 			pt_decoder_flush(cpu->pt_decoder_state[i]);
 		}
 	}
+	pt_cfg_cache_sync(cpu, false);
+	pt_profile_sync(cpu, false);
 
 	return r;
 }
@@ -199,6 +968,7 @@ int pt_set_cr3(CPUState *cpu, uint64_t val, bool hmp_mode){
 }
 
 int pt_enable_ip_filtering(CPUState *cpu, uint8_t addrn, uint64_t ip_a, uint64_t ip_b, bool hmp_mode){
+	decoder_t* decoder;
 	int r = 0;
 
 	if(addrn > 3){
@@ -209,11 +979,13 @@ int pt_enable_ip_filtering(CPUState *cpu, uint8_t addrn, uint64_t ip_a, uint64_t
 		return -EINVAL;
 	}
 		
-	if(ip_a > ip_b){
-		QEMU_PT_ERROR(PT_PREFIX, "Error (ip_a > ip_b) 0x%lx-0x%lx", ip_a, ip_b);
+	if(ip_a >= ip_b){
+		QEMU_PT_ERROR(PT_PREFIX, "Error (ip_a >= ip_b) 0x%lx-0x%lx", ip_a, ip_b);
 		return -EINVAL;
 	}
 	
+	/* queued chunks were traced with the old set of ranges */
+	pt_decode_fence(cpu);
 	if(cpu->pt_ip_filter_enabled[addrn]){
 		pt_disable_ip_filtering(cpu, addrn, hmp_mode);
 	}
@@ -244,13 +1016,26 @@ int pt_enable_ip_filtering(CPUState *cpu, uint8_t addrn, uint64_t ip_a, uint64_t
 		case 1:
 		case 2:
 		case 3:
-			module_base_address = ip_a; 				// for pt_bitmap
+			decoder = pt_decoder_init(cpu, ip_a, ip_b, &pt_bitmap, &((pt_vcpu_state_t*)cpu->pt_state)->ranges[addrn]);
+			if(!decoder){
+				return -EINVAL;
+			}
+			((pt_vcpu_state_t*)cpu->pt_state)->ranges[addrn].base = ip_a;	// for pt_bitmap
 			cpu->pt_ip_filter_a[addrn] = ip_a;
 			cpu->pt_ip_filter_b[addrn] = ip_b;
 			r += pt_cmd(cpu, KVM_VMX_PT_CONFIGURE_ADDR0+addrn, hmp_mode);
 			r += pt_cmd(cpu, KVM_VMX_PT_ENABLE_ADDR0+addrn, hmp_mode);
 			cpu->pt_ip_filter_enabled[addrn] = true;	
-			cpu->pt_decoder_state[addrn] = pt_decoder_init(cpu, ip_a, ip_b, &pt_bitmap);
+			decoder->ovf_resync = pt_ovf_resync;
+			if(profile_dir){
+				pt_decoder_enable_profile(decoder);
+			}
+			cpu->pt_decoder_state[addrn] = decoder;
+			pt_cfg_cache_attach(cpu, addrn);
+			disassembler_set_edge_sink(decoder->disassembler_state, pt_edge_sink(cpu->pt_state));
+			pt_decoder_enable_parallel(decoder, decode_threads);
+			pt_predisasm_start(cpu, addrn);
+			pt_link_ranges(cpu);
 			break;
 		default:
 			r = -EINVAL;
@@ -267,8 +1052,17 @@ int pt_disable_ip_filtering(CPUState *cpu, uint8_t addrn, bool hmp_mode){
 		case 3:
 			r = pt_cmd(cpu, KVM_VMX_PT_DISABLE_ADDR0+addrn, hmp_mode);
 			if(cpu->pt_ip_filter_enabled[addrn]){
+				decoder_t* decoder = cpu->pt_decoder_state[addrn];
+				pt_decode_fence(cpu);
+				pt_predisasm_stop(cpu, addrn);
+				disassembler_sync_cache(decoder->disassembler_state);
+				if(profile_dir){
+					pt_profile_write(cpu, addrn);
+				}
 				cpu->pt_ip_filter_enabled[addrn] = false;
 				pt_decoder_destroy(cpu->pt_decoder_state[addrn]);
+				cpu->pt_decoder_state[addrn] = NULL;
+				pt_link_ranges(cpu);
 			}
 			break;
 		default:
@@ -300,10 +1094,36 @@ void pt_kvm_init(CPUState *cpu){
 	cpu->pt_c3_filter = 0;
 	cpu->pt_target_file = NULL;
 	cpu->overflow_counter = 0;
+	cpu->ovf_gap_counter = 0;
 	cpu->trace_size = 0;
 	cpu->reload_pending = false;
 	cpu->executing = false;
 	cpu->intel_pt_run_trashed = false;
+	cpu->intel_pt_run_gaps = 0;
+	cpu->pt_state = pt_vcpu_state_new(cpu);
+	cpu->pt_tlb = mem_tlb_new();
+}
+
+/* 
+ * vCPU unplug, called in the vCPU thread. The state itself stays around: the
+ * decoders of the vCPU point at it and the CPU may still be walked by pt_sync()
+ * until it is removed from the CPU list.
+ */
+void pt_kvm_destroy(CPUState *cpu){
+	pt_vcpu_state_t* state = cpu->pt_state;
+
+	if(!state){
+		return;
+	}
+	pt_decode_stop(state);
+	pthread_mutex_destroy(&state->decode_mutex);
+	pthread_cond_destroy(&state->decode_cond_pushed);
+	pthread_cond_destroy(&state->decode_cond_decoded);
+	for(uint8_t i = 0; i < PT_DECODE_RING_SLOTS; i++){
+		free(state->decode_ring[i].data);
+		state->decode_ring[i].data = NULL;
+		state->decode_ring[i].capacity = 0;
+	}
 }
 
 struct vmx_pt_filter_iprs {
@@ -311,10 +1131,9 @@ struct vmx_pt_filter_iprs {
 	__u64 b;
 };
 
-pthread_mutex_t pt_dump_mutex = PTHREAD_MUTEX_INITIALIZER;
-
 void pt_pre_kvm_run(CPUState *cpu){
-	pthread_mutex_lock(&pt_dump_mutex);
+	pt_vcpu_state_t* state = cpu->pt_state;
+	pthread_mutex_lock(&state->dump_mutex);
 	int ret;
 	struct vmx_pt_filter_iprs filter_iprs;
 
@@ -378,11 +1197,12 @@ void pt_pre_kvm_run(CPUState *cpu){
 		cpu->pt_cmd = 0;
 		cpu->pt_ret = 0;
 	}
-	pthread_mutex_unlock(&pt_dump_mutex);
+	pthread_mutex_unlock(&state->dump_mutex);
 }
 
 void pt_handle_overflow(CPUState *cpu){
-	pthread_mutex_lock(&pt_dump_mutex);
+	pt_vcpu_state_t* state = cpu->pt_state;
+	pthread_mutex_lock(&state->dump_mutex);
 	//printf("%s\n", __func__);
 	int overflow = ioctl(cpu->pt_fd, KVM_VMX_PT_CHECK_TOPA_OVERFLOW, (unsigned long)0);
 	if (overflow > 0){
@@ -390,7 +1210,7 @@ void pt_handle_overflow(CPUState *cpu){
 		pt_dump(cpu, overflow);
 	}  
 
-	pthread_mutex_unlock(&pt_dump_mutex);
+	pthread_mutex_unlock(&state->dump_mutex);
 }
 
 void pt_post_kvm_run(CPUState *cpu){
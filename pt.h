@@ -9,11 +9,47 @@
 #ifndef PT_H
 #define PT_H
 
+typedef struct pt_bench_s{
+	uint64_t bytes;
+	uint64_t packets;
+	uint64_t nsec;
+} pt_bench_t;
+
+typedef struct pt_disasm_bench_s{
+	uint64_t bytes;
+	uint64_t instructions;	/* decoded by capstone, all iterations */
+	uint64_t capstone_nsec;
+	uint64_t table_nsec;
+	uint64_t fallbacks;		/* per image */
+	uint64_t mismatches;
+} pt_disasm_bench_t;
+
+typedef struct pt_decoder_stats_s{
+	uint64_t cofi_nodes;
+	uint64_t cofi_bytes;
+	uint64_t lookup_bytes;
+	uint64_t cache_bytes;
+	uint64_t unknown_packets;
+} pt_decoder_stats_t;
+
 void pt_sync(void);
 void pt_reset_bitmap(void);
 void pt_reset_coverage_map(void);
 void pt_setup_bitmap(void* ptr);
 void pt_setup_coverage_map(void* ptr);
+void pt_setup_cfg_cache(const char* dir);
+void pt_setup_timing_profile(const char* dir);
+void pt_setup_predisassembly(uint32_t threads);
+void pt_setup_parallel_decode(uint32_t threads);
+void pt_setup_async_decode(void);
+void pt_setup_ovf_resync(void);
+void pt_setup_shared_memory(void);
+void pt_setup_virgin_map(void);
+void pt_setup_trace_image(uint64_t ip_a, uint64_t ip_b, uint8_t* image, uint64_t size);
+
+void pt_dirty_stats(uint64_t* bitmap_bytes, uint64_t* coverage_map_bytes);
+bool pt_novelty(uint8_t* verdict);
+void pt_bitmap_foreach(void (*fn)(void* opaque, uint32_t index, uint8_t count), void* opaque);
 
 void pt_turn_on_coverage_map(void);
 void pt_turn_off_coverage_map(void);
@@ -25,10 +61,15 @@ int pt_disable_ip_filtering(CPUState *cpu, uint8_t addrn, bool hmp_mode);
 int pt_set_cr3(CPUState *cpu, uint64_t val, bool hmp_mode);
 
 void pt_kvm_init(CPUState *cpu);
+void pt_kvm_destroy(CPUState *cpu);
 void pt_pre_kvm_run(CPUState *cpu);
 void pt_post_kvm_run(CPUState *cpu);
 
 void pt_handle_overflow(CPUState *cpu);
 void pt_dump(CPUState *cpu, int bytes);
-void pt_bitmap(uint64_t addr);
+void pt_decode_fence(CPUState *cpu);
+void pt_bitmap(void* opaque, uint64_t addr);
+bool pt_decoder_stats(CPUState *cpu, uint8_t addrn, pt_decoder_stats_t* stats);
+int pt_decoder_bench(CPUState *cpu, uint8_t addrn, const char* file, uint32_t iterations, pt_bench_t* res);
+int pt_disassembler_bench(const char* file, uint8_t word_width, uint32_t iterations, pt_disasm_bench_t* res);
 #endif
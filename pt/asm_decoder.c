@@ -43,19 +43,23 @@ void asm_decoder_compile(void){
 		char *str_displace_const = NULL;
 		const char* str_const = "^(-)?(0x[a-f0-9]+|[0-9]+)$";
 		char *str_reg = NULL;
-		assert(-1 != asprintf(&str_displace,  "^%s (%s:)?\\[(%s ([+\\-]) )?%s(\\*%s)?( ([+\\-]) %s)?\\]$",ptr, segreg, reg, reg, scale, integer));
-		assert(-1 != asprintf(&str_displace_const, "^%s (%s:)?\\[%s\\]$", ptr, segreg, integer));
-		assert(-1 != asprintf(&str_reg, "^%s$", reg ));
+		bool failed = false;
+
+		failed |= -1 == asprintf(&str_displace,  "^%s (%s:)?\\[(%s ([+\\-]) )?%s(\\*%s)?( ([+\\-]) %s)?\\]$",ptr, segreg, reg, reg, scale, integer);
+		failed |= -1 == asprintf(&str_displace_const, "^%s (%s:)?\\[%s\\]$", ptr, segreg, integer);
+		failed |= -1 == asprintf(&str_reg, "^%s$", reg );
+		assert(!failed);
 
 		op_regex_reg = malloc(sizeof(regex_t));
 		op_regex_const = malloc(sizeof(regex_t));
 		op_regex_mem_const = malloc(sizeof(regex_t));
 		op_regex_mem = malloc(sizeof(regex_t));
 
-		assert(!regcomp(op_regex_reg, str_reg, REG_EXTENDED));
-		assert(!regcomp(op_regex_const, str_const, REG_EXTENDED));
-		assert(!regcomp(op_regex_mem, str_displace, REG_EXTENDED));
-		assert(!regcomp(op_regex_mem_const, str_displace_const, REG_EXTENDED));
+		failed |= !!regcomp(op_regex_reg, str_reg, REG_EXTENDED);
+		failed |= !!regcomp(op_regex_const, str_const, REG_EXTENDED);
+		failed |= !!regcomp(op_regex_mem, str_displace, REG_EXTENDED);
+		failed |= !!regcomp(op_regex_mem_const, str_displace_const, REG_EXTENDED);
+		assert(!failed);
 
 		free(str_reg);
 		free(str_displace);
@@ -0,0 +1,128 @@
+/*
+ * *
+ * Sergej Schumilo, 2019 <sergej@schumilo.de>
+ * Cornelius Aschermann, 2019 <cornelius.aschermann@rub.de>
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/atomic.h"
+#include "cpu.h"
+#include "pt.h"
+#include "pt/batch.h"
+#include "pt/interface.h"
+#include "pt/novelty.h"
+
+static struct {
+	batch_t* shm;
+	bool active;
+	uint32_t count;
+	uint32_t next;				/* input loaded by the next batch_step() */
+} batch = {NULL, false, 0, 0};
+
+void batch_init(batch_t* shm){
+	QEMU_BUILD_BUG_ON(sizeof(batch_t) > BATCH_SIZE);
+
+	memset(shm, 0x00, offsetof(batch_t, inputs));
+	shm->version = BATCH_VERSION;
+	batch.shm = shm;
+	/* the fuzzer must not queue inputs before the header is reset */
+	atomic_store_release(&shm->magic, BATCH_MAGIC);
+}
+
+/* the fuzzer owns the descriptors: keep each input within data and the payload region */
+static void batch_load(uint8_t* payload, uint32_t i){
+	batch_input_t* input = &batch.shm->inputs[i];
+	uint32_t offset = MIN(input->offset, BATCH_DATA_SIZE);
+	uint32_t len = MIN(MIN(input->size, BATCH_DATA_SIZE - offset), PAYLOAD_SIZE - PAYLOAD_LEN_SIZE);
+
+	memcpy(payload, &len, PAYLOAD_LEN_SIZE);
+	memcpy(payload + PAYLOAD_LEN_SIZE, batch.shm->data + offset, len);
+}
+
+static void batch_add_edge(void* opaque, uint32_t index, uint8_t count){
+	batch_result_t* result = opaque;
+
+	if(batch.shm->edges_used >= BATCH_MAX_EDGES){
+		result->flags |= BATCH_RESULT_TRUNCATED;
+		return;
+	}
+	batch.shm->edges[batch.shm->edges_used].index = index;
+	batch.shm->edges[batch.shm->edges_used].count = count;
+	batch.shm->edges_used++;
+	result->edge_count++;
+}
+
+static batch_result_t* batch_result(uint8_t status){
+	batch_result_t* result = &batch.shm->results[batch.next - 1];
+
+	memset(result, 0x00, sizeof(batch_result_t));
+	result->status = status;
+	result->novelty = KAFL_PROTO_NOVELTY_NONE;
+	result->edge_offset = batch.shm->edges_used;
+	return result;
+}
+
+static void batch_publish(void){
+	/* pairs with the acquire of the fuzzer once it got woken up */
+	atomic_store_release(&batch.shm->done, batch.next);
+}
+
+void batch_begin(uint8_t* payload){
+	if(!batch.shm || !(batch.count = atomic_load_acquire(&batch.shm->count))){
+		return;
+	}
+	batch.count = MIN(batch.count, BATCH_MAX_INPUTS);
+	batch.shm->count = 0;
+	batch.shm->done = 0;
+	batch.shm->edges_used = 0;
+	batch_load(payload, 0);
+	batch.next = 1;
+	batch.active = true;
+}
+
+bool batch_step(CPUState *cpu, uint8_t* payload){
+	batch_result_t* result;
+	uint8_t verdict;
+
+	if(!batch.active){
+		return false;
+	}
+
+	/* pt_sync() ran on RELEASE, the bitmap holds this input only */
+	pt_decode_fence(cpu);
+	if(cpu->intel_pt_run_trashed){
+		result = batch_result(KAFL_PROTO_PT_TRASHED);
+	}
+	else {
+		result = batch_result(cpu->intel_pt_run_gaps ? KAFL_PROTO_PT_PARTIAL : KAFL_PROTO_ACQUIRE);
+		if(pt_novelty(&verdict)){
+			result->novelty = KAFL_PROTO_NOVELTY_NONE + verdict;
+		}
+	}
+	cpu->intel_pt_run_trashed = false;
+	cpu->intel_pt_run_gaps = 0;
+	pt_bitmap_foreach(batch_add_edge, result);
+	batch_publish();
+
+	if(batch.next == batch.count){
+		batch.active = false;
+		return false;
+	}
+	batch_load(payload, batch.next++);
+	return true;
+}
+
+void batch_abort(uint8_t status){
+	if(!batch.active){
+		return;
+	}
+	batch_result(status);
+	batch_publish();
+	batch.active = false;
+}
+
+void batch_cancel(void){
+	batch.active = false;
+}
@@ -0,0 +1,87 @@
+/*
+ * *
+ * Sergej Schumilo, 2019 <sergej@schumilo.de>
+ * Cornelius Aschermann, 2019 <cornelius.aschermann@rub.de>
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "qemu/osdep.h"
+
+/*
+ * Batched execution: before its RELEASE the fuzzer queues up to
+ * BATCH_MAX_INPUTS inputs and sets count. QEMU consumes count and hands the
+ * inputs to the agent on each NEXT_PAYLOAD, without a round trip to the
+ * fuzzer. For each finished input it writes a result with
+ *
+ *  status		KAFL_PROTO_ACQUIRE, _PT_PARTIAL, _PT_TRASHED, _CRASH, _KASAN or _TIMEOUT
+ *  novelty		KAFL_PROTO_NOVELTY_* (NONE without virgin_map=on)
+ *  edges		the non-zero bitmap bytes of the run, in the edges area
+ *
+ * and bumps done. The fuzzer is woken once per batch: by the usual reply to
+ * the NEXT_PAYLOAD after the last input, or by the crash / kasan / timeout
+ * message of the input that ended the batch early. The shared bitmap only
+ * holds the coverage of the last input. count left at 0 keeps the old
+ * one input per handshake protocol. The layout is shared with the fuzzer
+ * and must not change without bumping the version.
+ */
+#define BATCH_MAGIC				0x686374626c66616bULL	/* "kaflbtch" */
+#define BATCH_VERSION			1
+#define BATCH_MAX_INPUTS		1024
+#define BATCH_MAX_EDGES			(512 << 10)
+#define BATCH_DATA_SIZE			(8 << 20)
+#define BATCH_SIZE				(16 << 20)
+
+#define BATCH_RESULT_TRUNCATED	1	/* the edges area ran full, the edge list is incomplete */
+
+typedef struct batch_input_s{
+	uint32_t offset;			/* into data */
+	uint32_t size;
+} batch_input_t;
+
+typedef struct batch_result_s{
+	uint8_t status;
+	uint8_t novelty;
+	uint8_t flags;
+	uint8_t pad;
+	uint32_t edge_offset;		/* into edges */
+	uint32_t edge_count;
+} batch_result_t;
+
+typedef struct batch_edge_s{
+	uint32_t index;				/* bitmap offset */
+	uint8_t count;
+	uint8_t pad[3];
+} batch_edge_t;
+
+typedef struct batch_s{
+	uint64_t magic;
+	uint32_t version;
+	uint32_t count;				/* fuzzer: inputs queued, reset by QEMU when the batch starts */
+	uint32_t done;				/* QEMU: results written */
+	uint32_t edges_used;
+	uint8_t pad[40];
+	batch_input_t inputs[BATCH_MAX_INPUTS];
+	batch_result_t results[BATCH_MAX_INPUTS];
+	batch_edge_t edges[BATCH_MAX_EDGES];
+	uint8_t data[BATCH_DATA_SIZE];
+} batch_t;
+
+void batch_init(batch_t* shm);
+
+/* picks up the inputs queued with the RELEASE and loads the first one into payload */
+void batch_begin(uint8_t* payload);
+
+/* records the input which just finished and loads the next one, false once the batch is done */
+bool batch_step(CPUState *cpu, uint8_t* payload);
+
+/* the running input ended the batch with status (crash, kasan, timeout) */
+void batch_abort(uint8_t status);
+
+/* the VM was reloaded, the rest of the batch is dropped without a result */
+void batch_cancel(void);
+
+#endif
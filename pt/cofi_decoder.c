@@ -0,0 +1,384 @@
+/*
+ * *
+ * Sergej Schumilo, 2019 <sergej@schumilo.de>
+ * Cornelius Aschermann, 2019 <cornelius.aschermann@rub.de>
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include "pt/cofi_decoder.h"
+
+#define MAX_INSN_LENGTH		15
+
+/* operand encoding of an opcode */
+#define M			0x0001	/* ModR/M (+ SIB + displacement) */
+#define I8			0x0002	/* imm8 */
+#define I16			0x0004	/* imm16 */
+#define IZ			0x0008	/* imm16/32 (operand size) */
+#define IV			0x0010	/* imm16/32/64 (operand size, REX.W) */
+#define MO			0x0020	/* moffs (address size) */
+#define R8			0x0040	/* rel8 */
+#define RZ			0x0080	/* rel16/32 */
+#define FP			0x0100	/* far pointer: imm16/32 + selector */
+#define G3			0x0200	/* group 3: immediate for /0 and /1 only */
+#define PX			0x0400	/* legacy prefix */
+#define I64			0x0800	/* invalid (or re-purposed) in 64-bit mode */
+#define FB			0x1000	/* left to capstone */
+
+static const uint16_t one_byte_map[256] = {
+	/* 0x00 */ M, M, M, M, I8, IZ, I64, I64, M, M, M, M, I8, IZ, I64, 0,
+	/* 0x10 */ M, M, M, M, I8, IZ, I64, I64, M, M, M, M, I8, IZ, I64, I64,
+	/* 0x20 */ M, M, M, M, I8, IZ, PX, I64, M, M, M, M, I8, IZ, PX, I64,
+	/* 0x30 */ M, M, M, M, I8, IZ, PX, I64, M, M, M, M, I8, IZ, PX, I64,
+	/* 0x40 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	/* 0x50 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	/* 0x60 */ I64, I64, FB, M, PX, PX, PX, PX, IZ, M|IZ, I8, M|I8, 0, 0, 0, 0,
+	/* 0x70 */ R8, R8, R8, R8, R8, R8, R8, R8, R8, R8, R8, R8, R8, R8, R8, R8,
+	/* 0x80 */ M|I8, M|IZ, M|I8|I64, M|I8, M, M, M, M, M, M, M, M, M, M, M, M,
+	/* 0x90 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, FP|I64, 0, 0, 0, 0, 0,
+	/* 0xa0 */ MO, MO, MO, MO, 0, 0, 0, 0, I8, IZ, 0, 0, 0, 0, 0, 0,
+	/* 0xb0 */ I8, I8, I8, I8, I8, I8, I8, I8, IV, IV, IV, IV, IV, IV, IV, IV,
+	/* 0xc0 */ M|I8, M|I8, I16, 0, M, M, M|I8, M|IZ, I16|I8, 0, I16, 0, 0, I8, I64, 0,
+	/* 0xd0 */ M, M, M, M, I8|I64, I8|I64, FB, 0, M, M, M, M, M, M, M, M,
+	/* 0xe0 */ R8, R8, R8, R8, I8, I8, I8, I8, RZ, RZ, FP|I64, R8, 0, 0, 0, 0,
+	/* 0xf0 */ PX, 0, PX, PX, 0, 0, M|G3, M|G3, 0, 0, 0, 0, 0, 0, M, M,
+};
+
+static const uint16_t two_byte_map[256] = {
+	/* 0x00 */ M, M, M, M, FB, 0, 0, 0, 0, 0, FB, 0, FB, M, 0, FB,
+	/* 0x10 */ M, M, M, M, M, M, M, M, M, M, M, M, M, M, M, M,
+	/* 0x20 */ M, M, M, M, FB, FB, FB, FB, M, M, M, M, M, M, M, M,
+	/* 0x30 */ 0, 0, 0, 0, 0, 0, FB, 0, FB, FB, FB, FB, FB, FB, FB, FB,
+	/* 0x40 */ M, M, M, M, M, M, M, M, M, M, M, M, M, M, M, M,
+	/* 0x50 */ M, M, M, M, M, M, M, M, M, M, M, M, M, M, M, M,
+	/* 0x60 */ M, M, M, M, M, M, M, M, M, M, M, M, M, M, M, M,
+	/* 0x70 */ M|I8, M|I8, M|I8, M|I8, M, M, M, 0, M, M, FB, FB, M, M, M, M,
+	/* 0x80 */ RZ, RZ, RZ, RZ, RZ, RZ, RZ, RZ, RZ, RZ, RZ, RZ, RZ, RZ, RZ, RZ,
+	/* 0x90 */ M, M, M, M, M, M, M, M, M, M, M, M, M, M, M, M,
+	/* 0xa0 */ 0, 0, 0, M, M|I8, M, FB, FB, 0, 0, 0, M, M|I8, M, M, M,
+	/* 0xb0 */ M, M, M, M, M, M, M, M, M, M, M|I8, M, M, M, M, M,
+	/* 0xc0 */ M, M, M|I8, M, M|I8, M|I8, M|I8, M, 0, 0, 0, 0, 0, 0, 0, 0,
+	/* 0xd0 */ M, M, M, M, M, M, M, M, M, M, M, M, M, M, M, M,
+	/* 0xe0 */ M, M, M, M, M, M, M, M, M, M, M, M, M, M, M, M,
+	/* 0xf0 */ M, M, M, M, M, M, M, M, M, M, M, M, M, M, M, M,
+};
+
+typedef struct prefix_state_s{
+	bool opsize;	/* 0x66 */
+	bool addrsize;	/* 0x67 */
+	bool rep;		/* 0xf3 */
+	bool repne;		/* 0xf2 */
+	bool rex_w;
+} prefix_state_t;
+
+static bool modrm_length(const uint8_t* code, size_t code_size, size_t* len, bool addr16){
+	uint8_t modrm, mod, rm;
+
+	if (*len >= code_size){
+		return false;
+	}
+	modrm = code[(*len)++];
+	mod = modrm >> 6;
+	rm = modrm & 7;
+
+	if (mod == 3){
+		return true;
+	}
+
+	if (addr16){
+		if ((mod == 0 && rm == 6) || mod == 2){
+			*len += 2;
+		} else if (mod == 1){
+			*len += 1;
+		}
+		return true;
+	}
+
+	if (rm == 4){
+		if (*len >= code_size){
+			return false;
+		}
+		if (mod == 0 && (code[*len] & 7) == 5){
+			*len += 4;
+		}
+		(*len)++;
+	}
+	if ((mod == 0 && rm == 5) || mod == 2){
+		*len += 4;
+	} else if (mod == 1){
+		*len += 1;
+	}
+	return true;
+}
+
+static inline uint8_t immediate_length(uint16_t flags, prefix_state_t* p, bool mode64, uint8_t opcode, uint8_t modrm){
+	uint8_t len = 0;
+	uint8_t z = (p->opsize && !p->rex_w) ? 2 : 4;
+
+	if (flags & G3){
+		if (((modrm >> 3) & 7) < 2){
+			len += (opcode & 1) ? z : 1;
+		}
+	}
+	if (flags & I8){
+		len += 1;
+	}
+	if (flags & I16){
+		len += 2;
+	}
+	if (flags & IZ){
+		len += z;
+	}
+	if (flags & IV){
+		len += p->rex_w ? 8 : z;
+	}
+	if (flags & MO){
+		len += mode64 ? (p->addrsize ? 4 : 8) : (p->addrsize ? 2 : 4);
+	}
+	if (flags & FP){
+		len += z + 2;
+	}
+	return len;
+}
+
+static cofi_type one_byte_cofi(uint8_t opcode, uint8_t modrm){
+	switch(opcode){
+		case 0x70 ... 0x7f:
+		case 0xe0 ... 0xe3:
+			return COFI_TYPE_CONDITIONAL_BRANCH;
+		case 0xe8:
+		case 0xe9:
+		case 0xeb:
+			return COFI_TYPE_UNCONDITIONAL_DIRECT_BRANCH;
+		case 0xc2:
+		case 0xc3:
+			return COFI_TYPE_NEAR_RET;
+		case 0x9a:
+		case 0xca:
+		case 0xcb:
+		case 0xcc:
+		case 0xcd:
+		case 0xce:
+		case 0xcf:
+		case 0xea:
+		case 0xf1:
+			return COFI_TYPE_FAR_TRANSFERS;
+		case 0xff:
+			switch((modrm >> 3) & 7){
+				case 2:
+				case 4:
+					return COFI_TYPE_INDIRECT_BRANCH;
+				case 3:
+				case 5:
+					return COFI_TYPE_FAR_TRANSFERS;
+			}
+			break;
+	}
+	return NO_COFI_TYPE;
+}
+
+static cofi_type two_byte_cofi(uint8_t opcode, uint8_t modrm){
+	switch(opcode){
+		case 0x80 ... 0x8f:
+			return COFI_TYPE_CONDITIONAL_BRANCH;
+		case 0x05:	/* syscall */
+		case 0x07:	/* sysret */
+		case 0x34:	/* sysenter */
+		case 0x35:	/* sysexit */
+			return COFI_TYPE_FAR_TRANSFERS;
+		case 0x01:	/* vmlaunch / vmresume */
+			if (modrm == 0xc2 || modrm == 0xc3){
+				return COFI_TYPE_FAR_TRANSFERS;
+			}
+			break;
+	}
+	return NO_COFI_TYPE;
+}
+
+/* VEX encoded instructions: never control flow, only the length matters */
+static bool decode_vex(const uint8_t* code, size_t code_size, size_t len, bool mode64, decoded_insn_t* res){
+	uint8_t map, opcode;
+	uint16_t flags;
+
+	if (code[len] == 0xc5){
+		map = 1;
+		len += 2;
+	} else {
+		if (len + 1 >= code_size){
+			return false;
+		}
+		map = code[len + 1] & 0x1f;
+		len += 3;
+	}
+	if (len >= code_size){
+		return false;
+	}
+	opcode = code[len++];
+
+	switch(map){
+		case 1:
+			flags = two_byte_map[opcode];
+			if (opcode == 0x77){	/* vzeroupper / vzeroall */
+				break;
+			}
+			if (!(flags & M) || (flags & (RZ | FB))){
+				return false;
+			}
+			if (!modrm_length(code, code_size, &len, false)){
+				return false;
+			}
+			len += (flags & I8) ? 1 : 0;
+			break;
+		case 2:
+		case 3:
+			if (!modrm_length(code, code_size, &len, false)){
+				return false;
+			}
+			len += (map == 3) ? 1 : 0;
+			break;
+		default:
+			return false;
+	}
+
+	if (len > code_size || len > MAX_INSN_LENGTH){
+		return false;
+	}
+	res->size = len;
+	res->type = NO_COFI_TYPE;
+	res->target_addr = 0;
+	return true;
+}
+
+bool cofi_decoder_decode(const uint8_t* code, size_t code_size, uint64_t address, bool mode64, decoded_insn_t* res){
+	prefix_state_t p = {false, false, false, false, false};
+	size_t len = 0;
+	size_t modrm_pos = 0;
+	uint8_t opcode;
+	uint8_t modrm = 0;
+	uint16_t flags;
+	bool two_byte = false;
+	int64_t disp = 0;
+
+	res->address = address;
+
+	/* legacy prefixes, REX has to be the last one */
+	while (len < code_size){
+		opcode = code[len];
+		if (one_byte_map[opcode] & PX){
+			p.opsize |= opcode == 0x66;
+			p.addrsize |= opcode == 0x67;
+			p.rep |= opcode == 0xf3;
+			p.repne |= opcode == 0xf2;
+			p.rex_w = false;
+			len++;
+		} else if (mode64 && (opcode & 0xf0) == 0x40){
+			p.rex_w = !!(opcode & 0x08);
+			len++;
+		} else {
+			break;
+		}
+		if (len >= MAX_INSN_LENGTH){
+			return false;
+		}
+	}
+	if (len >= code_size){
+		return false;
+	}
+
+	opcode = code[len];
+
+	/* VEX in 64-bit mode, LES / LDS with a memory operand otherwise */
+	if ((opcode == 0xc4 || opcode == 0xc5) && (mode64 || (len + 1 < code_size && (code[len + 1] & 0xc0) == 0xc0))){
+		return decode_vex(code, code_size, len, mode64, res);
+	}
+	/* XOP */
+	if (opcode == 0x8f && len + 1 < code_size && (code[len + 1] & 0x38)){
+		return false;
+	}
+
+	len++;
+	if (opcode == 0x0f){
+		if (len >= code_size){
+			return false;
+		}
+		opcode = code[len++];
+		two_byte = true;
+		if (opcode == 0x38 || opcode == 0x3a){
+			/* three byte maps: ModR/M everywhere, imm8 for 0f 3a */
+			flags = M | (opcode == 0x3a ? I8 : 0);
+			if (len >= code_size){
+				return false;
+			}
+			opcode = code[len++];
+			two_byte = false;
+			modrm_pos = len;
+			if (!modrm_length(code, code_size, &len, p.addrsize && !mode64)){
+				return false;
+			}
+			len += immediate_length(flags, &p, mode64, opcode, 0);
+			if (len > code_size || len > MAX_INSN_LENGTH){
+				return false;
+			}
+			res->size = len;
+			res->type = NO_COFI_TYPE;
+			res->target_addr = 0;
+			return true;
+		}
+		flags = two_byte_map[opcode];
+		/* SSE4a extrq / insertq, jmpe */
+		if (((opcode == 0x78 || opcode == 0x79) && (p.opsize || p.repne)) || (opcode == 0xb8 && !p.rep)){
+			return false;
+		}
+	} else {
+		flags = one_byte_map[opcode];
+		if (mode64 && (flags & I64)){
+			return false;
+		}
+	}
+
+	if (flags & FB){
+		return false;
+	}
+
+	if (flags & M){
+		modrm_pos = len;
+		if (!modrm_length(code, code_size, &len, p.addrsize && !mode64)){
+			return false;
+		}
+		modrm = code[modrm_pos];
+	}
+
+	len += immediate_length(flags, &p, mode64, opcode, modrm);
+
+	if (flags & (R8 | RZ)){
+		/* 16-bit branch targets are truncated to IP, leave them to capstone */
+		if (p.opsize){
+			return false;
+		}
+		if (len + ((flags & R8) ? 1 : 4) > code_size){
+			return false;
+		}
+		if (flags & R8){
+			disp = (int8_t)code[len];
+			len += 1;
+		} else {
+			disp = (int32_t)(code[len] | (code[len + 1] << 8) | (code[len + 2] << 16) | ((uint32_t)code[len + 3] << 24));
+			len += 4;
+		}
+	}
+
+	if (len > code_size || len > MAX_INSN_LENGTH){
+		return false;
+	}
+
+	res->size = len;
+	res->type = two_byte ? two_byte_cofi(opcode, modrm) : one_byte_cofi(opcode, modrm);
+	res->target_addr = 0;
+	if (res->type == COFI_TYPE_CONDITIONAL_BRANCH || res->type == COFI_TYPE_UNCONDITIONAL_DIRECT_BRANCH){
+		res->target_addr = address + len + disp;
+		if (!mode64){
+			res->target_addr &= 0xffffffffULL;
+		}
+	}
+	return true;
+}
@@ -0,0 +1,32 @@
+/*
+ * *
+ * Sergej Schumilo, 2019 <sergej@schumilo.de>
+ * Cornelius Aschermann, 2019 <cornelius.aschermann@rub.de>
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+
+#ifndef COFI_DECODER_H
+#define COFI_DECODER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "pt/disassembler.h"
+
+typedef struct decoded_insn_s{
+	uint64_t address;
+	uint64_t target_addr;	/* direct branches only */
+	uint16_t size;
+	cofi_type type;
+} decoded_insn_t;
+
+/*
+ * Table-driven x86 length decoder which only classifies control flow
+ * instructions. Returns false for encodings it leaves to capstone (VEX/EVEX
+ * edge cases, 3DNow!, opcodes which are invalid in the current mode, ...).
+ */
+bool cofi_decoder_decode(const uint8_t* code, size_t code_size, uint64_t address, bool mode64, decoded_insn_t* res);
+
+#endif
@@ -43,6 +43,7 @@
  */
 
 #define _GNU_SOURCE 1
+#include <pthread.h>
 #include "pt/decoder.h"
 
 #define LEFT(x) ((end - p) >= (x))
@@ -65,7 +66,7 @@
 #define PT_PKT_CBR_BYTE0		PT_PKT_GENERIC_BYTE0
 #define PT_PKT_CBR_BYTE1		0b00000011
 
-#define PT_PKT_OVF_LEN			8
+#define PT_PKT_OVF_LEN			2
 #define PT_PKT_OVF_BYTE0		PT_PKT_GENERIC_BYTE0
 #define PT_PKT_OVF_BYTE1		0b11110011
 
@@ -90,6 +91,15 @@
 #define PT_PKT_VMCS_BYTE0		PT_PKT_GENERIC_BYTE0
 #define PT_PKT_VMCS_BYTE1		0b11001000
 
+#define PT_PKT_TSC_LEN			8
+#define PT_PKT_TSC_BYTE0		0b00011001
+
+#define PT_PKT_MTC_LEN			2
+#define PT_PKT_MTC_BYTE0		0b01011001
+
+#define PT_PKT_CYC_MASK			0b00000011
+#define PT_PKT_CYC_EXP			0b00000100
+
 #define	PT_PKT_TS_LEN			2
 #define PT_PKT_TS_BYTE0			PT_PKT_GENERIC_BYTE0
 #define PT_PKT_TS_BYTE1			0b10000011
@@ -115,16 +125,220 @@
 #define TIP_VALUE_6				(0x6<<5)
 #define TIP_VALUE_7				(0x7<<5)
 
+/* dispatch table helpers, see decode_buffer() */
+#define TIP_LABELS(byte0, label) \
+	[(byte0) + TIP_VALUE_0] = label, [(byte0) + TIP_VALUE_1] = label, \
+	[(byte0) + TIP_VALUE_2] = label, [(byte0) + TIP_VALUE_3] = label, \
+	[(byte0) + TIP_VALUE_4] = label, [(byte0) + TIP_VALUE_5] = label, \
+	[(byte0) + TIP_VALUE_6] = label, [(byte0) + TIP_VALUE_7] = label
+
+/* short TNT packets: every even first byte except PAD (0x00) and 0x02 */
+#define TNT8_LABELS(base, label) \
+	[(base) + 0x0] = label, [(base) + 0x2] = label, \
+	[(base) + 0x4] = label, [(base) + 0x6] = label, \
+	[(base) + 0x8] = label, [(base) + 0xa] = label, \
+	[(base) + 0xc] = label, [(base) + 0xe] = label
+
+/* CYC packets: every first byte with both low bits set */
+#define CYC_LABELS(base, label) \
+	[(base) + 0x3] = label, [(base) + 0x7] = label, \
+	[(base) + 0xb] = label, [(base) + 0xf] = label
+
+/* stop decoding (truncated packet) if fewer than x bytes are left */
+#define NEED(x) do { if (unlikely(!LEFT(x))) goto done; } while (0)
+
+#define DISPATCH() \
+	do { \
+		if (unlikely(p >= end)) goto done; \
+		packets++; \
+		goto *dispatch_table[*p]; \
+	} while (0)
+
 //#define DEBUG
 
 static decoder_state_machine_t* decoder_statemachine_new(void);
 static void decoder_statemachine_reset(decoder_state_machine_t* self);
+static void decoder_pool_destroy(decoder_pool_t* pool);
 
 static uint8_t psb[16] = {
 	0x02, 0x82, 0x02, 0x82, 0x02, 0x82, 0x02, 0x82,
 	0x02, 0x82, 0x02, 0x82, 0x02, 0x82, 0x02, 0x82
 };
 
+/* ===== sync point and padding scan ===== */
+
+/* locate the first PSB; memchr() is considerably faster than memmem() here */
+static uint8_t* find_psb_scalar(uint8_t* p, uint8_t* end){
+	while (end - p >= PT_PKT_PSB_LEN) {
+		p = memchr(p, PT_PKT_PSB_BYTE0, (end - p) - (PT_PKT_PSB_LEN - 1));
+		if (!p) {
+			return NULL;
+		}
+		if (!memcmp(p, psb, PT_PKT_PSB_LEN)) {
+			return p;
+		}
+		p++;
+	}
+	return NULL;
+}
+
+/* returns the first non-PAD byte (or end) */
+static uint8_t* skip_pad_scalar(uint8_t* p, uint8_t* end){
+	while (end - p >= 8 && !*(uint64_t *)p) {
+		p += 8;
+	}
+	while (p < end && !(*p)) {
+		p++;
+	}
+	return p;
+}
+
+/* the vector variants leave the tail to the scalar versions */
+#if defined(CONFIG_AVX2_OPT) || defined(__SSE2__)
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("sse2")
+#endif
+#include <emmintrin.h>
+
+static uint8_t* skip_pad_sse2(uint8_t* p, uint8_t* end){
+	const __m128i zero = _mm_setzero_si128();
+
+	while (end - p >= 16) {
+		uint32_t mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((__m128i *)p), zero)) ^ 0xffff;
+		if (mask) {
+			return p + __builtin_ctz(mask);
+		}
+		p += 16;
+	}
+	return skip_pad_scalar(p, end);
+}
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC pop_options
+#endif
+#endif
+
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
+
+/* 
+ * memchr() stops at every 0x02, which starts most extended packets. A PSB (02 82
+ * repeated) however fully covers at least one 8-byte aligned qword, which then
+ * holds one of two values: only compare aligned qwords and look for the PSB
+ * around a matching one.
+ */
+#define PSB_QWORD_EVEN			0x8202820282028202ULL
+#define PSB_QWORD_ODD			0x0282028202820282ULL
+
+static inline uint8_t* psb_at_qword(uint8_t* p, uint8_t* q, uint8_t* end){
+	for (uint8_t* c = (q - p >= 7) ? q - 7 : p; c <= q && end - c >= PT_PKT_PSB_LEN; c++) {
+		if (!memcmp(c, psb, PT_PKT_PSB_LEN)) {
+			return c;
+		}
+	}
+	return NULL;
+}
+
+static inline uint32_t psb_qword_mask(uint8_t* q, __m256i even, __m256i odd){
+	__m256i v = _mm256_loadu_si256((__m256i *)q);
+	return _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi64(v, even), _mm256_cmpeq_epi64(v, odd)));
+}
+
+static uint8_t* psb_in_mask(uint8_t* p, uint8_t* q, uint32_t mask, uint8_t* end){
+	uint8_t* res;
+
+	while (mask) {
+		uint32_t lane = __builtin_ctz(mask) >> 3;
+		res = psb_at_qword(p, q + lane * 8, end);
+		if (res) {
+			return res;
+		}
+		mask &= ~(0xffU << (lane * 8));
+	}
+	return NULL;
+}
+
+static uint8_t* find_psb_avx2(uint8_t* p, uint8_t* end){
+	const __m256i even = _mm256_set1_epi64x(PSB_QWORD_EVEN);
+	const __m256i odd = _mm256_set1_epi64x(PSB_QWORD_ODD);
+	uint8_t* q = (uint8_t*)(((uintptr_t)p + 7) & ~(uintptr_t)7);
+	uint8_t* res;
+
+	/* keep the hit handling out of line, q must not depend on the compare */
+	for (; end - q >= 64; q += 64) {
+		uint32_t lo = psb_qword_mask(q, even, odd);
+		uint32_t hi = psb_qword_mask(q + 32, even, odd);
+		if (likely(!(lo | hi))) {
+			continue;
+		}
+		if ((res = psb_in_mask(p, q, lo, end)) || (res = psb_in_mask(p, q + 32, hi, end))) {
+			return res;
+		}
+	}
+	/* PSBs starting before q - 7 cover an aligned qword below q and were checked */
+	return find_psb_scalar((q - p >= 7) ? q - 7 : p, end);
+}
+
+static uint8_t* skip_pad_avx2(uint8_t* p, uint8_t* end){
+	const __m256i zero = _mm256_setzero_si256();
+
+	/* long runs: 64 bytes per iteration */
+	while (end - p >= 64) {
+		__m256i v = _mm256_or_si256(_mm256_loadu_si256((__m256i *)p), _mm256_loadu_si256((__m256i *)(p + 32)));
+		if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, zero)) != -1) {
+			break;
+		}
+		p += 64;
+	}
+	while (end - p >= 32) {
+		uint32_t mask = ~_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((__m256i *)p), zero));
+		if (mask) {
+			return p + __builtin_ctz(mask);
+		}
+		p += 32;
+	}
+	return skip_pad_sse2(p, end);
+}
+#pragma GCC pop_options
+#endif /* CONFIG_AVX2_OPT */
+
+#if defined(CONFIG_AVX2_OPT) || defined(__SSE2__)
+static uint8_t* (*find_psb_accel)(uint8_t*, uint8_t*) = find_psb_scalar;
+static uint8_t* (*skip_pad_accel)(uint8_t*, uint8_t*) = skip_pad_sse2;
+#else
+static uint8_t* (*find_psb_accel)(uint8_t*, uint8_t*) = find_psb_scalar;
+static uint8_t* (*skip_pad_accel)(uint8_t*, uint8_t*) = skip_pad_scalar;
+#endif
+
+#ifdef CONFIG_AVX2_OPT
+#include "qemu/cpuid.h"
+
+static void __attribute__((constructor)) init_decoder_accel(void){
+	int max = __get_cpuid_max(0, NULL);
+	int a, b, c, d;
+
+	/* AVX has to be usable, not just available */
+	if (max >= 7) {
+		__cpuid(1, a, b, c, d);
+		if ((c & bit_OSXSAVE) && (c & bit_AVX)) {
+			int bv;
+			__asm("xgetbv" : "=a"(bv), "=d"(d) : "c"(0));
+			__cpuid_count(7, 0, a, b, c, d);
+			if ((bv & 0x6) == 0x6 && (b & bit_AVX2)) {
+				find_psb_accel = find_psb_avx2;
+				skip_pad_accel = skip_pad_avx2;
+			}
+		}
+	}
+}
+#endif
+
+static inline uint8_t* find_psb(uint8_t* p, uint8_t* end){
+	return find_psb_accel(p, end);
+}
+
 #ifdef DECODER_LOG
 static void flush_log(decoder_t* self){
 	self->log.tnt64 = 0;
@@ -132,6 +346,9 @@ static void flush_log(decoder_t* self){
 	self->log.pip = 0;
 	self->log.cbr = 0;
 	self->log.ts = 0;
+	self->log.tsc = 0;
+	self->log.mtc = 0;
+	self->log.cyc = 0;
 	self->log.ovf = 0;
 	self->log.psbc = 0;
 	self->log.psbend = 0;
@@ -147,14 +364,28 @@ static void flush_log(decoder_t* self){
 }
 #endif
 
-decoder_t* pt_decoder_init(CPUState *cpu, uint64_t min_addr, uint64_t max_addr, void (*pt_bitmap)(uint64_t)){
+static decoder_t* decoder_new(disassembler_t* disassembler){
 	decoder_t* res = malloc(sizeof(decoder_t));
 	res->last_tip = 0;
 	res->last_tip_tmp = 0;
+	res->fup_tip = 0;
+	res->packet_count = 0;
+	res->ovf_resync = false;
+	res->resync_pending = false;
+	res->ovf_gaps = 0;
+	res->unknown_packets = 0;
+	res->profile = NULL;
+	res->pending_cycles = 0;
+	res->pending_mtc = 0;
+	res->last_ctc = -1;
+	res->segment_entry = 0;
+	res->pool = NULL;
+	memset(res->ranges, 0x00, sizeof(res->ranges));
+	res->range_count = 0;
 #ifdef DECODER_LOG
 	flush_log(res);
 #endif
-	res->disassembler_state = init_disassembler(cpu, min_addr, max_addr, pt_bitmap);
+	res->disassembler_state = disassembler;
 	res->tnt_cache_state = tnt_cache_init();
 		/* ToDo: Free! */
 	res->decoder_state = decoder_statemachine_new();
@@ -166,12 +397,28 @@ decoder_t* pt_decoder_init(CPUState *cpu, uint64_t min_addr, uint64_t max_addr,
 	return res;
 }
 
+/* NULL if the trace region is rejected, see init_disassembler() */
+decoder_t* pt_decoder_init(CPUState *cpu, uint64_t min_addr, uint64_t max_addr, void (*pt_bitmap)(void*, uint64_t), void* handler_opaque){
+	disassembler_t* disassembler = init_disassembler(cpu, min_addr, max_addr, pt_bitmap, handler_opaque);
+
+	if(!disassembler){
+		return NULL;
+	}
+	return decoder_new(disassembler);
+}
+
 void pt_decoder_destroy(decoder_t* self){
+	if(self->pool){
+		decoder_pool_destroy(self->pool);
+	}
 	if(self->tnt_cache_state){
 		destroy_disassembler(self->disassembler_state);
 		tnt_cache_destroy(self->tnt_cache_state);
 		self->tnt_cache_state = NULL;
 	}
+	if(self->profile){
+		kh_destroy(PROFILE, self->profile);
+	}
 	free(self->decoder_state);
 	free(self->decoder_state_result);
 	free(self);
@@ -180,6 +427,10 @@ void pt_decoder_destroy(decoder_t* self){
 void pt_decoder_flush(decoder_t* self){
 	self->last_tip = 0;
 	self->last_tip_tmp = 0;
+	self->resync_pending = false;
+	self->pending_cycles = 0;
+	self->pending_mtc = 0;
+	self->last_ctc = -1;
 #ifdef DECODER_LOG
 	flush_log(self);
 #endif
@@ -288,50 +539,47 @@ static inline void decoder_handle_fup(decoder_state_machine_t *self, uint64_t ad
 	}
 }
 
+/* payload bytes of a TIP / FUP packet by its IPBytes field, reserved codes carry none */
+static const uint8_t ip_bytes[8] = {0, 2, 4, 6, 6, 0, 8, 0};
+#define IP_PKT_LEN(byte0)	(1 + ip_bytes[(byte0) >> PT_PKT_TIP_SHIFT])
+
 static inline uint64_t get_ip_val(uint8_t **pp, uint8_t *end, uint8_t len, uint64_t *last_ip){
 	uint8_t *p = *pp;
 	uint64_t v = *last_ip;
+	uint64_t ip = 0;
+	uint8_t n = ip_bytes[len & 0x7];
 
-	if (unlikely(!LEFT(len))) {
+	if (unlikely(!LEFT(n))) {
 		*last_ip = 0;
 		v = 0;
 		return v;
 	}
+	/* never load more than the packet holds */
+	memcpy(&ip, p, n);
 
 	switch(len){
-		case 0:
-			v = 0;
-			break;
 		case 1:
-			v = (v & ~0xffffull) | (*(uint64_t *)p & 0xffffull);
-			*pp = p + 2;
-			*last_ip = v;
+			v = (v & ~0xffffull) | ip;
 			break;
 		case 2:
-			v = (v & ~0xffffffffull) | (*(uint64_t *)p & 0xffffffffull);
-			*pp = p + 4;
-			*last_ip = v;
+			v = (v & ~0xffffffffull) | ip;
 			break;
 		case 3:
-			v = (v & ~0xffffffffffffull) | (*(uint64_t *)p & 0xffffffffffffull);
+			v = (v & ~0xffffffffffffull) | ip;
 			v = ((int64_t)(v << (64 - 48))) >> (64 - 48); /* sign extension */
-			*pp = p + 6;
-			*last_ip = v;
 			break;
 		case 4:
-			v = (v & ~0xffffffffffffull) | (*(uint64_t *)p & 0xffffffffffffull);
-			*pp = p + 6;
-			*last_ip = v;
+			v = (v & ~0xffffffffffffull) | ip;
 			break;
 		case 6:
-			v = *(uint64_t *)p;
-			*pp = p + 8;
-			*last_ip = v;
+			v = ip;
 			break;
 		default:
-			v = 0;
-			break;
+			/* suppressed or reserved */
+			return 0;
 	}
+	*pp = p + n;
+	*last_ip = v;
 	return v;
 }
 
@@ -347,22 +595,187 @@ static inline uint64_t get_val(uint8_t **pp, uint8_t len){
 	return v;
 }
 
+void pt_decoder_enable_profile(decoder_t* self){
+	if(!self->profile){
+		self->profile = kh_init(PROFILE);
+	}
+}
+
+typedef struct profile_entry_s{
+	uint64_t addr;
+	block_profile_t p;
+} profile_entry_t;
+
+static int profile_compare(const void* a, const void* b){
+	const block_profile_t* x = &((const profile_entry_t*)a)->p;
+	const block_profile_t* y = &((const profile_entry_t*)b)->p;
+
+	if(x->cycles != y->cycles){
+		return x->cycles < y->cycles ? 1 : -1;
+	}
+	if(x->mtc != y->mtc){
+		return x->mtc < y->mtc ? 1 : -1;
+	}
+	return x->segments < y->segments ? 1 : (x->segments > y->segments ? -1 : 0);
+}
+
+/* writes the hot-spot histogram, hottest blocks first */
+bool pt_decoder_write_profile(decoder_t* self, const char* file){
+	profile_entry_t* entries;
+	uint32_t count = 0;
+	khiter_t k;
+	FILE* fd;
+
+	if(!self->profile){
+		return false;
+	}
+	fd = fopen(file, "w");
+	if(!fd){
+		return false;
+	}
+
+	entries = malloc(sizeof(*entries) * (kh_size(self->profile) + 1));
+	for(k = kh_begin(self->profile); k != kh_end(self->profile); k++){
+		if(kh_exist(self->profile, k)){
+			entries[count].addr = kh_key(self->profile, k);
+			entries[count].p = kh_value(self->profile, k);
+			count++;
+		}
+	}
+	qsort(entries, count, sizeof(*entries), profile_compare);
+
+	fprintf(fd, "# block\tsegments\tcycles\tmtc\n");
+	for(uint32_t i = 0; i < count; i++){
+		fprintf(fd, "%lx\t%lu\t%lu\t%lu\n", entries[i].addr, entries[i].p.segments, entries[i].p.cycles, entries[i].p.mtc);
+	}
+	free(entries);
+	fclose(fd);
+	return true;
+}
+
+/* 
+ * Timing packets precede the TIP which ends the segment they were measured in,
+ * so everything collected since the last TIP belongs to the segment which is
+ * about to be disassembled.
+ */
+static void profile_segment(decoder_t* self, khash_t(PROFILE)* profile, uint64_t block){
+	int ret;
+	khiter_t k = kh_put(PROFILE, profile, block, &ret);
+
+	if(ret){
+		memset(&kh_value(profile, k), 0x00, sizeof(block_profile_t));
+	}
+	kh_value(profile, k).segments++;
+	kh_value(profile, k).cycles += self->pending_cycles;
+	kh_value(profile, k).mtc += self->pending_mtc;
+	self->pending_cycles = 0;
+	self->pending_mtc = 0;
+}
+
+static inline decoder_t* decoder_range(decoder_t* self, uint64_t addr){
+	for(uint8_t i = 0; i < DECODER_MAX_RANGES; i++){
+		decoder_t* range = self->ranges[i];
+		if(range && addr >= range->disassembler_state->min_addr && addr <= range->disassembler_state->max_addr){
+			return range;
+		}
+	}
+	return NULL;
+}
+
+/* 
+ * Several trace ranges share one packet stream: every segment is traced on the
+ * CFG of the range it starts in and continues in the next range whenever a
+ * direct branch or fall-through leaves the current one. The pending indirect
+ * branch always ends up in our own disassembler, where the next TIP looks.
+ */
+static void disasm_ranges(decoder_t* self, uint64_t entry, uint64_t limit){
+	decoder_t* range = decoder_range(self, entry);
+	uint64_t fup_tip = self->fup_tip;
+
+	if(range && unlikely(self->profile && range->profile)){
+		profile_segment(self, range->profile, entry);
+	}
+	while(range){
+		disassembler_t* disassembler = range->disassembler_state;
+		disassembler_handover(self->disassembler_state, disassembler);
+		disassembler->range_exit = 0;
+		trace_disassembler(disassembler, entry, limit, self->tnt_cache_state, fup_tip);
+		disassembler_handover(disassembler, self->disassembler_state);
+		if(!disassembler->range_exit){
+			break;
+		}
+		/* reported by the previous range already (or not at all for jumps) */
+		entry = fup_tip = disassembler->range_exit;
+		range = decoder_range(self, entry);
+	}
+}
+
 static inline void disasm(decoder_t* self){
 	should_disasm_t* res = self->decoder_state_result;
 	if(res->valid){
     	WRITE_SAMPLE_DECODED_DETAILED("\n\ndisasm(%lx,%lx)\tTNT: %ld\n", res->start, res->end, count_tnt(self->tnt_cache_state));
-  		trace_disassembler(self->disassembler_state, res->start, res->end, self->tnt_cache_state, self->fup_tip);
+		if(likely(self->range_count < 2)){
+			if(unlikely(self->profile)){
+				profile_segment(self, self->profile, res->start);
+			}
+  			trace_disassembler(self->disassembler_state, res->start, res->end, self->tnt_cache_state, self->fup_tip);
+		} else {
+			disasm_ranges(self, res->start, res->end);
+		}
 		if(unlikely(self->fup_tip))
 			self->fup_tip = 0;
 		
 	}
 }
 
+/* 
+ * Internal buffer overflow: packets were dropped, so neither the TNT cache nor
+ * the state machine match the control flow anymore. Everything up to the OVF
+ * has already been disassembled, decoding resumes at the IP of the next FUP
+ * (sent right after the OVF or within PSB+), TIP or TIP.PGE.
+ */
+static void ovf_handler(decoder_t* self){
+	tnt_cache_flush(self->tnt_cache_state);
+	disassembler_flush(self->disassembler_state);
+	decoder_statemachine_reset(self->decoder_state);
+	self->decoder_state_result->valid = false;
+	self->fup_tip = 0;
+	self->resync_pending = true;
+	self->ovf_gaps++;
+	self->pending_cycles = 0;
+	self->pending_mtc = 0;
+	self->last_ctc = -1;
+#ifdef DECODER_LOG
+	self->log.ovf++;
+#endif
+}
+
+static void resync_handler(decoder_t* self, uint64_t addr){
+	WRITE_SAMPLE_DECODED_DETAILED("RESYNC \t%lx\n", addr);
+	tnt_cache_flush(self->tnt_cache_state);
+	self->decoder_state->state = TraceEnabledWithLastIP;
+	self->decoder_state->last_ip = addr;
+	self->resync_pending = false;
+	if(!self->segment_entry){
+		self->segment_entry = addr;
+	}
+}
+
 static void tip_handler(decoder_t* self, uint8_t** p, uint8_t** end){
+	bool traced;
 	self->last_tip = get_ip_val(p, *end, (*(*p)++ >> PT_PKT_TIP_SHIFT), &self->last_tip_tmp);
 	WRITE_SAMPLE_DECODED_DETAILED("TIP    \t%lx\n", self->last_tip);
+	if(unlikely(self->resync_pending)){
+		resync_handler(self, self->last_tip);
+		return;
+	}
+	traced = self->decoder_state->state == TraceEnabledWithLastIP;
 	decoder_handle_tip(self->decoder_state, self->last_tip, self->decoder_state_result);
 	disasm(self);
+	/* the segment ends at the indirect branch or ret this TIP is the target of */
+	if(traced){
+		inform_disassembler_target_ip(self->disassembler_state, self->last_tip);
+	}
 #ifdef DECODER_LOG
 	self->log.tip++;
 #endif
@@ -371,6 +784,10 @@ static void tip_handler(decoder_t* self, uint8_t** p, uint8_t** end){
 static void tip_pge_handler(decoder_t* self, uint8_t** p, uint8_t** end){
 	self->last_tip = get_ip_val(p, *end, (*(*p)++ >> PT_PKT_TIP_SHIFT), &self->last_tip_tmp);
 	WRITE_SAMPLE_DECODED_DETAILED("PGE    \t%lx\n", self->last_tip);
+	if(unlikely(self->resync_pending)){
+		resync_handler(self, self->last_tip);
+		return;
+	}
 	decoder_handle_pge(self->decoder_state, self->last_tip, self->decoder_state_result);
 	disasm(self);
 #ifdef DECODER_LOG
@@ -383,6 +800,7 @@ static void tip_pgd_handler(decoder_t* self, uint8_t** p, uint8_t** end){
 	WRITE_SAMPLE_DECODED_DETAILED("PGD    \t%lx\n", self->last_tip);
 	decoder_handle_pgd(self->decoder_state, self->last_tip, self->decoder_state_result);
 	disasm(self);
+	inform_disassembler_target_ip(self->disassembler_state, self->last_tip);
 #ifdef DECODER_LOG
 	self->log.tip_pgd++;
 #endif
@@ -390,6 +808,10 @@ static void tip_pgd_handler(decoder_t* self, uint8_t** p, uint8_t** end){
 
 static void tip_fup_handler(decoder_t* self, uint8_t** p, uint8_t** end){
 	self->fup_tip = get_ip_val(p, *end, (*(*p)++ >> PT_PKT_TIP_SHIFT), &self->last_tip_tmp);
+	if(unlikely(self->resync_pending)){
+		/* fup_tip is kept, the segment starting here must not report its entry twice */
+		resync_handler(self, self->fup_tip);
+	}
 #ifdef DECODER_LOG
 	self->log.tip_fup++;
 #endif
@@ -407,9 +829,62 @@ static inline void pip_handler(decoder_t* self, uint8_t** p){
 #endif
 }
 
- __attribute__((hot)) bool decode_buffer(decoder_t* self, uint8_t* map, size_t len){
+ __attribute__((hot)) static bool decode_packets(decoder_t* self, uint8_t* map, size_t len){
 	uint8_t *end = map + len;
 	uint8_t *p;
+	uint64_t packets = 0;
+
+	/*
+	 * Byte-indexed dispatch tables (GCC computed goto). Every first byte of a
+	 * packet maps to exactly one handler label, so the hot path costs a single
+	 * indirect jump per packet instead of a large switch. Packets starting with
+	 * PT_PKT_GENERIC_BYTE0 are dispatched again on their second byte.
+	 */
+	static void* const dispatch_table[256] = {
+		[0 ... 255]									= &&handle_unknown,
+		[0x00]										= &&handle_pad,
+		[PT_PKT_GENERIC_BYTE0]						= &&handle_ext,
+		[PT_PKT_MODE_BYTE0]							= &&handle_mode,
+		TIP_LABELS(PT_PKT_TIP_BYTE0,				&&handle_tip),
+		TIP_LABELS(PT_PKT_TIP_PGE_BYTE0,			&&handle_tip_pge),
+		TIP_LABELS(PT_PKT_TIP_PGD_BYTE0,			&&handle_tip_pgd),
+		TIP_LABELS(PT_PKT_TIP_FUP_BYTE0,			&&handle_tip_fup),
+		[0x04] = &&handle_tnt8, [0x06] = &&handle_tnt8,
+		[0x08] = &&handle_tnt8, [0x0a] = &&handle_tnt8,
+		[0x0c] = &&handle_tnt8, [0x0e] = &&handle_tnt8,
+		TNT8_LABELS(0x10, &&handle_tnt8), TNT8_LABELS(0x20, &&handle_tnt8),
+		TNT8_LABELS(0x30, &&handle_tnt8), TNT8_LABELS(0x40, &&handle_tnt8),
+		TNT8_LABELS(0x50, &&handle_tnt8), TNT8_LABELS(0x60, &&handle_tnt8),
+		TNT8_LABELS(0x70, &&handle_tnt8), TNT8_LABELS(0x80, &&handle_tnt8),
+		TNT8_LABELS(0x90, &&handle_tnt8), TNT8_LABELS(0xa0, &&handle_tnt8),
+		TNT8_LABELS(0xb0, &&handle_tnt8), TNT8_LABELS(0xc0, &&handle_tnt8),
+		TNT8_LABELS(0xd0, &&handle_tnt8), TNT8_LABELS(0xe0, &&handle_tnt8),
+		TNT8_LABELS(0xf0, &&handle_tnt8),
+		[PT_PKT_TSC_BYTE0]							= &&handle_tsc,
+		[PT_PKT_MTC_BYTE0]							= &&handle_mtc,
+		CYC_LABELS(0x00, &&handle_cyc), CYC_LABELS(0x10, &&handle_cyc),
+		CYC_LABELS(0x20, &&handle_cyc), CYC_LABELS(0x30, &&handle_cyc),
+		CYC_LABELS(0x40, &&handle_cyc), CYC_LABELS(0x50, &&handle_cyc),
+		CYC_LABELS(0x60, &&handle_cyc), CYC_LABELS(0x70, &&handle_cyc),
+		CYC_LABELS(0x80, &&handle_cyc), CYC_LABELS(0x90, &&handle_cyc),
+		CYC_LABELS(0xa0, &&handle_cyc), CYC_LABELS(0xb0, &&handle_cyc),
+		CYC_LABELS(0xc0, &&handle_cyc), CYC_LABELS(0xd0, &&handle_cyc),
+		CYC_LABELS(0xe0, &&handle_cyc), CYC_LABELS(0xf0, &&handle_cyc),
+	};
+
+	static void* const ext_dispatch_table[256] = {
+		[0 ... 255]									= &&handle_unknown,
+		[PT_PKT_LTNT_BYTE1]							= &&handle_ltnt,
+		[PT_PKT_PIP_BYTE1]							= &&handle_pip,
+		[PT_PKT_CBR_BYTE1]							= &&handle_cbr,
+		[PT_PKT_VMCS_BYTE1]							= &&handle_vmcs,
+		[PT_PKT_OVF_BYTE1]							= &&handle_ovf,
+		[PT_PKT_TS_BYTE1]							= &&handle_trashed,
+		[PT_PKT_PSBEND_BYTE1]						= &&handle_psbend,
+		[PT_PKT_PSB_BYTE1]							= &&handle_psb,
+		[PT_PKT_MNT_BYTE1]							= &&handle_mnt,
+		[PT_PKT_TMA_BYTE1]							= &&handle_tma,
+	};
 
 #ifdef DECODER_LOG
 	flush_log(self);
@@ -426,257 +901,557 @@ static inline void pip_handler(decoder_t* self, uint8_t** p){
 	puts("");
 #endif
 
-	for (p = map; p < end; ) {
-		p = memmem(p, end - p, psb, PT_PKT_PSB_LEN);
-		if (!p) {
-			p = end;
-			break;
-		}
-		
-		while (p < end) {			
-			
-			switch(p[0]){
-				case 0x00:
-					while(!(*(++p)) && p < end){}
-					#ifdef DECODER_LOG
-					self->log.pad++;
-					#endif
-					break;
-				case PT_PKT_MODE_BYTE0:
-					p += PT_PKT_MODE_LEN;
-					WRITE_SAMPLE_DECODED_DETAILED("MODE\n");
-					#ifdef DECODER_LOG
-					self->log.mode++;
-					#endif
-					break;
-				case (PT_PKT_TIP_BYTE0 + TIP_VALUE_0):
-				case (PT_PKT_TIP_BYTE0 + TIP_VALUE_1):
-				case (PT_PKT_TIP_BYTE0 + TIP_VALUE_2):
-				case (PT_PKT_TIP_BYTE0 + TIP_VALUE_3):
-				case (PT_PKT_TIP_BYTE0 + TIP_VALUE_4):
-				case (PT_PKT_TIP_BYTE0 + TIP_VALUE_5):
-				case (PT_PKT_TIP_BYTE0 + TIP_VALUE_6):
-				case (PT_PKT_TIP_BYTE0 + TIP_VALUE_7):
-					tip_handler(self, &p, &end);
-					break;
-				case (PT_PKT_TIP_PGE_BYTE0 + TIP_VALUE_0):
-				case (PT_PKT_TIP_PGE_BYTE0 + TIP_VALUE_1):
-				case (PT_PKT_TIP_PGE_BYTE0 + TIP_VALUE_2):
-				case (PT_PKT_TIP_PGE_BYTE0 + TIP_VALUE_3):
-				case (PT_PKT_TIP_PGE_BYTE0 + TIP_VALUE_4):
-				case (PT_PKT_TIP_PGE_BYTE0 + TIP_VALUE_5):
-				case (PT_PKT_TIP_PGE_BYTE0 + TIP_VALUE_6):
-				case (PT_PKT_TIP_PGE_BYTE0 + TIP_VALUE_7):
-					tip_pge_handler(self, &p, &end);
-					break;
-				case (PT_PKT_TIP_PGD_BYTE0 + TIP_VALUE_0):
-				case (PT_PKT_TIP_PGD_BYTE0 + TIP_VALUE_1):
-				case (PT_PKT_TIP_PGD_BYTE0 + TIP_VALUE_2):
-				case (PT_PKT_TIP_PGD_BYTE0 + TIP_VALUE_3):
-				case (PT_PKT_TIP_PGD_BYTE0 + TIP_VALUE_4):
-				case (PT_PKT_TIP_PGD_BYTE0 + TIP_VALUE_5):
-				case (PT_PKT_TIP_PGD_BYTE0 + TIP_VALUE_6):
-				case (PT_PKT_TIP_PGD_BYTE0 + TIP_VALUE_7):
-					tip_pgd_handler(self, &p, &end);
-					break;
-				case (PT_PKT_TIP_FUP_BYTE0 + TIP_VALUE_0):
-				case (PT_PKT_TIP_FUP_BYTE0 + TIP_VALUE_1):
-				case (PT_PKT_TIP_FUP_BYTE0 + TIP_VALUE_2):
-				case (PT_PKT_TIP_FUP_BYTE0 + TIP_VALUE_3):
-				case (PT_PKT_TIP_FUP_BYTE0 + TIP_VALUE_4):
-				case (PT_PKT_TIP_FUP_BYTE0 + TIP_VALUE_5):
-				case (PT_PKT_TIP_FUP_BYTE0 + TIP_VALUE_6):
-				case (PT_PKT_TIP_FUP_BYTE0 + TIP_VALUE_7):
-					tip_fup_handler(self, &p, &end);
-					break;
-				case PT_PKT_GENERIC_BYTE0:
-					switch(p[1]){
-						case PT_PKT_LTNT_BYTE1:
-							append_tnt_cache_ltnt(self->tnt_cache_state, (uint64_t)*p);
-							p += PT_PKT_LTNT_LEN;
-							#ifdef DECODER_LOG
-							self->log.tnt64++;
-							#endif
-							break;
-						case PT_PKT_PIP_BYTE1:
-							pip_handler(self, &p);
-							break;
-						case PT_PKT_CBR_BYTE1:
-							p += PT_PKT_CBR_LEN;
-							#ifdef DECODER_LOG
-							self->log.cbr++;
-							#endif
-							break;
-						case PT_PKT_VMCS_BYTE1:
-							WRITE_SAMPLE_DECODED_DETAILED("VMCS\n");
-							p += PT_PKT_VMCS_LEN;
-							#ifdef DECODER_LOG
-							self->log.vmcs++;
-							#endif
-							break;
-						case PT_PKT_OVF_BYTE1:
-						case PT_PKT_TS_BYTE1:
-							return false;
-							break;
-						case PT_PKT_PSBEND_BYTE1:
-							p += PT_PKT_PSBEND_LEN;
-							WRITE_SAMPLE_DECODED_DETAILED("PSBEND\n");
-							#ifdef DECODER_LOG
-							self->log.psbend++;
-							#endif
-							break;
-						case PT_PKT_PSB_BYTE1:
-							p += PT_PKT_PSB_LEN;
-							WRITE_SAMPLE_DECODED_DETAILED("PSB\n");
-							#ifdef DECODER_LOG
-							self->log.psbc++;
-							#endif
-							break;
-						default:
-							assert(false);
-					}
-					break;
-				/* :( */
-				case 4:
-				case 6:
-				case 8:
-				case 10:
-				case 12:
-				case 14:
-				case 16:
-				case 18:
-				case 20:
-				case 22:
-				case 24:
-				case 26:
-				case 28:
-				case 30:
-				case 32:
-				case 34:
-				case 36:
-				case 38:
-				case 40:
-				case 42:
-				case 44:
-				case 46:
-				case 48:
-				case 50:
-				case 52:
-				case 54:
-				case 56:
-				case 58:
-				case 60:
-				case 62:
-				case 64:
-				case 66:
-				case 68:
-				case 70:
-				case 72:
-				case 74:
-				case 76:
-				case 78:
-				case 80:
-				case 82:
-				case 84:
-				case 86:
-				case 88:
-				case 90:
-				case 92:
-				case 94:
-				case 96:
-				case 98:
-				case 100:
-				case 102:
-				case 104:
-				case 106:
-				case 108:
-				case 110:
-				case 112:
-				case 114:
-				case 116:
-				case 118:
-				case 120:
-				case 122:
-				case 124:
-				case 126:
-				case 130:
-				case 128:
-				case 132:
-				case 134:
-				case 136:
-				case 138:
-				case 140:
-				case 142:
-				case 144:
-				case 146:
-				case 148:
-				case 150:
-				case 152:
-				case 154:
-				case 156:
-				case 158:
-				case 160:
-				case 162:
-				case 164:
-				case 166:
-				case 168:
-				case 170:
-				case 172:
-				case 174:
-				case 176:
-				case 178:
-				case 180:
-				case 182:
-				case 184:
-				case 186:
-				case 188:
-				case 190:
-				case 192:
-				case 194:
-				case 196:
-				case 198:
-				case 200:
-				case 202:
-				case 204:
-				case 206:
-				case 208:
-				case 210:
-				case 212:
-				case 214:
-				case 216:
-				case 218:
-				case 220:
-				case 222:
-				case 224:
-				case 226:
-				case 228:
-				case 230:
-				case 232:
-				case 234:
-				case 236:
-				case 238:
-				case 240:
-				case 242:
-				case 244:
-				case 246:
-				case 248:
-				case 250:
-				case 252:
-				case 254:
-					append_tnt_cache(self->tnt_cache_state, (uint64_t)(*p));
-					p++;
-					#ifdef DECODER_LOG
-					self->log.tnt8++;
-					#endif
-					break;
-				default:
-					fprintf(stderr, "unkown packet : %x %x\n", *p, *(p+1));
-					assert(false);
-			}	
+	p = find_psb(map, end);
+	if (!p) {
+		goto done;
+	}
+
+	DISPATCH();
+
+handle_pad:
+	/* most PADs come alone, only scan runs */
+	if (LEFT(2) && p[1]) {
+		p++;
+	} else {
+		p = skip_pad_accel(p + 1, end);
+	}
+	#ifdef DECODER_LOG
+	self->log.pad++;
+	#endif
+	DISPATCH();
+
+handle_mode:
+	NEED(PT_PKT_MODE_LEN);
+	p += PT_PKT_MODE_LEN;
+	WRITE_SAMPLE_DECODED_DETAILED("MODE\n");
+	#ifdef DECODER_LOG
+	self->log.mode++;
+	#endif
+	DISPATCH();
+
+handle_tip:
+	NEED(IP_PKT_LEN(*p));
+	tip_handler(self, &p, &end);
+	DISPATCH();
+
+handle_tip_pge:
+	NEED(IP_PKT_LEN(*p));
+	tip_pge_handler(self, &p, &end);
+	DISPATCH();
+
+handle_tip_pgd:
+	NEED(IP_PKT_LEN(*p));
+	tip_pgd_handler(self, &p, &end);
+	DISPATCH();
+
+handle_tip_fup:
+	NEED(IP_PKT_LEN(*p));
+	tip_fup_handler(self, &p, &end);
+	DISPATCH();
+
+handle_tnt8:
+	append_tnt_cache(self->tnt_cache_state, (uint64_t)(*p));
+	p++;
+	#ifdef DECODER_LOG
+	self->log.tnt8++;
+	#endif
+	DISPATCH();
+
+handle_ext:
+	NEED(PT_PKT_GENERIC_LEN);
+	goto *ext_dispatch_table[p[1]];
+
+handle_ltnt:
+	NEED(PT_PKT_LTNT_LEN);
+	append_tnt_cache_ltnt(self->tnt_cache_state, (*(uint64_t *)p) >> LONG_TNT_OFFSET);
+	p += PT_PKT_LTNT_LEN;
+	#ifdef DECODER_LOG
+	self->log.tnt64++;
+	#endif
+	DISPATCH();
+
+handle_pip:
+	NEED(PT_PKT_PIP_LEN);
+	pip_handler(self, &p);
+	DISPATCH();
+
+handle_cbr:
+	NEED(PT_PKT_CBR_LEN);
+	p += PT_PKT_CBR_LEN;
+	#ifdef DECODER_LOG
+	self->log.cbr++;
+	#endif
+	DISPATCH();
+
+handle_vmcs:
+	NEED(PT_PKT_VMCS_LEN);
+	WRITE_SAMPLE_DECODED_DETAILED("VMCS\n");
+	p += PT_PKT_VMCS_LEN;
+	#ifdef DECODER_LOG
+	self->log.vmcs++;
+	#endif
+	DISPATCH();
+
+handle_psbend:
+	p += PT_PKT_PSBEND_LEN;
+	WRITE_SAMPLE_DECODED_DETAILED("PSBEND\n");
+	#ifdef DECODER_LOG
+	self->log.psbend++;
+	#endif
+	DISPATCH();
+
+handle_psb:
+	NEED(PT_PKT_PSB_LEN);
+	p += PT_PKT_PSB_LEN;
+	WRITE_SAMPLE_DECODED_DETAILED("PSB\n");
+	#ifdef DECODER_LOG
+	self->log.psbc++;
+	#endif
+	DISPATCH();
+
+handle_mnt:
+	NEED(PT_PKT_MNT_LEN);
+	p += PT_PKT_MNT_LEN;
+	#ifdef DECODER_LOG
+	self->log.mnt++;
+	#endif
+	DISPATCH();
+
+handle_tma:
+	NEED(PT_PKT_TMA_LEN);
+	p += PT_PKT_TMA_LEN;
+	/* the MTC payload is a slice of the CTC, resynchronised by TMA */
+	self->last_ctc = -1;
+	#ifdef DECODER_LOG
+	self->log.tma++;
+	#endif
+	DISPATCH();
+
+handle_tsc:
+	NEED(PT_PKT_TSC_LEN);
+	p += PT_PKT_TSC_LEN;
+	#ifdef DECODER_LOG
+	self->log.tsc++;
+	#endif
+	DISPATCH();
+
+handle_mtc:
+	NEED(PT_PKT_MTC_LEN);
+	if(self->last_ctc >= 0){
+		self->pending_mtc += (uint8_t)(p[1] - self->last_ctc);
+	}
+	self->last_ctc = p[1];
+	p += PT_PKT_MTC_LEN;
+	#ifdef DECODER_LOG
+	self->log.mtc++;
+	#endif
+	DISPATCH();
+
+handle_cyc:
+	{
+		/* 5 bits in the header, 7 more per extension byte while bit 0 is set */
+		uint64_t cycles = *p >> 3;
+		uint8_t shift = 5;
+		bool ext = *p & PT_PKT_CYC_EXP;
+
+		p++;
+		while(ext){
+			NEED(1);
+			if(shift < 64){
+				cycles |= (uint64_t)(*p >> 1) << shift;
+			}
+			shift += 7;
+			ext = *p++ & 1;
 		}
+		self->pending_cycles += cycles;
+	}
+	#ifdef DECODER_LOG
+	self->log.cyc++;
+	#endif
+	DISPATCH();
+
+handle_ovf:
+	if(!self->ovf_resync){
+		goto handle_trashed;
 	}
+	p += PT_PKT_OVF_LEN;
+	WRITE_SAMPLE_DECODED_DETAILED("OVF\n");
+	ovf_handler(self);
+	DISPATCH();
+
+handle_trashed:
+	self->packet_count = packets;
+	return false;
+
+handle_unknown:
+	/* garbage traces would flood stderr, the count shows up in pt status */
+	self->unknown_packets++;
+	self->packet_count = packets;
+	return false;
+
+done:
+	self->packet_count = packets;
 #ifdef DEBUG
 	WRITE_SAMPLE_DECODED_DETAILED("\tTNT %d (PGE %d)\n", count_tnt(self->tnt_cache_state), self->last_tip);
 #endif
 	return true;
 }
+
+/* ===== parallel decoding ===== */
+
+#define DECODER_MAX_WORKERS		32
+#define DECODER_SEGMENT_MIN		(256 << 10)	/* smaller buffers are not worth splitting */
+//#define PARALLEL_DECODE_VERIFY	/* compare every parallel run with a serial one, see decoder_verify_begin() */
+
+typedef struct decoder_worker_s{
+	decoder_pool_t* pool;
+	decoder_t* decoder;		/* decodes on a read-only view of the CFG */
+	uint8_t* start;
+	size_t len;
+	bool ret;
+	uint64_t* edges;		/* recorded handler calls, replayed in order by the merge */
+	uint64_t edges_used;
+	uint64_t edges_size;
+	pthread_t thread;
+} decoder_worker_t;
+
+struct decoder_pool_s{
+	uint32_t size;
+	decoder_worker_t workers[DECODER_MAX_WORKERS];
+	pthread_mutex_t mutex;
+	pthread_cond_t cond_job;
+	pthread_cond_t cond_done;
+	uint64_t job;
+	uint32_t pending;
+	bool quit;
+};
+
+static void decoder_worker_edge(void* opaque, uint64_t addr){
+	decoder_worker_t* worker = opaque;
+
+	if(unlikely(worker->edges_used == worker->edges_size)){
+		worker->edges_size = worker->edges_size ? worker->edges_size * 2 : 0x1000;
+		worker->edges = realloc(worker->edges, worker->edges_size * sizeof(uint64_t));
+	}
+	worker->edges[worker->edges_used++] = addr;
+}
+
+static void decoder_worker_free(decoder_t* self){
+	destroy_disassembler_view(self->disassembler_state);
+	tnt_cache_destroy(self->tnt_cache_state);
+	free(self->decoder_state);
+	free(self->decoder_state_result);
+	free(self);
+}
+
+/* 
+ * Every segment starts at a PSB, the worker has no idea about the state the
+ * previous segment ends in and waits for the FUP in PSB+ (or the next TIP) to
+ * resynchronise, just as after an OVF.
+ */
+static void decoder_worker_run(decoder_worker_t* worker){
+	decoder_t* self = worker->decoder;
+
+	pt_decoder_flush(self);
+	self->resync_pending = true;
+	self->segment_entry = 0;
+	self->ovf_gaps = 0;
+	worker->edges_used = 0;
+	worker->ret = decode_packets(self, worker->start, worker->len);
+}
+
+static void* decoder_worker_thread(void* arg){
+	decoder_worker_t* worker = arg;
+	decoder_pool_t* pool = worker->pool;
+	uint64_t job = 0;
+
+	while(true){
+		pthread_mutex_lock(&pool->mutex);
+		while(!pool->quit && pool->job == job){
+			pthread_cond_wait(&pool->cond_job, &pool->mutex);
+		}
+		if(pool->quit){
+			pthread_mutex_unlock(&pool->mutex);
+			return NULL;
+		}
+		job = pool->job;
+		pthread_mutex_unlock(&pool->mutex);
+
+		if(worker->len){
+			decoder_worker_run(worker);
+		}
+
+		pthread_mutex_lock(&pool->mutex);
+		if(!--pool->pending){
+			pthread_cond_signal(&pool->cond_done);
+		}
+		pthread_mutex_unlock(&pool->mutex);
+	}
+}
+
+static void decoder_pool_destroy(decoder_pool_t* pool){
+	pthread_mutex_lock(&pool->mutex);
+	pool->quit = true;
+	pthread_cond_broadcast(&pool->cond_job);
+	pthread_mutex_unlock(&pool->mutex);
+
+	for(uint32_t i = 0; i < pool->size; i++){
+		pthread_join(pool->workers[i].thread, NULL);
+		decoder_worker_free(pool->workers[i].decoder);
+		free(pool->workers[i].edges);
+	}
+	free(pool);
+}
+
+/* splits large buffers at PSB boundaries and decodes the segments on up to threads workers */
+void pt_decoder_enable_parallel(decoder_t* self, uint32_t threads){
+	decoder_pool_t* pool;
+
+	if(self->pool || threads < 2){
+		return;
+	}
+	pool = malloc(sizeof(decoder_pool_t));
+	memset(pool, 0x00, sizeof(decoder_pool_t));
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_cond_init(&pool->cond_job, NULL);
+	pthread_cond_init(&pool->cond_done, NULL);
+
+	for(uint32_t i = 0; i < MIN(threads, DECODER_MAX_WORKERS); i++){
+		decoder_worker_t* worker = &pool->workers[i];
+		worker->pool = pool;
+		worker->decoder = decoder_new(disassembler_view(self->disassembler_state, decoder_worker_edge, worker));
+		if(pthread_create(&worker->thread, NULL, decoder_worker_thread, worker)){
+			decoder_worker_free(worker->decoder);
+			break;
+		}
+		pool->size++;
+	}
+	self->pool = pool;
+	if(pool->size < 2){
+		decoder_pool_destroy(pool);
+		self->pool = NULL;
+	}
+}
+
+/* the workers' views have to follow if the CFG is swapped (e.g. by pre-disassembly) */
+void pt_decoder_replace_disassembler(decoder_t* self, disassembler_t* disassembler){
+	if(self->disassembler_state->edge_sink){
+		disassembler_set_edge_sink(disassembler, self->disassembler_state->edge_sink);
+	}
+	destroy_disassembler(self->disassembler_state);
+	self->disassembler_state = disassembler;
+	if(self->pool){
+		for(uint32_t i = 0; i < self->pool->size; i++){
+			decoder_worker_t* worker = &self->pool->workers[i];
+			destroy_disassembler_view(worker->decoder->disassembler_state);
+			worker->decoder->disassembler_state = disassembler_view(disassembler, decoder_worker_edge, worker);
+		}
+	}
+}
+
+/* continues with the state a worker ended its segment in */
+static void decoder_merge_segment(decoder_t* self, decoder_worker_t* worker){
+	decoder_t* segment = worker->decoder;
+	tnt_cache_t* tnt_cache_state;
+	decoder_state_machine_t* decoder_state;
+
+	/* branches between the last TIP of the previous segment and the IP in PSB+ */
+	if(self->decoder_state->state == TraceEnabledWithLastIP && !self->resync_pending){
+		_set_disasm(self->decoder_state_result, self->decoder_state->last_ip, segment->segment_entry);
+		disasm(self);
+		self->decoder_state_result->valid = false;
+	}
+
+	/* an indirect branch right before the PSB has no target we know of */
+	disassembler_flush(self->disassembler_state);
+
+	for(uint64_t i = 0; i < worker->edges_used; i++){
+		disassembler_report(self->disassembler_state, worker->edges[i]);
+	}
+	self->disassembler_state->has_pending_indirect_branch = segment->disassembler_state->has_pending_indirect_branch;
+	self->disassembler_state->pending_indirect_branch_src = segment->disassembler_state->pending_indirect_branch_src;
+	self->disassembler_state->reported_target = segment->disassembler_state->reported_target;
+
+	tnt_cache_state = self->tnt_cache_state;
+	self->tnt_cache_state = segment->tnt_cache_state;
+	segment->tnt_cache_state = tnt_cache_state;
+	decoder_state = self->decoder_state;
+	self->decoder_state = segment->decoder_state;
+	segment->decoder_state = decoder_state;
+
+	self->last_tip = segment->last_tip;
+	self->last_tip_tmp = segment->last_tip_tmp;
+	self->fup_tip = segment->fup_tip;
+	self->resync_pending = segment->resync_pending;
+	self->ovf_gaps += segment->ovf_gaps;
+}
+
+#ifdef PARALLEL_DECODE_VERIFY
+/* 
+ * Debug aid: decodes the buffer once more, serially on a view of the CFG and
+ * from the state the parallel run started in, and counts the bitmap bytes the
+ * two runs disagree on. Segments only start with an empty state, so small
+ * differences at the boundaries are expected, see decoder_merge_segment().
+ */
+typedef struct decoder_verify_s{
+	decoder_t* serial;
+	edge_sink_t sink;		/* of the serial run */
+	uint8_t* before;		/* bitmap before the parallel run */
+} decoder_verify_t;
+
+static bool decoder_verify_begin(decoder_t* self, decoder_verify_t* verify){
+	disassembler_t* disassembler = self->disassembler_state;
+	edge_sink_t* sink = disassembler->edge_sink;
+	decoder_t* serial;
+	tnt_cache_t* tnt;
+
+	if(!sink || !sink->bitmap){
+		return false;
+	}
+	serial = decoder_new(disassembler_view(disassembler, disassembler->handler, disassembler->handler_opaque));
+	verify->sink.mask = sink->mask;
+	verify->sink.last_id = sink->last_id;
+	verify->sink.bitmap = calloc(sink->mask + 1, 1);
+	verify->sink.dirty = calloc(edge_dirty_words(sink->mask + 1), sizeof(uint64_t));
+	verify->before = malloc(sink->mask + 1);
+	memcpy(verify->before, sink->bitmap, sink->mask + 1);
+	disassembler_set_edge_sink(serial->disassembler_state, &verify->sink);
+
+	tnt = serial->tnt_cache_state;
+	if(tnt->size < self->tnt_cache_state->size){
+		tnt->bits = realloc(tnt->bits, self->tnt_cache_state->size >> 3);
+		tnt->size = self->tnt_cache_state->size;
+	}
+	memcpy(tnt->bits, self->tnt_cache_state->bits, self->tnt_cache_state->size >> 3);
+	tnt->head = self->tnt_cache_state->head;
+	tnt->tail = self->tnt_cache_state->tail;
+	*serial->decoder_state = *self->decoder_state;
+	*serial->decoder_state_result = *self->decoder_state_result;
+	serial->last_tip = self->last_tip;
+	serial->last_tip_tmp = self->last_tip_tmp;
+	serial->fup_tip = self->fup_tip;
+	serial->ovf_resync = self->ovf_resync;
+	serial->resync_pending = self->resync_pending;
+	serial->disassembler_state->has_pending_indirect_branch = disassembler->has_pending_indirect_branch;
+	serial->disassembler_state->pending_indirect_branch_src = disassembler->pending_indirect_branch_src;
+	serial->disassembler_state->reported_target = disassembler->reported_target;
+	serial->disassembler_state->range_exit = disassembler->range_exit;
+	verify->serial = serial;
+	return true;
+}
+
+static void decoder_verify_end(decoder_t* self, decoder_verify_t* verify, uint8_t* map, size_t len){
+	edge_sink_t* sink = self->disassembler_state->edge_sink;
+	uint64_t mismatches = 0;
+
+	/* the parallel run disassembled everything the serial one should need */
+	disassembler_view_sync(verify->serial->disassembler_state);
+	decode_packets(verify->serial, map, len);
+	if(verify->serial->disassembler_state->view_miss){
+		printf("parallel decode verify: serial run left the CFG, skipped\n");
+	} else {
+		for(uint64_t i = 0; i <= sink->mask; i++){
+			mismatches += (uint8_t)(sink->bitmap[i] - verify->before[i]) != verify->sink.bitmap[i];
+		}
+		if(mismatches){
+			printf("parallel decode verify: %lu of %u bitmap bytes differ (%lu bytes of trace)\n",
+				mismatches, sink->mask + 1, len);
+		}
+	}
+	decoder_worker_free(verify->serial);
+	free(verify->sink.bitmap);
+	free(verify->sink.dirty);
+	free(verify->before);
+}
+#endif
+
+static bool decode_parallel(decoder_t* self, uint8_t* map, size_t len){
+	decoder_pool_t* pool = self->pool;
+	uint8_t* end = map + len;
+	uint8_t* starts[DECODER_MAX_WORKERS + 1];
+	uint32_t n = MIN(pool->size, len / DECODER_SEGMENT_MIN);
+	uint32_t segments = 0;
+	uint64_t packets = 0;
+	bool ret = true;
+
+	for(uint32_t i = 0; i < n; i++){
+		uint8_t* psb_start = find_psb(map + i * (len / n), end);
+		if(!psb_start){
+			break;
+		}
+		if(!segments || psb_start > starts[segments - 1]){
+			starts[segments++] = psb_start;
+		}
+	}
+	if(segments < 2){
+		return decode_packets(self, map, len);
+	}
+	starts[segments] = end;
+
+	for(uint32_t i = 0; i < pool->size; i++){
+		decoder_worker_t* worker = &pool->workers[i];
+		worker->start = i < segments ? starts[i] : NULL;
+		worker->len = i < segments ? starts[i + 1] - starts[i] : 0;
+		worker->decoder->ovf_resync = self->ovf_resync;
+		disassembler_view_sync(worker->decoder->disassembler_state);
+	}
+
+	pthread_mutex_lock(&pool->mutex);
+	pool->pending = pool->size;
+	pool->job++;
+	pthread_cond_broadcast(&pool->cond_job);
+	while(pool->pending){
+		pthread_cond_wait(&pool->cond_done, &pool->mutex);
+	}
+	pthread_mutex_unlock(&pool->mutex);
+
+	/* merge in trace order, segments the CFG was not ready for are decoded again */
+	for(uint32_t i = 0; i < segments; i++){
+		decoder_worker_t* worker = &pool->workers[i];
+		if(worker->decoder->disassembler_state->view_miss || !worker->decoder->segment_entry){
+			ret = decode_packets(self, worker->start, worker->len);
+			packets += self->packet_count;
+		} else {
+			decoder_merge_segment(self, worker);
+			packets += worker->decoder->packet_count;
+			ret = worker->ret;
+		}
+		if(!ret){
+			break;
+		}
+	}
+	self->packet_count = packets;
+	return ret;
+}
+
+/* 
+ * Makes self decode the packets of all ranges, self has to be one of them. The
+ * other decoders only keep their CFG and profile and are not fed anymore.
+ */
+void pt_decoder_set_ranges(decoder_t* self, decoder_t** ranges, uint8_t count){
+	memset(self->ranges, 0x00, sizeof(self->ranges));
+	self->range_count = 0;
+	for(uint8_t i = 0; i < count && i < DECODER_MAX_RANGES; i++){
+		if(ranges[i]){
+			self->ranges[self->range_count++] = ranges[i];
+		}
+	}
+}
+
+bool decode_buffer(decoder_t* self, uint8_t* map, size_t len){
+	/* the workers only have a view on our own range */
+	if(self->pool && !self->profile && self->range_count < 2 && len >= 2 * DECODER_SEGMENT_MIN){
+#ifdef PARALLEL_DECODE_VERIFY
+		decoder_verify_t verify;
+		bool verified = decoder_verify_begin(self, &verify);
+		bool ret = decode_parallel(self, map, len);
+		if(verified){
+			decoder_verify_end(self, &verify, map, len);
+		}
+		return ret;
+#else
+		return decode_parallel(self, map, len);
+#endif
+	}
+	return decode_packets(self, map, len);
+}
@@ -27,6 +27,17 @@
 
 //#define DECODER_LOG
 
+/* timing attributed to the block a decoded segment (TIP to TIP) starts at */
+typedef struct block_profile_s{
+	uint64_t segments;
+	uint64_t cycles;	/* CYC packets */
+	uint64_t mtc;		/* MTC periods, the only time base if CYC is disabled */
+} block_profile_t;
+
+KHASH_INIT(PROFILE, khint64_t, block_profile_t, 1, kh_int64_hash_func, kh_int64_hash_equal)
+
+#define DECODER_MAX_RANGES	4	/* INTEL_PT_MAX_RANGES */
+
 typedef enum decoder_state { 
 	TraceDisabled=1,
 	TraceEnabledWithLastIP,
@@ -48,10 +59,12 @@ typedef struct ShouldDisasm{
 } should_disasm_t;
 
 
+typedef struct decoder_pool_s decoder_pool_t;
+
 typedef struct decoder_s{
 	uint64_t min_addr;
 	uint64_t max_addr;
-	void (*handler)(uint64_t);
+	void (*handler)(void*, uint64_t);
 	uint64_t last_tip;
 	uint64_t fup_tip;
 	uint64_t last_tip_tmp;
@@ -59,6 +72,24 @@ typedef struct decoder_s{
 	tnt_cache_t* tnt_cache_state;
 	decoder_state_machine_t* decoder_state;
 	should_disasm_t* decoder_state_result;
+	uint64_t packet_count;	/* packets consumed by the last decode_buffer() call */
+	bool ovf_resync;		/* treat OVF as a gap instead of trashing the run */
+	bool resync_pending;	/* OVF seen, waiting for the next FUP/TIP to resume at */
+	uint32_t ovf_gaps;		/* OVF gaps not yet collected by the caller */
+	uint64_t unknown_packets;	/* undecodable packets which trashed a run, see pt_decoder_stats() */
+
+	/* timing packets are only evaluated if profile is set */
+	khash_t(PROFILE) *profile;
+	uint64_t pending_cycles;
+	uint64_t pending_mtc;
+	int16_t last_ctc;		/* -1 until the first MTC after PSB/TMA */
+
+	uint64_t segment_entry;	/* IP of the first resynchronisation (parallel decoding) */
+	decoder_pool_t* pool;		/* worker threads, see pt_decoder_enable_parallel() */
+
+	/* trace ranges dispatched to by address, see pt_decoder_set_ranges() */
+	struct decoder_s* ranges[DECODER_MAX_RANGES];
+	uint8_t range_count;
 
 #ifdef DECODER_LOG
 	struct decoder_log_s{
@@ -67,6 +98,9 @@ typedef struct decoder_s{
 		uint64_t pip;
 		uint64_t cbr;
 		uint64_t ts;
+		uint64_t tsc;
+		uint64_t mtc;
+		uint64_t cyc;
 		uint64_t ovf;
 		uint64_t psbc;
 		uint64_t psbend;
@@ -83,10 +117,15 @@ typedef struct decoder_s{
 #endif
 } decoder_t;
 
-decoder_t* pt_decoder_init(CPUState *cpu, uint64_t min_addr, uint64_t max_addr, void (*handler)(uint64_t));
-/* returns false if the CPU trashed our tracing run */
+decoder_t* pt_decoder_init(CPUState *cpu, uint64_t min_addr, uint64_t max_addr, void (*handler)(void*, uint64_t), void* handler_opaque);
+/* returns false if the CPU trashed our tracing run, OVF only counts as gap with ovf_resync */
  __attribute__((hot)) bool decode_buffer(decoder_t* self, uint8_t* map, size_t len);
 void pt_decoder_destroy(decoder_t* self);
 void pt_decoder_flush(decoder_t* self);
+void pt_decoder_enable_profile(decoder_t* self);
+void pt_decoder_enable_parallel(decoder_t* self, uint32_t threads);
+void pt_decoder_replace_disassembler(decoder_t* self, disassembler_t* disassembler);
+void pt_decoder_set_ranges(decoder_t* self, decoder_t** ranges, uint8_t count);
+bool pt_decoder_write_profile(decoder_t* self, const char* file);
 
 #endif
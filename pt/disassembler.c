@@ -10,7 +10,13 @@
 #include "debug.h"
 #include "pt/disassembler.h"
 #include "qemu/log.h"
+#include "qemu/host-utils.h"
+#include "qemu/atomic.h"
+#include "qemu/timer.h"
 #include "pt/memory_access.h"
+#include "pt/cofi_decoder.h"
+#include <sys/mman.h>
+#include <pthread.h>
 
 #define LOOKUP_TABLES		5
 #define IGN_MOD_RM			0
@@ -22,10 +28,8 @@
 #define out_of_bounds(self, addr) ((addr < self->min_addr) | (addr > self->max_addr))
 
 #define FAST_ARRAY_LOOKUP
+//#define COFI_DECODER_VERIFY	/* cross-check every table-decoded instruction with capstone */
 
-#ifdef FAST_ARRAY_LOOKUP
-uint64_t* lookup_area = NULL;
-#endif
 cofi_ins cb_lookup[] = {
 	{X86_INS_JAE,		IGN_MOD_RM,	IGN_OPODE_PREFIX},
 	{X86_INS_JA,		IGN_MOD_RM,	IGN_OPODE_PREFIX},
@@ -126,77 +130,138 @@ uint8_t lookup_table_sizes[] = {
 
 /* ===== kAFL disassembler cofi list ===== */
 
-static cofi_list* create_list_head(void){
-	cofi_list* head = malloc(sizeof(cofi_list));
-	if (head != NULL){
-		head->list_ptr = NULL;
-		head->cofi_ptr = NULL;
-		head->cofi_target_ptr = NULL;
-		//head->cofi = NULL;
-		head->cofi.type = NO_DISASSEMBLY;
-		return head;
-	}
-	return NULL;
+static inline cofi_list* cofi_node(disassembler_t* self, uint32_t index){
+	return index ? &self->cofi_arena[index] : NULL;
 }
 
-static void free_list(cofi_list* head){
-	cofi_list *tmp1, *tmp2;
-	tmp1 = head;
-	while (1){
-		tmp2 = tmp1;
-		if(tmp1 == NULL){
-			break;
-		}
-		tmp1 = tmp1->list_ptr;
-		//if (tmp2->cofi != NULL){
-		//	free(tmp2->cofi);
-		//}
-		free(tmp2);
+static inline uint32_t cofi_index(disassembler_t* self, cofi_list* element){
+	return element ? element - self->cofi_arena : 0;
+}
+
+/* module relative, so that relocated trace regions still hit the same bitmap entries */
+static inline uint32_t edge_id(disassembler_t* self, uint64_t addr){
+	return mix_bits(addr - self->min_addr);
+}
+
+/* relaxed atomics: plain moves, but views share the links (see disassembler_view) */
+#define cofi_link_get(link)			atomic_read(&(link))
+#define cofi_link_set(link, index)	atomic_set(&(link), (index))
+
+#define COFI_ARENA_SIZE		((uint64_t)sizeof(cofi_list) * COFI_ARENA_MAX_NODES)
+
+/* 
+ * The arena is reserved PROT_NONE, which costs address space only (also with
+ * vm.overcommit_memory=2), and made writable in chunks once nodes get used.
+ */
+static bool cofi_arena_grow(disassembler_t* self, uint64_t nodes){
+	uint64_t committed = MIN(ROUND_UP(nodes, COFI_ARENA_CHUNK_NODES), COFI_ARENA_MAX_NODES);
+
+	QEMU_BUILD_BUG_ON((sizeof(cofi_list) * COFI_ARENA_CHUNK_NODES) % 0x1000);
+	if (nodes <= self->cofi_arena_committed){
+		return true;
 	}
+	if (nodes > COFI_ARENA_MAX_NODES ||
+		mprotect(&self->cofi_arena[self->cofi_arena_committed], sizeof(cofi_list) * (committed - self->cofi_arena_committed), PROT_READ | PROT_WRITE)){
+		return false;
+	}
+	self->cofi_arena_committed = committed;
+	return true;
 }
 
-static cofi_list* new_list_element(cofi_list* predecessor){ //, cofi_header* cofi){
-	if(predecessor){
-		cofi_list* next = malloc(sizeof(cofi_list));
-		if (next){
-			predecessor->list_ptr = next;
-			next->list_ptr = NULL;
-			next->cofi_ptr = NULL;
-			next->cofi_target_ptr = NULL;
-			//next->cofi = cofi;
-			next->cofi.type = NO_DISASSEMBLY;
-			return next;
-		}
+static cofi_list* new_list_element(disassembler_t* self){
+	cofi_list* next;
+	if (unlikely(self->cofi_arena_used == self->cofi_arena_committed) && !cofi_arena_grow(self, self->cofi_arena_used + 1)){
+		QEMU_PT_ERROR(DISASM_PREFIX, "cofi arena exhausted (%u nodes)", self->cofi_arena_used);
+		abort();
 	}
-	return NULL;
+	next = &self->cofi_arena[self->cofi_arena_used++];
+	next->cofi_ptr = 0;
+	next->cofi_target_ptr = 0;
+	next->target_id = 0;
+	next->next_id = 0;
+	next->cofi.type = NO_DISASSEMBLY;
+	return next;
 }
 
-static void edit_cofi_ptr(cofi_list* element, cofi_list* target){
+static void edit_cofi_ptr(disassembler_t* self, cofi_list* element, cofi_list* target){
 	if (element){
-		element->cofi_ptr = target;
+		element->cofi_ptr = cofi_index(self, target);
 	}
 }
 
 /* ===== kAFL disassembler hashmap ===== */
 
 #ifdef FAST_ARRAY_LOOKUP
-static void map_put(disassembler_t* self, uint64_t addr, uint64_t ref){
-	lookup_area[self->max_addr-addr] = ref;
+/* 
+ * Radix lookup table: the directory holds one chunk per 2MB of the trace
+ * region, a chunk one slot per page and a page table one entry per byte.
+ * Chunks and page tables are only allocated once code in them is
+ * disassembled, a sparse range of several GB costs a small directory.
+ */
+static inline uint64_t lookup_page_index(disassembler_t* self, uint64_t addr){
+	return (addr >> LOOKUP_PAGE_BITS) - (self->min_addr >> LOOKUP_PAGE_BITS);
+}
+
+static inline uint64_t lookup_dir_size(uint64_t pages){
+	return (pages + LOOKUP_CHUNK_MASK) >> LOOKUP_CHUNK_BITS;
+}
+
+static inline uint32_t* lookup_page(disassembler_t* self, uint64_t index){
+	uint32_t** chunk = self->lookup_area[index >> LOOKUP_CHUNK_BITS];
+	return chunk ? chunk[index & LOOKUP_CHUNK_MASK] : NULL;
+}
+
+/* page table slot of index, allocates the chunk holding it */
+static uint32_t** lookup_slot(disassembler_t* self, uint64_t index){
+	uint32_t*** chunk = &self->lookup_area[index >> LOOKUP_CHUNK_BITS];
+	if (unlikely(!*chunk)){
+		*chunk = g_new0(uint32_t*, 1ULL << LOOKUP_CHUNK_BITS);
+		self->lookup_chunks++;
+	}
+	return &(*chunk)[index & LOOKUP_CHUNK_MASK];
+}
+
+static void lookup_area_reset(disassembler_t* self){
+	for (uint64_t i = 0; i < lookup_dir_size(self->lookup_area_size); i++){
+		if (self->lookup_area[i]){
+			for (uint64_t j = 0; j <= LOOKUP_CHUNK_MASK; j++){
+				g_free(self->lookup_area[i][j]);
+			}
+			g_free(self->lookup_area[i]);
+			self->lookup_area[i] = NULL;
+		}
+	}
+	self->lookup_chunks = 0;
+	self->lookup_pages = 0;
+}
+
+static void map_put(disassembler_t* self, uint64_t addr, uint32_t ref){
+	uint32_t** slot = lookup_slot(self, lookup_page_index(self, addr));
+	if (unlikely(!*slot)){
+		*slot = g_new0(uint32_t, 1ULL << LOOKUP_PAGE_BITS);
+		self->lookup_pages++;
+	}
+	(*slot)[addr & LOOKUP_PAGE_MASK] = ref;
 }
 
-static int map_get(disassembler_t* self, uint64_t addr, uint64_t* ref){
-	*ref = lookup_area[self->max_addr-addr];
+static int map_get(disassembler_t* self, uint64_t addr, uint32_t* ref){
+	uint32_t* page = lookup_page(self, lookup_page_index(self, addr));
+	if (unlikely(!page)){
+		*ref = 0;
+		return 1;
+	}
+	*ref = page[addr & LOOKUP_PAGE_MASK];
 	return !(*ref);
 }
 #else
-static void map_put(disassembler_t* self, uint64_t addr, uint64_t ref){
+static void map_put(disassembler_t* self, uint64_t addr, uint32_t ref){
 	int ret;
 	khiter_t k;
 	k = kh_put(ADDR0, self->map, addr, &ret); 
 	kh_value(self->map, k) = ref;
 }
 
-static int map_get(disassembler_t* self, uint64_t addr, uint64_t* ref){
+static int map_get(disassembler_t* self, uint64_t addr, uint32_t* ref){
 	khiter_t k;
 	k = kh_get(ADDR0, self->map, addr); 
 	if(k != kh_end(self->map)){
@@ -207,6 +272,13 @@ static int map_get(disassembler_t* self, uint64_t addr, uint64_t* ref){
 }
 #endif
 
+/* ===== kAFL disassembler transition cache ===== */
+
+static inline transition_cache_entry_t* transition_cache_lookup(disassembler_t* self, cofi_list* obj, uint8_t tnt){
+	uint64_t key = (obj->cofi.ins_addr << TRANSITION_CACHE_BITS) | tnt;
+	return &self->transition_cache[(key * 0x9E3779B97F4A7C15ULL) >> (64 - TRANSITION_CACHE_SIZE_BITS)];
+}
+
 /* ===== kAFL disassembler engine ===== */
 
 static inline uint64_t fast_strtoull(const char *hexstring){
@@ -263,15 +335,118 @@ int get_capstone_mode(CPUState *cpu){
 	}
 }
 
+static bool read_code(disassembler_t* self, uint64_t address, uint8_t* data, uint32_t size){
+	if (!self->image){
+		return read_virtual_memory(address, data, size, self->cpu);
+	}
+	/* pre-disassembly works on the image snapshot, not on guest memory */
+	if (address < self->min_addr || address - self->min_addr + size > self->image_size){
+		return false;
+	}
+	memcpy(data, self->image + (address - self->min_addr), size);
+	return true;
+}
+
+static void open_capstone_mode(int mode, csh* handle, cs_insn** insn){
+	if (cs_open(CS_ARCH_X86, mode, handle) != CS_ERR_OK){
+		QEMU_PT_ERROR(DISASM_PREFIX, "capstone: cs_open() failed");
+		abort();
+	}
+	cs_option(*handle, CS_OPT_DETAIL, CS_OPT_ON);
+	// parse unrecognized instructions as data (endbr32/endbr64)
+	cs_option(*handle, CS_OPT_SKIPDATA, CS_OPT_ON);
+	*insn = cs_malloc(*handle);
+}
+
+static inline void open_capstone(disassembler_t* self, csh* handle, cs_insn** insn){
+	open_capstone_mode(get_capstone_mode(self->cpu), handle, insn);
+}
+
+static void decode_instruction(disassembler_t* self, cs_insn* insn, decoded_insn_t* res){
+	res->address = insn->address;
+	res->size = insn->size;
+	res->type = opcode_analyzer(self, insn);
+	if (res->type == COFI_TYPE_CONDITIONAL_BRANCH || res->type == COFI_TYPE_UNCONDITIONAL_DIRECT_BRANCH){
+		res->target_addr = hex_to_bin(insn->op_str);
+	} else {
+		res->target_addr = 0;
+	}
+}
+
+#ifdef COFI_DECODER_VERIFY
+static void verify_instruction(disassembler_t* self, csh* handle, cs_insn** insn, const uint8_t* code, size_t code_size, uint64_t address, decoded_insn_t* res){
+	decoded_insn_t ref;
+
+	if (!*insn){
+		open_capstone(self, handle, insn);
+	}
+	if (!cs_disasm_iter(*handle, &code, &code_size, &address, *insn)){
+		QEMU_PT_ERROR(DISASM_PREFIX, "cofi decoder: capstone failed at %lx (size %d)", res->address, res->size);
+		return;
+	}
+	decode_instruction(self, *insn, &ref);
+	if (ref.size != res->size || ref.type != res->type || ref.target_addr != res->target_addr){
+		QEMU_PT_ERROR(DISASM_PREFIX, "cofi decoder mismatch at %lx: %s %s (size %d/%d, type %d/%d, target %lx/%lx)",
+			res->address, (*insn)->mnemonic, (*insn)->op_str, res->size, ref.size, res->type, ref.type, res->target_addr, ref.target_addr);
+		*res = ref;
+	}
+}
+#endif
+
+/* 
+ * cs_disasm_iter() replacement: the table-driven decoder handles almost all
+ * instructions, capstone is only opened for the encodings it refuses.
+ */
+static bool decode_next(disassembler_t* self, csh* handle, cs_insn** insn, const uint8_t** code, size_t* code_size, uint64_t* address, decoded_insn_t* res){
+	if (cofi_decoder_decode(*code, *code_size, *address, self->cpu->disassembler_word_width == 64, res)){
+#ifdef COFI_DECODER_VERIFY
+		verify_instruction(self, handle, insn, *code, *code_size, *address, res);
+#endif
+		*code += res->size;
+		*code_size -= res->size;
+		*address += res->size;
+		return true;
+	}
+
+	if (!*insn){
+		open_capstone(self, handle, insn);
+	}
+	if (!cs_disasm_iter(*handle, code, code_size, address, *insn)){
+		return false;
+	}
+	decode_instruction(self, *insn, res);
+	return true;
+}
+
+/* decode_next() which prefers the pre-decoded instruction table */
+static bool next_instruction(disassembler_t* self, csh* handle, cs_insn** insn, const uint8_t** code, size_t* code_size, uint64_t* address, decoded_insn_t* res){
+	predecoded_insn_t* p;
+
+	if (self->predecode && *address >= self->min_addr && *address - self->min_addr < self->image_size){
+		p = &self->predecode[*address - self->min_addr];
+		if (p->size && p->size <= *code_size){
+			res->address = *address;
+			res->size = p->size;
+			res->type = p->type;
+			res->target_addr = p->type == NO_COFI_TYPE ? 0 : *address + p->disp;
+			*code += p->size;
+			*code_size -= p->size;
+			*address += p->size;
+			return true;
+		}
+	}
+	return decode_next(self, handle, insn, code, code_size, address, res);
+}
+
 static cofi_list* analyse_assembly(disassembler_t* self, uint64_t base_address){
 	csh handle;
-	cs_insn *insn;
-	cofi_type type;
+	cs_insn *insn = NULL;
+	decoded_insn_t ins;
   //cofi_header* tmp = NULL;
-	uint64_t tmp_list_element = 0;
+	uint32_t tmp_list_element = 0;
 	bool last_nop = false;
 	uint64_t cofi = 0;
-	uint8_t* code = NULL;
+	const uint8_t* code = NULL;
 	uint8_t tmp_code[x86_64_PAGE_SIZE*2];
 	size_t code_size = 0;
 	uint64_t address = base_address;
@@ -280,68 +455,61 @@ static cofi_list* analyse_assembly(disassembler_t* self, uint64_t base_address){
   	//bool abort_disassembly = false;
 
 	code_size = x86_64_PAGE_SIZE - (address & ~x86_64_PAGE_MASK);
-	if (!read_virtual_memory(address, tmp_code, code_size, self->cpu))
+	if (!read_code(self, address, tmp_code, code_size))
 		return NULL;
 	if (code_size < 15) {
 		// instruction may continue onto next page, try reading it..
-		if (read_virtual_memory(address, tmp_code, code_size + x86_64_PAGE_SIZE, self->cpu))
+		if (read_code(self, address, tmp_code, code_size + x86_64_PAGE_SIZE))
 			code_size += x86_64_PAGE_SIZE;
 	}
 	code = tmp_code;
 
-	assert(cs_open(CS_ARCH_X86, get_capstone_mode(self->cpu), &handle) == CS_ERR_OK);
-	cs_option(handle, CS_OPT_DETAIL, CS_OPT_ON);
-	// parse unrecognized instructions as data (endbr32/endbr64)
-	cs_option(handle, CS_OPT_SKIPDATA, CS_OPT_ON);
-	insn = cs_malloc(handle);
-
 	QEMU_PT_DEBUG(DISASM_PREFIX, "Analyse ASM: %lx (%zd), max_addr=%lx", address, code_size, self->max_addr);
 
-	while(cs_disasm_iter(handle, (const uint8_t**)&code, &code_size, &address, insn)) {	
+	/* existing nodes may be relinked below -> invalidate all cached transitions */
+	self->transition_cache_gen++;
+
+	while(next_instruction(self, &handle, &insn, &code, &code_size, &address, &ins)) {	
 
-		QEMU_PT_DEBUG(DISASM_PREFIX, "Loop: %lx:\t%s\t%s, last_nop=%d", insn->address, insn->mnemonic, insn->op_str, last_nop);
+		QEMU_PT_DEBUG(DISASM_PREFIX, "Loop: %lx:\t(%d) size=%d, last_nop=%d", ins.address, ins.type, ins.size, last_nop);
 
-		if (insn->address > self->max_addr){
+		if (ins.address > self->max_addr){
 			break;
 		}
-			
-		type = opcode_analyzer(self, insn);
 		
 		if (!last_nop){
 			if (cofi)
 				predecessor = self->list_element;
 
-			self->list_element = new_list_element(self->list_element);
+			self->list_element = new_list_element(self);
 			self->list_element->cofi.type = NO_COFI_TYPE;
-			self->list_element->cofi.ins_addr = insn->address;
-			self->list_element->cofi.ins_size = insn->size;
+			self->list_element->cofi.ins_addr = ins.address;
+			self->list_element->cofi.ins_size = ins.size;
 			self->list_element->cofi.target_addr = 0;
 
-			edit_cofi_ptr(predecessor, self->list_element);
+			edit_cofi_ptr(self, predecessor, self->list_element);
 		}
 		
-		if (!map_get(self, insn->address, (uint64_t *)&tmp_list_element)){
-			if(((cofi_list *)tmp_list_element)->cofi_ptr){
-				edit_cofi_ptr(self->list_element, (cofi_list *)tmp_list_element);
+		if (!map_get(self, ins.address, &tmp_list_element)){
+			if(cofi_node(self, tmp_list_element)->cofi_ptr){
+				edit_cofi_ptr(self, self->list_element, cofi_node(self, tmp_list_element));
 				break;
 			} else {
-				self->list_element = (cofi_list *)tmp_list_element;
+				self->list_element = cofi_node(self, tmp_list_element);
 			}
 		}
 		
-		if (type != NO_COFI_TYPE){
+		if (ins.type != NO_COFI_TYPE){
 			cofi++;
 			last_nop = false;
-			self->list_element->cofi.type = type;
-			self->list_element->cofi.ins_addr = insn->address;
-			self->list_element->cofi.ins_size = insn->size;
-			if (type == COFI_TYPE_CONDITIONAL_BRANCH || type == COFI_TYPE_UNCONDITIONAL_DIRECT_BRANCH){
-				self->list_element->cofi.target_addr = hex_to_bin(insn->op_str);	
-			} else {
-				self->list_element->cofi.target_addr = 0;
-			}
+			self->list_element->cofi.type = ins.type;
+			self->list_element->cofi.ins_addr = ins.address;
+			self->list_element->cofi.ins_size = ins.size;
+			self->list_element->cofi.target_addr = ins.target_addr;
+			self->list_element->target_id = edge_id(self, ins.target_addr);
+			self->list_element->next_id = edge_id(self, ins.address + ins.size);
 			//self->list_element->cofi = tmp;
-			map_put(self, self->list_element->cofi.ins_addr, (uint64_t)(self->list_element));
+			map_put(self, self->list_element->cofi.ins_addr, cofi_index(self, self->list_element));
 			//if(type == COFI_TYPE_INDIRECT_BRANCH || type == COFI_TYPE_NEAR_RET || type == COFI_TYPE_FAR_TRANSFERS){
 				//don't disassembly through ret and similar instructions to avoid disassembly inline data
 				//however we need to finish the cofi ptr datatstructure therefore we take a second loop iteration and abort
@@ -351,7 +519,7 @@ static cofi_list* analyse_assembly(disassembler_t* self, uint64_t base_address){
 			//}
 		} else {
 			last_nop = true;
-			map_put(self, insn->address, (uint64_t)(self->list_element));
+			map_put(self, ins.address, cofi_index(self, self->list_element));
 		}
 		
 		if (!first){
@@ -363,57 +531,650 @@ static cofi_list* analyse_assembly(disassembler_t* self, uint64_t base_address){
 		//}
 	}
 	
-	cs_free(insn, 1);
-	cs_close(&handle);
+	if (insn){
+		cs_free(insn, 1);
+		cs_close(&handle);
+	}
 	return first;
 }
-disassembler_t* init_disassembler(CPUState *cpu, uint64_t min_addr, uint64_t max_addr, void (*pt_bitmap)(uint64_t)){
-	disassembler_t* res = malloc(sizeof(disassembler_t));
+
+/* returns NULL for an empty or oversized trace region */
+disassembler_t* init_disassembler(CPUState *cpu, uint64_t min_addr, uint64_t max_addr, void (*pt_bitmap)(void*, uint64_t), void* handler_opaque){
+	disassembler_t* res;
+
+	if (max_addr <= min_addr || max_addr - min_addr >= LOOKUP_MAX_RANGE){
+		QEMU_PT_ERROR(DISASM_PREFIX, "Invalid trace region 0x%lx-0x%lx", min_addr, max_addr);
+		return NULL;
+	}
+
+	res = malloc(sizeof(disassembler_t));
+	if (!res){
+		return NULL;
+	}
+#ifdef FAST_ARRAY_LOOKUP
+	res->lookup_area_size = (max_addr >> LOOKUP_PAGE_BITS) - (min_addr >> LOOKUP_PAGE_BITS) + 1;
+	res->lookup_area = g_try_new0(uint32_t**, lookup_dir_size(res->lookup_area_size));
+	if (!res->lookup_area){
+		free(res);
+		return NULL;
+	}
+	res->lookup_chunks = 0;
+	res->lookup_pages = 0;
+#else
+	res->map = kh_init(ADDR0);
+#endif
 	res->cpu = cpu;
 	res->min_addr = min_addr;
 	res->max_addr = max_addr;
 	res->handler = pt_bitmap;
-	res->list_head = create_list_head();
-	res->list_element = res->list_head;
+	res->handler_opaque = handler_opaque;
+	res->cofi_arena = mmap(NULL, COFI_ARENA_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (res->cofi_arena == MAP_FAILED){
+#ifdef FAST_ARRAY_LOOKUP
+		g_free(res->lookup_area);
+#else
+		kh_destroy(ADDR0, res->map);
+#endif
+		free(res);
+		return NULL;
+	}
+	res->cofi_arena_used = 0;
+	res->cofi_arena_committed = 0;
+	res->list_element = new_list_element(res);	/* list head, index 0 */
 	res->has_pending_indirect_branch = false;
 	res->pending_indirect_branch_src = 0;
+	res->reported_target = 0;
+	res->range_exit = 0;
+	res->transition_cache = malloc(sizeof(transition_cache_entry_t) * (1 << TRANSITION_CACHE_SIZE_BITS));
+	memset(res->transition_cache, 0x00, sizeof(transition_cache_entry_t) * (1 << TRANSITION_CACHE_SIZE_BITS));
+	res->transition_cache_gen = 1;
+	res->cache_file = NULL;
+	res->cofi_arena_synced = 0;
+	res->cache_image_hash = 0;
+	res->image = NULL;
+	res->image_size = 0;
+	res->predecode = NULL;
+	res->parent = NULL;
+	res->view_miss = false;
+	res->edge_sink = NULL;
+	return res;
+}
 
+void destroy_disassembler(disassembler_t* self){
 #ifdef FAST_ARRAY_LOOKUP
-	assert((max_addr-min_addr) <= (128 << 20)); /* up to 128MB trace region (results in 512MB lookup table...) */
-	lookup_area = malloc(sizeof(uint64_t) * (max_addr-min_addr));
-	memset(lookup_area, 0x00, (sizeof(uint64_t) * (max_addr-min_addr)));
+	lookup_area_reset(self);
+	g_free(self->lookup_area);
 #else
-	res->map = kh_init(ADDR0);
+	kh_destroy(ADDR0, self->map);
 #endif
+	munmap(self->cofi_arena, COFI_ARENA_SIZE);
+	free(self->transition_cache);
+	free(self->cache_file);
+	free(self);
+}
 
+/* 
+ * Read-only view for parallel decoding: shares the CFG of parent, but has its
+ * own handler and transition cache. A view never disassembles, get_obj() fails
+ * and sets view_miss instead. Views only ever fill in missing links of shared
+ * nodes with the index the parent would have stored, the parent itself must
+ * not be used while views are. Several views may store the same link at once,
+ * so get_obj() and trace_disassembler() go through cofi_link_get() / _set().
+ */
+disassembler_t* disassembler_view(disassembler_t* parent, void (*handler)(void*, uint64_t), void* handler_opaque){
+	disassembler_t* res = malloc(sizeof(disassembler_t));
+	*res = *parent;
+	res->handler = handler;
+	res->handler_opaque = handler_opaque;
+	res->has_pending_indirect_branch = false;
+	res->pending_indirect_branch_src = 0;
+	res->reported_target = 0;
+	res->range_exit = 0;
+	res->transition_cache = malloc(sizeof(transition_cache_entry_t) * (1 << TRANSITION_CACHE_SIZE_BITS));
+	memset(res->transition_cache, 0x00, sizeof(transition_cache_entry_t) * (1 << TRANSITION_CACHE_SIZE_BITS));
+	res->cache_file = NULL;
+	res->image = NULL;
+	res->predecode = NULL;
+	res->parent = parent;
+	res->view_miss = false;
+	res->edge_sink = NULL;	/* views record addresses, the merge reports them */
 	return res;
 }
 
-void destroy_disassembler(disassembler_t* self){
+/* picks up CFG growth of the parent, the parent bumps the generation whenever it grows */
+void disassembler_view_sync(disassembler_t* self){
+	self->transition_cache_gen = self->parent->transition_cache_gen;
+	self->view_miss = false;
+}
+
+void destroy_disassembler_view(disassembler_t* self){
+	free(self->transition_cache);
+	free(self);
+}
+
+/* 
+ * Lets trace_disassembler() update the bitmap shard directly with the edge ids
+ * precomputed for every cofi node. Only for the plain bitmap handler: coverage
+ * maps and sample dumps need the addresses.
+ */
+void disassembler_set_edge_sink(disassembler_t* self, edge_sink_t* sink){
+	self->edge_sink = sink;
+	self->transition_cache_gen++;	/* cached edges switch from addresses to ids */
+}
+
+static inline void report_addr(disassembler_t* self, uint64_t addr){
+	if (likely(self->edge_sink)){
+		edge_sink_add(self->edge_sink, edge_id(self, addr));
+	} else {
+		self->handler(self->handler_opaque, addr);
+	}
+}
+
+static inline void report_edge(disassembler_t* self, uint64_t addr, uint32_t id){
+	if (likely(self->edge_sink)){
+		edge_sink_add(self->edge_sink, id);
+	} else {
+		self->handler(self->handler_opaque, addr);
+	}
+}
+
+void disassembler_report(disassembler_t* self, uint64_t addr){
+	report_addr(self, addr);
+}
+
+/* moves the pending indirect branch state when the trace continues in another range */
+void disassembler_handover(disassembler_t* from, disassembler_t* to){
+	if (from == to){
+		return;
+	}
+	to->has_pending_indirect_branch = from->has_pending_indirect_branch;
+	to->pending_indirect_branch_src = from->pending_indirect_branch_src;
+	to->reported_target = from->reported_target;
+	disassembler_flush(from);
+}
+
+void disassembler_get_stats(disassembler_t* self, uint64_t* cofi_nodes, uint64_t* cofi_bytes, uint64_t* lookup_bytes, uint64_t* cache_bytes){
+	*cofi_nodes = self->cofi_arena_used - 1;
+	*cofi_bytes = sizeof(cofi_list) * self->cofi_arena_used;
 #ifdef FAST_ARRAY_LOOKUP
-	free(lookup_area);
+	*lookup_bytes = (sizeof(uint32_t**) * lookup_dir_size(self->lookup_area_size)) +
+		((sizeof(uint32_t*) << LOOKUP_CHUNK_BITS) * self->lookup_chunks) + ((sizeof(uint32_t) << LOOKUP_PAGE_BITS) * self->lookup_pages);
 #else
-	kh_destroy(ADDR0, self->map);
+	*lookup_bytes = kh_n_buckets(self->map) * (sizeof(khint32_t) + sizeof(uint64_t));
 #endif
-	free_list(self->list_head);
-	free(self);
+	*cache_bytes = sizeof(transition_cache_entry_t) * (1 << TRANSITION_CACHE_SIZE_BITS);
+}
+
+/* ===== kAFL disassembler CFG cache ===== */
+
+/*
+ * File layout: header, cofi arena (page aligned, mapped MAP_PRIVATE on load so
+ * that parallel instances share the page cache until a node is patched) and
+ * one {page index, lookup table} record per materialised lookup page.
+ */
+#define CFG_CACHE_MAGIC		0x4746434c46414bULL	/* "KAFLCFG" */
+#define CFG_CACHE_VERSION	2
+#define CFG_CACHE_NODE_SIZE	40		/* sizeof(cofi_list) of this version */
+#define CFG_CACHE_ALIGN		0x1000ULL
+
+#define cfg_cache_align(x)	(((x) + CFG_CACHE_ALIGN - 1) & ~(CFG_CACHE_ALIGN - 1))
+#define cfg_cache_page_size	(sizeof(uint64_t) + (sizeof(uint32_t) << LOOKUP_PAGE_BITS))
+
+typedef struct cfg_cache_header_s{
+	uint64_t magic;
+	uint32_t version;
+	uint32_t word_width;
+	uint64_t min_addr;
+	uint64_t max_addr;
+	uint64_t image_hash;		/* a rebuilt module at the same address must not reuse the CFG */
+	uint64_t nodes;
+	uint64_t pages;
+} cfg_cache_header_t;
+
+#ifdef FAST_ARRAY_LOOKUP
+/* every arena index in the file has to point into the arena, the file might be truncated or corrupt */
+static bool cache_page_valid(uint32_t* page, uint64_t nodes){
+	for (uint64_t i = 0; i < (1ULL << LOOKUP_PAGE_BITS); i++){
+		if (page[i] >= nodes){
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool cache_nodes_valid(cofi_list* arena, uint64_t nodes){
+	for (uint64_t i = 0; i < nodes; i++){
+		if (arena[i].cofi_ptr >= nodes || arena[i].cofi_target_ptr >= nodes ||
+			(uint32_t)arena[i].cofi.type > NO_DISASSEMBLY){
+			return false;
+		}
+	}
+	return true;
+}
+
+/* back to an empty arena after a failed load */
+static void cache_reset_arena(disassembler_t* self, uint64_t nodes_size){
+	/* MAP_FIXED may already have dropped the old mapping, there is no way back without a new one */
+	if (mmap(self->cofi_arena, nodes_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0) == MAP_FAILED){
+		QEMU_PT_ERROR(DISASM_PREFIX, "cannot remap the cofi arena");
+		abort();
+	}
+	self->cofi_arena_used = 0;
+	self->list_element = new_list_element(self);
+	lookup_area_reset(self);
+}
+
+static bool load_cache(disassembler_t* self, int fd, uint64_t image_hash){
+	cfg_cache_header_t hdr;
+	struct stat st;
+	uint64_t nodes_size, offset, index;
+	uint32_t* page;
+
+	if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) || fstat(fd, &st)){
+		return false;
+	}
+	if (hdr.magic != CFG_CACHE_MAGIC || hdr.version != CFG_CACHE_VERSION || 
+		hdr.min_addr != self->min_addr || hdr.max_addr != self->max_addr || hdr.image_hash != image_hash ||
+		hdr.nodes < 2 || hdr.nodes > COFI_ARENA_MAX_NODES || hdr.pages > self->lookup_area_size){
+		return false;
+	}
+	if (self->cpu->disassembler_word_width && hdr.word_width != self->cpu->disassembler_word_width){
+		return false;
+	}
+	nodes_size = cfg_cache_align(sizeof(cofi_list) * hdr.nodes);
+	if ((uint64_t)st.st_size != CFG_CACHE_ALIGN + nodes_size + (hdr.pages * cfg_cache_page_size)){
+		return false;
+	}
+
+	offset = CFG_CACHE_ALIGN + nodes_size;
+	for (uint64_t i = 0; i < hdr.pages; i++){
+		if (pread(fd, &index, sizeof(uint64_t), offset) != sizeof(uint64_t) ||
+			index >= self->lookup_area_size || lookup_page(self, index)){
+			lookup_area_reset(self);
+			return false;
+		}
+		page = g_new(uint32_t, 1ULL << LOOKUP_PAGE_BITS);
+		if (pread(fd, page, sizeof(uint32_t) << LOOKUP_PAGE_BITS, offset + sizeof(uint64_t)) != (sizeof(uint32_t) << LOOKUP_PAGE_BITS) ||
+			!cache_page_valid(page, hdr.nodes)){
+			g_free(page);
+			lookup_area_reset(self);
+			return false;
+		}
+		*lookup_slot(self, index) = page;
+		self->lookup_pages++;
+		offset += cfg_cache_page_size;
+	}
+
+	/* the file is mapped over committed chunks, the rest of the arena stays reserved */
+	if (!cofi_arena_grow(self, hdr.nodes)){
+		lookup_area_reset(self);
+		return false;
+	}
+	if (mmap(self->cofi_arena, nodes_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, CFG_CACHE_ALIGN) == MAP_FAILED ||
+		!cache_nodes_valid(self->cofi_arena, hdr.nodes)){
+		cache_reset_arena(self, nodes_size);
+		return false;
+	}
+
+	self->cofi_arena_used = hdr.nodes;
+	self->cofi_arena_synced = hdr.nodes;
+	self->list_element = &self->cofi_arena[hdr.nodes - 1];
+	return true;
+}
+
+/* 
+ * Must be called on a freshly initialised disassembler. Loads the CFG from
+ * file if it exists and matches the trace region, and remembers the file for
+ * disassembler_sync_cache().
+ */
+bool disassembler_attach_cache(disassembler_t* self, const char* file, uint64_t image_hash){
+	int fd;
+	bool ret;
+
+	assert(self->cofi_arena_used == 1 && !self->lookup_pages);
+	free(self->cache_file);
+	self->cache_file = strdup(file);
+	self->cache_image_hash = image_hash;
+
+	fd = open(file, O_RDONLY);
+	if (fd == -1){
+		return false;
+	}
+	ret = load_cache(self, fd, image_hash);
+	close(fd);
+	return ret;
+}
+
+/* 
+ * Writes the CFG to a temporary file which is then renamed over the cache file,
+ * instances which have mapped the previous version keep using their copy.
+ */
+bool disassembler_sync_cache(disassembler_t* self){
+	cfg_cache_header_t hdr;
+	char* tmp_file;
+	FILE* fd;
+	bool ret = true;
+	uint64_t nodes_size;
+
+	if (!self->cache_file || self->cofi_arena_used == self->cofi_arena_synced || !self->cpu->disassembler_word_width){
+		return true;
+	}
+
+	/* a node layout change has to bump the version */
+	QEMU_BUILD_BUG_ON(sizeof(cofi_list) != CFG_CACHE_NODE_SIZE);
+
+	hdr.magic = CFG_CACHE_MAGIC;
+	hdr.version = CFG_CACHE_VERSION;
+	hdr.word_width = self->cpu->disassembler_word_width;
+	hdr.min_addr = self->min_addr;
+	hdr.max_addr = self->max_addr;
+	hdr.image_hash = self->cache_image_hash;
+	hdr.nodes = self->cofi_arena_used;
+	hdr.pages = self->lookup_pages;
+	nodes_size = cfg_cache_align(sizeof(cofi_list) * hdr.nodes);
+
+	tmp_file = malloc(strlen(self->cache_file) + 16);
+	sprintf(tmp_file, "%s.%d", self->cache_file, getpid());
+	fd = fopen(tmp_file, "wb");
+	if (!fd){
+		free(tmp_file);
+		return false;
+	}
+
+	ret &= fwrite(&hdr, sizeof(hdr), 1, fd) == 1;
+	ret &= !fseek(fd, CFG_CACHE_ALIGN, SEEK_SET);
+	ret &= fwrite(self->cofi_arena, sizeof(cofi_list), hdr.nodes, fd) == hdr.nodes;
+	ret &= !fseek(fd, CFG_CACHE_ALIGN + nodes_size, SEEK_SET);
+	for (uint64_t i = 0; i < self->lookup_area_size && ret; i++){
+		uint32_t* page = lookup_page(self, i);
+		if (page){
+			ret &= fwrite(&i, sizeof(uint64_t), 1, fd) == 1;
+			ret &= fwrite(page, sizeof(uint32_t) << LOOKUP_PAGE_BITS, 1, fd) == 1;
+		}
+	}
+	/* no lookup page after the arena -> extend the file up to the aligned end */
+	ret &= !fflush(fd) && !ftruncate(fileno(fd), CFG_CACHE_ALIGN + nodes_size + (hdr.pages * cfg_cache_page_size));
+	ret &= !fclose(fd);
+
+	if (ret && !rename(tmp_file, self->cache_file)){
+		self->cofi_arena_synced = hdr.nodes;
+	} else {
+		QEMU_PT_ERROR(DISASM_PREFIX, "Error writing CFG cache %s", self->cache_file);
+		unlink(tmp_file);
+		ret = false;
+	}
+	free(tmp_file);
+	return ret;
+}
+#else
+bool disassembler_attach_cache(disassembler_t* self, const char* file, uint64_t image_hash){
+	return false;
+}
+
+bool disassembler_sync_cache(disassembler_t* self){
+	return true;
+}
+#endif
+
+/* ===== kAFL disassembler pre-disassembly ===== */
+
+typedef struct predisasm_worker_s{
+	disassembler_t* self;
+	uint64_t start;		/* owned instruction addresses: start - end-1 */
+	uint64_t end;
+	volatile bool* abort;
+	pthread_t thread;
+	bool running;
+} predisasm_worker_t;
+
+/* 
+ * Decodes from address up to the end of its page (reads are bounded like in
+ * analyse_assembly) or up to the first instruction which is already known,
+ * as the remaining stream would be decoded the same way.
+ */
+static void predecode_run(disassembler_t* self, csh* handle, cs_insn** insn, uint64_t address, uint64_t end){
+	uint64_t image_end = self->min_addr + self->image_size;
+	const uint8_t* code = self->image + (address - self->min_addr);
+	size_t code_size = MIN(x86_64_PAGE_SIZE - (address & ~x86_64_PAGE_MASK), image_end - address);
+	decoded_insn_t ins;
+	predecoded_insn_t* p;
+	int64_t disp;
+
+	if (code_size < 15 && address + code_size + x86_64_PAGE_SIZE <= image_end){
+		code_size += x86_64_PAGE_SIZE;
+	}
+
+	while(decode_next(self, handle, insn, &code, &code_size, &address, &ins)){
+		if (ins.address >= end){
+			break;
+		}
+		p = &self->predecode[ins.address - self->min_addr];
+		if (p->size){
+			break;
+		}
+		disp = ins.target_addr - ins.address;
+		if (ins.type != NO_COFI_TYPE && disp != (int32_t)disp){
+			continue;	/* left to capstone */
+		}
+		p->type = ins.type;
+		p->disp = disp;
+		p->size = ins.size;
+	}
+}
+
+static void* predisasm_worker(void* arg){
+	predisasm_worker_t* w = arg;
+	disassembler_t* self = w->self;
+	predecoded_insn_t* p;
+	uint64_t target;
+	csh handle;
+	cs_insn* insn = NULL;
+	bool changed = true;
+
+	/* linear sweep of every page ... */
+	for (uint64_t page = w->start; page < w->end && !*w->abort; page = (page & x86_64_PAGE_MASK) + x86_64_PAGE_SIZE){
+		predecode_run(self, &handle, &insn, page, w->end);
+	}
+
+	/* ... and direct branch targets the sweep was out of sync with */
+	while (changed && !*w->abort){
+		changed = false;
+		for (uint64_t addr = w->start; addr < w->end; addr++){
+			p = &self->predecode[addr - self->min_addr];
+			if (p->size && (p->type == COFI_TYPE_CONDITIONAL_BRANCH || p->type == COFI_TYPE_UNCONDITIONAL_DIRECT_BRANCH)){
+				target = addr + p->disp;
+				if (target >= w->start && target < w->end && !self->predecode[target - self->min_addr].size){
+					predecode_run(self, &handle, &insn, target, w->end);
+					changed |= !!self->predecode[target - self->min_addr].size;
+				}
+			}
+		}
+	}
+
+	if (insn){
+		cs_free(insn, 1);
+		cs_close(&handle);
+	}
+	return NULL;
+}
+
+/* builds the CFG from the pre-decoded table: every page start plus all direct branch edges */
+static void predisasm_build(disassembler_t* self, volatile bool* abort){
+	uint64_t image_end = self->min_addr + self->image_size;
+	uint64_t next[2];
+	cofi_header* cofi;
+	uint32_t index;
+
+	for (uint64_t addr = self->min_addr; addr < image_end && !*abort; addr = (addr & x86_64_PAGE_MASK) + x86_64_PAGE_SIZE){
+		if (map_get(self, addr, &index)){
+			analyse_assembly(self, addr);
+		}
+	}
+
+	/* the arena grows while iterating, new nodes are visited as well */
+	for (uint32_t i = 1; i < self->cofi_arena_used && !*abort; i++){
+		cofi = &self->cofi_arena[i].cofi;
+		if (cofi->type != COFI_TYPE_CONDITIONAL_BRANCH && cofi->type != COFI_TYPE_UNCONDITIONAL_DIRECT_BRANCH){
+			continue;
+		}
+		next[0] = cofi->target_addr;
+		next[1] = cofi->type == COFI_TYPE_CONDITIONAL_BRANCH ? cofi->ins_addr + cofi->ins_size : 0;
+		for (uint8_t j = 0; j < 2; j++){
+			if (next[j] >= self->min_addr && next[j] < image_end && map_get(self, next[j], &index)){
+				analyse_assembly(self, next[j]);
+			}
+		}
+	}
+}
+
+/* 
+ * Disassembles a snapshot of the trace region ahead of time. Instructions are
+ * decoded by threads workers on disjoint page ranges, the resulting instruction
+ * table is then linked into cofi lists without decoding them again (except for
+ * the few instructions the workers could not reach). Returns NULL if aborted.
+ */
+disassembler_t* predisassemble(CPUState *cpu, uint64_t min_addr, uint64_t max_addr, void (*handler)(void*, uint64_t), void* handler_opaque, uint8_t* image, uint64_t image_size, uint32_t threads, volatile bool* abort){
+	disassembler_t* res = init_disassembler(cpu, min_addr, max_addr, handler, handler_opaque);
+	predisasm_worker_t* workers;
+	uint64_t first_page, image_end, chunk;
+
+	if (!res){
+		return NULL;
+	}
+	workers = malloc(sizeof(predisasm_worker_t) * threads);
+	res->image = image;
+	res->image_size = MIN(image_size, max_addr - min_addr + 1);
+	res->predecode = mmap(NULL, sizeof(predecoded_insn_t) * res->image_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	assert(res->predecode != MAP_FAILED);
+
+	image_end = min_addr + res->image_size;
+	first_page = min_addr & x86_64_PAGE_MASK;
+	chunk = DIV_ROUND_UP(DIV_ROUND_UP(image_end - first_page, x86_64_PAGE_SIZE), threads) * x86_64_PAGE_SIZE;
+
+	for (uint32_t i = 0; i < threads; i++){
+		workers[i].self = res;
+		workers[i].start = MAX(min_addr, first_page + (i * chunk));
+		workers[i].end = MIN(image_end, first_page + ((i + 1) * chunk));
+		workers[i].abort = abort;
+		workers[i].running = false;
+		if (workers[i].start < workers[i].end){
+			workers[i].running = !pthread_create(&workers[i].thread, NULL, predisasm_worker, &workers[i]);
+			if (!workers[i].running){
+				/* no thread, sweep this part on the caller's */
+				predisasm_worker(&workers[i]);
+			}
+		}
+	}
+	for (uint32_t i = 0; i < threads; i++){
+		if (workers[i].running){
+			pthread_join(workers[i].thread, NULL);
+		}
+	}
+	free(workers);
+
+	if (!*abort){
+		predisasm_build(res, abort);
+	}
+
+	munmap(res->predecode, sizeof(predecoded_insn_t) * res->image_size);
+	res->predecode = NULL;
+	res->image = NULL;
+	res->image_size = 0;
+
+	if (*abort){
+		destroy_disassembler(res);
+		return NULL;
+	}
+	return res;
+}
+
+/* 
+ * Linear sweep over a raw code image with capstone (as analyse_assembly() used
+ * to decode, minus the per-call cs_open()) and with the table-driven decoder.
+ * Afterwards every capstone instruction is decoded again to count mismatches.
+ */
+void disassembler_bench(const uint8_t* image, size_t size, bool mode64, uint32_t iterations, uint64_t* instructions, uint64_t* capstone_nsec, uint64_t* table_nsec, uint64_t* fallbacks, uint64_t* mismatches){
+	csh handle;
+	cs_insn* insn;
+	decoded_insn_t ins, ref;
+	const uint8_t* code;
+	size_t code_size;
+	uint64_t address;
+	int64_t start;
+
+	*instructions = *capstone_nsec = *table_nsec = *fallbacks = *mismatches = 0;
+	open_capstone_mode(mode64 ? CS_MODE_64 : CS_MODE_32, &handle, &insn);
+
+	start = get_clock();
+	for (uint32_t i = 0; i < iterations; i++){
+		code = image;
+		code_size = size;
+		address = 0;
+		while (cs_disasm_iter(handle, &code, &code_size, &address, insn)){
+			decode_instruction(NULL, insn, &ins);
+			(*instructions)++;
+		}
+	}
+	*capstone_nsec = get_clock() - start;
+
+	start = get_clock();
+	for (uint32_t i = 0; i < iterations; i++){
+		code = image;
+		code_size = size;
+		address = 0;
+		while (code_size){
+			if (cofi_decoder_decode(code, code_size, address, mode64, &ins)){
+				code += ins.size;
+				code_size -= ins.size;
+				address += ins.size;
+			} else if (cs_disasm_iter(handle, &code, &code_size, &address, insn)){
+				(*fallbacks)++;
+			} else {
+				break;
+			}
+		}
+	}
+	*table_nsec = get_clock() - start;
+	*fallbacks /= iterations;
+
+	code = image;
+	code_size = size;
+	address = 0;
+	while (cs_disasm_iter(handle, &code, &code_size, &address, insn)){
+		decode_instruction(NULL, insn, &ref);
+		if (cofi_decoder_decode(image + ref.address, size - ref.address, ref.address, mode64, &ins) && 
+			(ins.size != ref.size || ins.type != ref.type || ins.target_addr != ref.target_addr)){
+			QEMU_PT_DEBUG(DISASM_PREFIX, "cofi decoder mismatch at %lx: %s %s", ref.address, insn->mnemonic, insn->op_str);
+			(*mismatches)++;
+		}
+	}
+
+	cs_free(insn, 1);
+	cs_close(&handle);
 }
 
 static inline cofi_list* get_obj(disassembler_t* self, uint64_t entry_point){
 	cofi_list *tmp_obj;
+	uint32_t index;
 
 	if (out_of_bounds(self, entry_point)){
 		assert(false);
 		return NULL;
 	}
 
-	if(map_get(self, entry_point, (uint64_t *)&tmp_obj)){
+	if(map_get(self, entry_point, &index)){
+		if(unlikely(self->parent)){
+			self->view_miss = true;
+			return NULL;
+		}
 		tmp_obj = analyse_assembly(self, entry_point);
+	} else {
+		tmp_obj = cofi_node(self, index);
 	}
 
 	// Decoding can fail on code read or decoding errors
 	// Fuzzing will usually still work but traces may not be accurate.
-	if (!tmp_obj || !tmp_obj->cofi_ptr)
+	if (!tmp_obj || !cofi_link_get(tmp_obj->cofi_ptr))
 		return NULL;
 
 	return tmp_obj;
@@ -422,11 +1183,23 @@ static inline cofi_list* get_obj(disassembler_t* self, uint64_t entry_point){
 void disassembler_flush(disassembler_t* self){
   self->has_pending_indirect_branch = false;
   self->pending_indirect_branch_src = 0;
+  self->reported_target = 0;
 }
 
+/* 
+ * Resolves the indirect branch or return the last trace stopped at into a
+ * (source, target) edge. Targets outside of the trace region (e.g. TIP.PGD)
+ * only get the source reported.
+ */
 void inform_disassembler_target_ip(disassembler_t* self, uint64_t target_ip){
   if(self->has_pending_indirect_branch){
-  	disassembler_flush(self);
+  	report_addr(self, self->pending_indirect_branch_src);
+  	if(target_ip >= self->min_addr && target_ip <= self->max_addr){
+  		report_addr(self, target_ip);
+  		self->reported_target = target_ip;
+  	}
+  	self->has_pending_indirect_branch = false;
+  	self->pending_indirect_branch_src = 0;
   }
 }
 
@@ -449,16 +1222,23 @@ void inform_disassembler_target_ip(disassembler_t* self, uint64_t target_ip){
  __attribute__((hot)) bool trace_disassembler(disassembler_t* self, uint64_t entry_point, uint64_t limit, tnt_cache_t* tnt_cache_state, uint64_t fup_tip){
 
 	cofi_list *obj, *last_obj;
+	transition_cache_entry_t *rec = NULL;
+	cofi_list *rec_obj = NULL;
+	uint8_t rec_tnt = 0;
+	uint8_t rec_n = 0;
+	uint64_t rec_edges[TRANSITION_CACHE_BITS];
 		
 	inform_disassembler_target_ip(self, entry_point);
 
 	obj = get_obj(self, entry_point);
 
 	if (!obj || !limit_check(entry_point, obj->cofi.ins_addr, limit)){
+		self->reported_target = 0;
 		check_return("1");
 	}
-	if (likely(entry_point != fup_tip))
-		self->handler(entry_point);
+	if (likely(entry_point != fup_tip && entry_point != self->reported_target))
+		report_addr(self, entry_point);
+	self->reported_target = 0;
 
 	while(true){
 		
@@ -467,6 +1247,38 @@ void inform_disassembler_target_ip(disassembler_t* self, uint64_t target_ip){
 		switch(obj->cofi.type){
 
 			case COFI_TYPE_CONDITIONAL_BRANCH:
+				/* 
+				 * Replay the next TRANSITION_CACHE_BITS branches from the transition cache
+				 * or start recording them. Only used without a limit, as the limit check
+				 * would otherwise have to be repeated for every cached block.
+				 */
+				if (!limit && !rec){
+					uint8_t count;
+					uint64_t bits = peek_tnt_cache(tnt_cache_state, &count);
+					if (count >= TRANSITION_CACHE_BITS){
+						uint8_t tnt = bits >> (64 - TRANSITION_CACHE_BITS);
+						transition_cache_entry_t *entry = transition_cache_lookup(self, obj, tnt);
+						if (entry->obj == obj && entry->tnt == tnt && entry->gen == self->transition_cache_gen){
+							drop_tnt_cache(tnt_cache_state, TRANSITION_CACHE_BITS);
+							if (likely(self->edge_sink)){
+								for (uint8_t i = 0; i < TRANSITION_CACHE_BITS; i++){
+									edge_sink_add(self->edge_sink, entry->edges[i]);
+								}
+							} else {
+								for (uint8_t i = 0; i < TRANSITION_CACHE_BITS; i++){
+									self->handler(self->handler_opaque, entry->edges[i]);
+								}
+							}
+							obj = entry->next;
+							break;
+						}
+						rec = entry;
+						rec_obj = obj;
+						rec_tnt = tnt;
+						rec_n = 0;
+					}
+				}
+
 				switch(process_tnt_cache(tnt_cache_state)){
 
 					case TNT_EMPTY:
@@ -476,41 +1288,79 @@ void inform_disassembler_target_ip(disassembler_t* self, uint64_t target_ip){
 					case TAKEN:
 						WRITE_SAMPLE_DECODED_DETAILED("(%d)\t%lx\t(Taken)\n", COFI_TYPE_CONDITIONAL_BRANCH, obj->cofi.ins_addr);
 						last_obj = obj;
-						self->handler(obj->cofi.target_addr);
-						if(!obj->cofi_target_ptr){
-							obj->cofi_target_ptr = get_obj(self, obj->cofi.target_addr);
+						report_edge(self, obj->cofi.target_addr, obj->target_id);
+						if (rec){
+							rec_edges[rec_n++] = self->edge_sink ? obj->target_id : obj->cofi.target_addr;
+						}
+						if(!cofi_link_get(obj->cofi_target_ptr)){
+							if (out_of_bounds(self, obj->cofi.target_addr)){
+								self->range_exit = obj->cofi.target_addr;
+								return true;
+							}
+							cofi_link_set(obj->cofi_target_ptr, cofi_index(self, get_obj(self, obj->cofi.target_addr)));
 						}
-						obj = obj->cofi_target_ptr;
+						obj = cofi_node(self, cofi_link_get(obj->cofi_target_ptr));
 
 						if (!obj || !limit_check(last_obj->cofi.target_addr, obj->cofi.ins_addr, limit)){
 							check_return("2");
 						}
+
+						/* tight loop: consume the whole run of taken bits at once */
+						if (obj == last_obj && !rec){
+							uint8_t count;
+							uint64_t bits = peek_tnt_cache(tnt_cache_state, &count);
+							uint8_t run = MIN(clz64(~bits), count);
+							drop_tnt_cache(tnt_cache_state, run);
+							while (run--){
+								report_edge(self, obj->cofi.target_addr, obj->target_id);
+							}
+						}
 						break;
 					case NOT_TAKEN:
 						WRITE_SAMPLE_DECODED_DETAILED("(%d)\t%lx\t(Not Taken)\n", COFI_TYPE_CONDITIONAL_BRANCH ,obj->cofi.ins_addr);
 
 						last_obj = obj;
-						self->handler((obj->cofi.ins_addr)+obj->cofi.ins_size);
+						report_edge(self, (obj->cofi.ins_addr)+obj->cofi.ins_size, obj->next_id);
+						if (rec){
+							rec_edges[rec_n++] = self->edge_sink ? obj->next_id : obj->cofi.ins_addr+obj->cofi.ins_size;
+						}
 						/* fix if cofi_ptr is null */
-    					if(!obj->cofi_ptr){
-    						obj->cofi_ptr = get_obj(self, obj->cofi.ins_addr+obj->cofi.ins_size);
+    					if(!cofi_link_get(obj->cofi_ptr)){
+							if (out_of_bounds(self, obj->cofi.ins_addr+obj->cofi.ins_size)){
+								self->range_exit = obj->cofi.ins_addr+obj->cofi.ins_size;
+								return true;
+							}
+    						cofi_link_set(obj->cofi_ptr, cofi_index(self, get_obj(self, obj->cofi.ins_addr+obj->cofi.ins_size)));
     					}
-						obj = obj->cofi_ptr;
+						obj = cofi_node(self, cofi_link_get(obj->cofi_ptr));
 
 						if(!obj || !limit_check(last_obj->cofi.ins_addr, obj->cofi.ins_addr, limit)){
 							check_return("3");
 						}
 						break;
 				}
+
+				if (rec && rec_n == TRANSITION_CACHE_BITS){
+					rec->obj = rec_obj;
+					rec->tnt = rec_tnt;
+					rec->gen = self->transition_cache_gen;
+					rec->next = obj;
+					memcpy(rec->edges, rec_edges, sizeof(rec_edges));
+					rec = NULL;
+				}
 				break;
 
 			case COFI_TYPE_UNCONDITIONAL_DIRECT_BRANCH:
 				WRITE_SAMPLE_DECODED_DETAILED("(%d)\t%lx\n", COFI_TYPE_UNCONDITIONAL_DIRECT_BRANCH ,obj->cofi.ins_addr);
 				last_obj = obj;
-				if(!obj->cofi_target_ptr){
-					obj->cofi_target_ptr = get_obj(self, obj->cofi.target_addr);
+				if(!cofi_link_get(obj->cofi_target_ptr)){
+					if (out_of_bounds(self, obj->cofi.target_addr)){
+						self->range_exit = obj->cofi.target_addr;
+						return true;
+					}
+					cofi_link_set(obj->cofi_target_ptr, cofi_index(self, get_obj(self, obj->cofi.target_addr)));
 				}
-				obj = obj->cofi_target_ptr;
+				obj = cofi_node(self, cofi_link_get(obj->cofi_target_ptr));
 
 				if(!obj || !limit_check(last_obj->cofi.target_addr, obj->cofi.ins_addr, limit)){
 					check_return("4");
@@ -518,12 +1368,15 @@ void inform_disassembler_target_ip(disassembler_t* self, uint64_t target_ip){
 				break;
 
 			case COFI_TYPE_INDIRECT_BRANCH:
-				self->handler(obj->cofi.ins_addr); //BROKEN, TODO move to inform_disassembler_target_ip
-				
+				/* the target is in the next TIP, see inform_disassembler_target_ip() */
+				self->has_pending_indirect_branch = true;
+				self->pending_indirect_branch_src = obj->cofi.ins_addr;
 				WRITE_SAMPLE_DECODED_DETAILED("(2)\t%lx\n",obj->cofi.ins_addr);
 				return true;
 
 			case COFI_TYPE_NEAR_RET:
+				self->has_pending_indirect_branch = true;
+				self->pending_indirect_branch_src = obj->cofi.ins_addr;
 				WRITE_SAMPLE_DECODED_DETAILED("(3)\t%lx\n",obj->cofi.ins_addr);
 				return true;
 
@@ -534,10 +1387,10 @@ void inform_disassembler_target_ip(disassembler_t* self, uint64_t target_ip){
 			case NO_COFI_TYPE:
 				WRITE_SAMPLE_DECODED_DETAILED("(5)\t%lx\n",obj->cofi.ins_addr);
 
-				if(!(obj->cofi_ptr) || !limit_check(obj->cofi.ins_addr, obj->cofi.ins_addr, limit)){
+				if(!cofi_link_get(obj->cofi_ptr) || !limit_check(obj->cofi.ins_addr, obj->cofi.ins_addr, limit)){
 					check_return("(5)");
 				}
-				obj = obj->cofi_ptr;
+				obj = cofi_node(self, cofi_link_get(obj->cofi_ptr));
 				break;
 			case NO_DISASSEMBLY:
 				assert(false);
@@ -52,32 +52,143 @@ typedef struct {
 	cofi_type type;
 } cofi_header;
 
+/* 
+ * cofi_list nodes live in a per-disassembler arena in discovery order,
+ * cofi_ptr / cofi_target_ptr are arena indices (0 is the unused list head).
+ * The cached edge ids grow a node from 32 to 40 bytes and save a mix_bits()
+ * per reported branch.
+ */
 typedef struct cofi_list {
-	struct cofi_list *list_ptr;
-	struct cofi_list *cofi_ptr;
-	struct cofi_list *cofi_target_ptr;
+	uint32_t cofi_ptr;
+	uint32_t cofi_target_ptr;
+	uint32_t target_id;		/* edge ids of target_addr and of the fall-through, see edge_id() */
+	uint32_t next_id;
 	cofi_header cofi;
 } cofi_list;
 
+/* 
+ * Capstone result for the instruction starting at one byte of the trace region,
+ * filled in by the pre-disassembly workers (size 0: not decoded).
+ */
+typedef struct predecoded_insn_s{
+	uint8_t size;
+	uint8_t type;
+	int32_t disp;		/* target_addr - ins_addr of direct branches */
+} predecoded_insn_t;
+
+/* 
+ * Bitmap update done by trace_disassembler() itself instead of calling the
+ * handler for every branch: the per-vCPU shard and the id of the last edge.
+ * dirty has one bit per cache line of bitmap, so that merging and clearing
+ * the shard only has to look at the lines touched by the run.
+ */
+#define EDGE_LINE_BITS		6
+#define EDGE_LINE_SIZE		(1 << EDGE_LINE_BITS)
+#define edge_dirty_words(size)	((((size) >> EDGE_LINE_BITS) + 63) / 64)
+
+typedef struct edge_sink_s{
+	uint8_t* bitmap;
+	uint64_t* dirty;
+	uint32_t mask;
+	uint64_t last_id;
+} edge_sink_t;
+
+static inline void edge_dirty_mark(uint64_t* dirty, uint32_t offset){
+	dirty[offset >> (EDGE_LINE_BITS + 6)] |= 1ULL << ((offset >> EDGE_LINE_BITS) & 63);
+}
+
+static inline uint64_t mix_bits(uint64_t v) {
+  v ^= (v >> 31);
+  v *= 0x7fb5d329728ea185;
+  v ^= (v >> 27);
+  v *= 0x81dadef4bc2dd44d;
+  v ^= (v >> 33);
+  return v;
+}
+
+static inline void edge_sink_add(edge_sink_t* sink, uint64_t id){
+	if (likely(sink->bitmap)){
+		uint32_t index = (id ^ (sink->last_id >> 1)) & sink->mask;
+		sink->bitmap[index]++;
+		edge_dirty_mark(sink->dirty, index);
+	}
+	sink->last_id = id;
+}
+
+#define COFI_ARENA_MAX_NODES		(1 << 26)	/* address space reserved per disassembler */
+#define COFI_ARENA_CHUNK_NODES		(1 << 14)	/* committed at a time, a multiple of the page size */
+
+#define LOOKUP_PAGE_BITS			12
+#define LOOKUP_PAGE_MASK			((1ULL << LOOKUP_PAGE_BITS) - 1)
+#define LOOKUP_CHUNK_BITS			9	/* page tables per directory chunk: 2MB of code */
+#define LOOKUP_CHUNK_MASK			((1ULL << LOOKUP_CHUNK_BITS) - 1)
+#define LOOKUP_MAX_RANGE			(1ULL << 36)	/* 64GB trace region, 256KB directory */
+
+#define TRANSITION_CACHE_BITS		8	/* TNT bits replayed per cache hit */
+#define TRANSITION_CACHE_SIZE_BITS	13	/* 8192 entries */
+
+/* 
+ * Memoized walk of TRANSITION_CACHE_BITS conditional branches starting at obj
+ * for a given TNT pattern: the handler addresses and the resulting cofi node.
+ */
+typedef struct transition_cache_entry_s{
+	cofi_list* obj;
+	cofi_list* next;
+	uint32_t gen;
+	uint8_t tnt;
+	uint64_t edges[TRANSITION_CACHE_BITS];	/* addresses, or edge ids with an edge sink */
+} transition_cache_entry_t;
+
 typedef struct disassembler_s{
 	CPUState *cpu;
 	uint64_t min_addr;
 	uint64_t max_addr;
-	void (*handler)(uint64_t);
+	void (*handler)(void*, uint64_t);
+	void* handler_opaque;		/* first argument of handler, e.g. the per-vCPU edge hash state */
 	khash_t(ADDR0) *map;
-	cofi_list* list_head;
+	uint32_t*** lookup_area;	/* FAST_ARRAY_LOOKUP: directory of chunks of per-page address -> cofi_list index tables */
+	uint64_t lookup_area_size;	/* pages of the trace region */
+	uint64_t lookup_chunks;		/* number of materialised directory chunks */
+	uint64_t lookup_pages;		/* number of materialised page tables */
+	cofi_list* cofi_arena;
+	uint32_t cofi_arena_used;
+	uint32_t cofi_arena_committed;	/* nodes backed by read-write memory, see cofi_arena_grow() */
 	cofi_list* list_element;
 	bool debug;
-	bool has_pending_indirect_branch;
+	bool has_pending_indirect_branch;	/* indirect branch / ret waiting for its TIP */
 	uint64_t pending_indirect_branch_src;
+	uint64_t reported_target;	/* resolved TIP target, not reported again as segment entry */
+	uint64_t range_exit;		/* direct branch target outside of [min_addr, max_addr] the trace stopped at */
+	transition_cache_entry_t* transition_cache;
+	uint32_t transition_cache_gen;
+	char* cache_file;			/* on-disk CFG cache (see disassembler_attach_cache) */
+	uint32_t cofi_arena_synced;	/* nodes already written to cache_file */
+	uint64_t cache_image_hash;	/* of the code the cached CFG was built from */
+	uint8_t* image;				/* code snapshot used instead of guest memory (pre-disassembly only) */
+	uint64_t image_size;
+	predecoded_insn_t* predecode;
+	struct disassembler_s* parent;	/* read-only view on the CFG of parent (see disassembler_view) */
+	bool view_miss;				/* the view hit code which is not disassembled yet */
+	edge_sink_t* edge_sink;		/* replaces handler for edges, see disassembler_set_edge_sink */
 } disassembler_t;
 
-disassembler_t* init_disassembler(CPUState *cpu, uint64_t min_addr, uint64_t max_addr, void (*handler)(uint64_t));
+disassembler_t* init_disassembler(CPUState *cpu, uint64_t min_addr, uint64_t max_addr, void (*handler)(void*, uint64_t), void* handler_opaque);
 
 int get_capstone_mode(CPUState *cpu);
 void disassembler_flush(disassembler_t* self);
 void inform_disassembler_target_ip(disassembler_t* self, uint64_t target_ip);
  __attribute__((hot)) bool trace_disassembler(disassembler_t* self, uint64_t entry_point, uint64_t limit, tnt_cache_t* tnt_cache_state, uint64_t fup_tip);
 void destroy_disassembler(disassembler_t* self);
+disassembler_t* disassembler_view(disassembler_t* parent, void (*handler)(void*, uint64_t), void* handler_opaque);
+void disassembler_view_sync(disassembler_t* self);
+void disassembler_set_edge_sink(disassembler_t* self, edge_sink_t* sink);
+void disassembler_report(disassembler_t* self, uint64_t addr);
+void disassembler_handover(disassembler_t* from, disassembler_t* to);
+void destroy_disassembler_view(disassembler_t* self);
+disassembler_t* predisassemble(CPUState *cpu, uint64_t min_addr, uint64_t max_addr, void (*handler)(void*, uint64_t), void* handler_opaque, uint8_t* image, uint64_t image_size, uint32_t threads, volatile bool* abort);
+bool disassembler_attach_cache(disassembler_t* self, const char* file, uint64_t image_hash);
+bool disassembler_sync_cache(disassembler_t* self);
+void disassembler_bench(const uint8_t* image, size_t size, bool mode64, uint32_t iterations, uint64_t* instructions, uint64_t* capstone_nsec, uint64_t* table_nsec, uint64_t* fallbacks, uint64_t* mismatches);
+void disassembler_get_stats(disassembler_t* self, uint64_t* cofi_nodes, uint64_t* cofi_bytes, uint64_t* lookup_bytes, uint64_t* cache_bytes);
 
 #endif
@@ -0,0 +1,200 @@
+/*
+ * *
+ * Sergej Schumilo, 2019 <sergej@schumilo.de>
+ * Cornelius Aschermann, 2019 <cornelius.aschermann@rub.de>
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/atomic.h"
+#include "qemu/futex.h"
+#include "qemu/processor.h"
+#include "qemu/timer.h"
+#include <sys/socket.h>
+#include "pt/doorbell.h"
+#include "pt/interface.h"
+
+void doorbell_init(doorbell_t* bell){
+	QEMU_BUILD_BUG_ON(sizeof(doorbell_t) > DOORBELL_SIZE);
+
+	memset(bell, 0x00, sizeof(doorbell_t));
+	bell->version = DOORBELL_VERSION;
+	/* the fuzzer must not use the rings before they are reset */
+	atomic_store_release(&bell->magic, DOORBELL_MAGIC);
+}
+
+/* waits until *index moved on from seen */
+static void doorbell_wait(uint32_t* index, uint32_t seen, uint32_t* waiting, uint32_t spin){
+	for(uint32_t i = 0; i < spin; i++){
+		if(atomic_read(index) != seen){
+			return;
+		}
+		cpu_relax();
+	}
+	atomic_set(waiting, 1);
+	/* pairs with doorbell_wake() */
+	smp_mb();
+	if(atomic_read(index) == seen){
+		qemu_futex_wait(index, seen);
+	}
+	atomic_set(waiting, 0);
+}
+
+static void doorbell_wake(uint32_t* index, uint32_t* waiting){
+	/* the index has to be visible before we look at the flag */
+	smp_mb();
+	if(atomic_read(waiting)){
+		qemu_futex_wake(index, 1);
+	}
+}
+
+void doorbell_push(doorbell_ring_t* ring, uint8_t val, uint32_t spin){
+	uint32_t head = ring->head;
+	uint32_t tail;
+
+	while(head - (tail = atomic_load_acquire(&ring->tail)) >= DOORBELL_SLOTS){
+		doorbell_wait(&ring->tail, tail, &ring->producer_waiting, spin);
+	}
+	ring->slots[head & (DOORBELL_SLOTS - 1)] = val;
+	atomic_store_release(&ring->head, head + 1);
+	doorbell_wake(&ring->head, &ring->consumer_waiting);
+}
+
+uint8_t doorbell_pop(doorbell_ring_t* ring, uint32_t spin){
+	uint32_t tail = ring->tail;
+	uint32_t head;
+	uint8_t val;
+
+	while((head = atomic_load_acquire(&ring->head)) == tail){
+		doorbell_wait(&ring->head, head, &ring->consumer_waiting, spin);
+	}
+	val = ring->slots[tail & (DOORBELL_SLOTS - 1)];
+	atomic_store_release(&ring->tail, tail + 1);
+	doorbell_wake(&ring->tail, &ring->producer_waiting);
+	return val;
+}
+
+/*
+ * The benchmark plays both sides in one process: the calling thread stands in
+ * for the vCPU thread in synchronization_lock(), a second thread for the
+ * fuzzer and, for the chardev, a third one for the main loop which turns the
+ * reply into synchronization_unlock().
+ */
+typedef struct doorbell_bench_state_s{
+	uint32_t iterations;
+	uint32_t spin;
+	doorbell_t* bell;
+	int fds[2];				/* QEMU, fuzzer */
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	bool released;
+} doorbell_bench_state_t;
+
+static void* doorbell_bench_fuzzer_fn(void* opaque){
+	doorbell_bench_state_t* state = opaque;
+	char val = KAFL_PROTO_RELEASE;
+
+	for(uint32_t i = 0; i < state->iterations; i++){
+		if(state->bell){
+			doorbell_pop(&state->bell->status, state->spin);
+			doorbell_push(&state->bell->command, KAFL_PROTO_RELEASE, state->spin);
+		}
+		else {
+			if(read(state->fds[1], &val, 1) != 1 || write(state->fds[1], &val, 1) != 1){
+				break;
+			}
+		}
+	}
+	return NULL;
+}
+
+static void* doorbell_bench_main_loop_fn(void* opaque){
+	doorbell_bench_state_t* state = opaque;
+	struct pollfd pfd = { .fd = state->fds[0], .events = POLLIN };
+	char val;
+
+	for(uint32_t i = 0; i < state->iterations; i++){
+		if(poll(&pfd, 1, -1) != 1 || read(state->fds[0], &val, 1) != 1){
+			break;
+		}
+		pthread_mutex_lock(&state->mutex);
+		state->released = true;
+		pthread_cond_signal(&state->cond);
+		pthread_mutex_unlock(&state->mutex);
+	}
+	return NULL;
+}
+
+static uint64_t doorbell_bench_run(doorbell_bench_state_t* state){
+	pthread_t fuzzer, main_loop;
+	char val = KAFL_PROTO_ACQUIRE;
+	uint64_t start;
+
+	pthread_create(&fuzzer, NULL, doorbell_bench_fuzzer_fn, state);
+	if(!state->bell){
+		pthread_create(&main_loop, NULL, doorbell_bench_main_loop_fn, state);
+	}
+	start = get_clock();
+	for(uint32_t i = 0; i < state->iterations; i++){
+		if(state->bell){
+			doorbell_push(&state->bell->status, KAFL_PROTO_ACQUIRE, state->spin);
+			doorbell_pop(&state->bell->command, state->spin);
+		}
+		else {
+			pthread_mutex_lock(&state->mutex);
+			state->released = false;
+			if(write(state->fds[0], &val, 1) != 1){
+				pthread_mutex_unlock(&state->mutex);
+				break;
+			}
+			while(!state->released){
+				pthread_cond_wait(&state->cond, &state->mutex);
+			}
+			pthread_mutex_unlock(&state->mutex);
+		}
+	}
+	start = get_clock() - start;
+	pthread_join(fuzzer, NULL);
+	if(!state->bell){
+		pthread_join(main_loop, NULL);
+	}
+	return start;
+}
+
+int doorbell_bench(uint32_t iterations, uint32_t spin, doorbell_bench_t* res){
+	doorbell_bench_state_t state;
+	doorbell_t* bell;
+
+	memset(&state, 0x00, sizeof(doorbell_bench_state_t));
+	state.iterations = iterations;
+	pthread_mutex_init(&state.mutex, NULL);
+	pthread_cond_init(&state.cond, NULL);
+
+	if(socketpair(AF_UNIX, SOCK_STREAM, 0, state.fds)){
+		return -1;
+	}
+	res->chardev_nsec = doorbell_bench_run(&state);
+	close(state.fds[0]);
+	close(state.fds[1]);
+
+	/* shared, like the region the fuzzer maps */
+	bell = mmap(0, DOORBELL_SIZE, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	if(bell == MAP_FAILED){
+		return -1;
+	}
+	state.bell = bell;
+
+	doorbell_init(bell);
+	state.spin = 0;
+	res->futex_nsec = doorbell_bench_run(&state);
+
+	doorbell_init(bell);
+	state.spin = spin;
+	res->spin_nsec = doorbell_bench_run(&state);
+
+	munmap(bell, DOORBELL_SIZE);
+	pthread_mutex_destroy(&state.mutex);
+	pthread_cond_destroy(&state.cond);
+	return 0;
+}
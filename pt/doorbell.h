@@ -0,0 +1,67 @@
+/*
+ * *
+ * Sergej Schumilo, 2019 <sergej@schumilo.de>
+ * Cornelius Aschermann, 2019 <cornelius.aschermann@rub.de>
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#ifndef DOORBELL_H
+#define DOORBELL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Shared memory replacement for the one byte chardev messages of the hot path
+ * (ACQUIRE / RELEASE and friends). The region holds two single producer,
+ * single consumer rings of KAFL_PROTO_* bytes:
+ *
+ *  status	QEMU -> fuzzer, every message hypercall_snd_char() sends
+ *  command	fuzzer -> QEMU, RELEASE, COVER_ON and COVER_OFF
+ *
+ * head is only written by the producer, tail only by the consumer. A side
+ * which runs out of work spins for a while and then sleeps on the futex of
+ * the index it waits for, after setting its waiting flag; the other side
+ * issues FUTEX_WAKE on that index only if the flag is set. The layout is
+ * shared with the fuzzer and must not change without bumping the version.
+ */
+#define DOORBELL_MAGIC			0x6c6c6562726f6f64ULL	/* "doorbell" */
+#define DOORBELL_VERSION		1
+#define DOORBELL_SLOTS			64		/* power of two */
+#define DOORBELL_SIZE			0x1000
+#define DOORBELL_SPIN_DEFAULT	2000	/* cpu_relax() rounds before sleeping */
+
+typedef struct doorbell_ring_s{
+	uint32_t head;
+	uint8_t pad0[60];
+	uint32_t tail;
+	uint8_t pad1[60];
+	uint32_t consumer_waiting;		/* sleeps on head */
+	uint32_t producer_waiting;		/* sleeps on tail, ring full */
+	uint8_t pad2[56];
+	uint8_t slots[DOORBELL_SLOTS];
+} doorbell_ring_t;
+
+typedef struct doorbell_s{
+	uint64_t magic;
+	uint32_t version;
+	uint8_t pad[52];
+	doorbell_ring_t status;
+	doorbell_ring_t command;
+} doorbell_t;
+
+typedef struct doorbell_bench_s{
+	uint64_t chardev_nsec;		/* socket, main loop thread and condvar, like the chardev */
+	uint64_t futex_nsec;		/* doorbell without spinning */
+	uint64_t spin_nsec;			/* doorbell with the given spin count */
+} doorbell_bench_t;
+
+void doorbell_init(doorbell_t* bell);
+void doorbell_push(doorbell_ring_t* ring, uint8_t val, uint32_t spin);
+uint8_t doorbell_pop(doorbell_ring_t* ring, uint32_t spin);
+
+/* round trips (QEMU message, fuzzer reply) over both transports between two local threads */
+int doorbell_bench(uint32_t iterations, uint32_t spin, doorbell_bench_t* res);
+
+#endif
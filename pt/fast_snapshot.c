@@ -0,0 +1,256 @@
+/*
+ * *
+ * Sergej Schumilo, 2019 <sergej@schumilo.de>
+ * Cornelius Aschermann, 2019 <cornelius.aschermann@rub.de>
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qemu/atomic.h"
+#include "qemu/bitops.h"
+#include "qemu/host-utils.h"
+#include "qemu/rcu.h"
+#include "qemu/timer.h"
+#include "exec/memory.h"
+#include "exec/ram_addr.h"
+#include "exec/ramblock.h"
+#include "hw/core/cpu.h"
+#include "hw/boards.h"
+#include "sysemu/cpus.h"
+#include "io/channel-buffer.h"
+#include "migration/blocker.h"
+#include "migration/misc.h"
+#include "migration/qemu-file-channel.h"
+#include "migration/qemu-file.h"
+#include "migration/savevm.h"
+#include "pt/fast_snapshot.h"
+#include "pt/memory_access.h"
+#include "pt/debug.h"
+
+#define FAST_SNAPSHOT_DEVICE_BUF	(1 << 20)	/* initial size, grows on demand */
+#define FAST_SNAPSHOT_HEADER		(2 * sizeof(uint32_t))	/* file magic and version */
+
+typedef struct fast_snapshot_block_s{
+	RAMBlock* rb;
+	uint8_t* copy;
+	uint64_t size;
+} fast_snapshot_block_t;
+
+static struct {
+	bool valid;
+	fast_snapshot_block_t* blocks;
+	uint32_t block_count;
+	uint8_t* device_state;		/* qemu_save_device_state() stream, re-read on each restore */
+	uint64_t device_size;
+	Error* blocker;
+	fast_snapshot_stats_t stats;
+} snapshot = {0};
+
+/*
+ * Takes the dirty bits of the block out of the migration bitmap, which
+ * memory_global_dirty_log_sync() filled from the KVM dirty log, and copies
+ * the dirty pages back if restore is set. Returns the number of dirty pages.
+ */
+static uint64_t fast_snapshot_scan_block(fast_snapshot_block_t* block, bool restore){
+	DirtyMemoryBlocks* dirty = atomic_rcu_read(&ram_list.dirty_memory[DIRTY_MEMORY_MIGRATION]);
+	uint64_t first = block->rb->offset >> TARGET_PAGE_BITS;
+	uint64_t end = first + (block->size >> TARGET_PAGE_BITS);
+	uint64_t count = 0;
+
+	for(uint64_t page = first; page < end; ){
+		uint64_t bit = page % BITS_PER_LONG;
+		uint64_t n = MIN(BITS_PER_LONG - bit, end - page);
+		unsigned long mask = ((n == BITS_PER_LONG) ? ~0UL : ((1UL << n) - 1)) << bit;
+		unsigned long* word = &dirty->blocks[page / DIRTY_MEMORY_BLOCK_SIZE][BIT_WORD(page % DIRTY_MEMORY_BLOCK_SIZE)];
+		uint64_t base = page - bit - first;		/* block page of bit 0 */
+		unsigned long bits;
+
+		page += n;
+		if(!(atomic_read(word) & mask)){
+			continue;
+		}
+		bits = atomic_fetch_and(word, ~mask) & mask;
+		count += ctpopl(bits);
+
+		/* re-arms write protection with manual dirty log protect, a no-op otherwise */
+		memory_region_clear_dirty_bitmap(block->rb->mr, (base + ctzl(bits)) << TARGET_PAGE_BITS,
+			(BITS_PER_LONG - clzl(bits) - ctzl(bits)) << TARGET_PAGE_BITS);
+
+		while(restore && bits){
+			uint64_t start = ctzl(bits);
+			uint64_t len = cto64(bits >> start);
+			uint64_t offset = (base + start) << TARGET_PAGE_BITS;
+
+			memcpy(block->rb->host + offset, block->copy + offset, len << TARGET_PAGE_BITS);
+			bits &= ~(((len == BITS_PER_LONG) ? ~0UL : ((1UL << len) - 1)) << start);
+		}
+	}
+	return count;
+}
+
+static uint64_t fast_snapshot_scan(bool restore){
+	uint64_t count = 0;
+
+	memory_global_dirty_log_sync();
+	RCU_READ_LOCK_GUARD();
+	for(uint32_t i = 0; i < snapshot.block_count; i++){
+		count += fast_snapshot_scan_block(&snapshot.blocks[i], restore);
+	}
+	return count;
+}
+
+static int fast_snapshot_count_block(RAMBlock *rb, void *opaque){
+	if(qemu_ram_is_migratable(rb)){
+		(*(uint32_t*)opaque)++;
+	}
+	return 0;
+}
+
+static int fast_snapshot_copy_block(RAMBlock *rb, void *opaque){
+	fast_snapshot_block_t* block;
+
+	/* non-migratable blocks (e.g. the payload region) keep their contents */
+	if(!qemu_ram_is_migratable(rb)){
+		return 0;
+	}
+	block = &snapshot.blocks[(*(uint32_t*)opaque)++];
+	block->rb = rb;
+	block->size = qemu_ram_get_used_length(rb);
+	block->copy = qemu_memalign(qemu_real_host_page_size, block->size);
+	memcpy(block->copy, qemu_ram_get_host_addr(rb), block->size);
+	snapshot.stats.ram_bytes += block->size;
+	return 0;
+}
+
+static void fast_snapshot_free_blocks(void){
+	for(uint32_t i = 0; i < snapshot.block_count; i++){
+		qemu_vfree(snapshot.blocks[i].copy);
+	}
+	g_free(snapshot.blocks);
+	snapshot.blocks = NULL;
+	snapshot.block_count = 0;
+}
+
+/* takes the stream over from the channel, closing the file would free it */
+static bool fast_snapshot_save_devices(void){
+	QIOChannelBuffer* bioc = qio_channel_buffer_new(FAST_SNAPSHOT_DEVICE_BUF);
+	QEMUFile* f = qemu_fopen_channel_output(QIO_CHANNEL(bioc));
+	bool ret = qemu_save_device_state(f) >= 0;
+
+	qemu_fflush(f);
+	ret = ret && !qemu_file_get_error(f);
+	if(ret){
+		g_free(snapshot.device_state);
+		snapshot.device_state = bioc->data;
+		snapshot.device_size = bioc->usage;
+		bioc->data = NULL;
+	}
+	qemu_fclose(f);
+	object_unref(OBJECT(bioc));
+	return ret;
+}
+
+/* a fresh file per restore, nothing of the previous load is buffered */
+static int fast_snapshot_load_devices(void){
+	QIOChannelBuffer* bioc = qio_channel_buffer_new(0);
+	QEMUFile* f;
+	int ret;
+
+	bioc->data = snapshot.device_state;
+	bioc->capacity = bioc->usage = snapshot.device_size;
+	f = qemu_fopen_channel_input(QIO_CHANNEL(bioc));
+	object_unref(OBJECT(bioc));
+
+	/* qemu_load_device_state() expects the sections without the file header */
+	qio_channel_io_seek(QIO_CHANNEL(bioc), FAST_SNAPSHOT_HEADER, SEEK_SET, NULL);
+	ret = qemu_load_device_state(f);
+
+	bioc->data = NULL;	/* still ours */
+	qemu_fclose(f);
+	return ret;
+}
+
+bool fast_snapshot_create(Error **errp){
+	uint32_t count = 0;
+
+	/* the vmstate is restored in the thread of the only vCPU, see fast_snapshot_restore() */
+	if(current_machine->smp.max_cpus > 1){
+		error_setg(errp, "fast snapshots support a single vCPU only (-smp 1,maxcpus=1)");
+		return false;
+	}
+	if(!snapshot.blocker){
+		if(!migration_is_idle()){
+			error_setg(errp, "fast snapshots cannot be created during migration");
+			return false;
+		}
+		/* migration would stop the dirty log we rely on */
+		error_setg(&snapshot.blocker, "kAFL fast snapshot active");
+		if(migrate_add_blocker(snapshot.blocker, errp) < 0){
+			error_free(snapshot.blocker);
+			snapshot.blocker = NULL;
+			return false;
+		}
+		memory_global_dirty_log_start();
+	}
+
+	snapshot.valid = false;
+	fast_snapshot_free_blocks();
+	snapshot.stats.ram_bytes = 0;
+
+	/* everything is copied below, forget what was dirtied so far */
+	qemu_ram_foreach_block(fast_snapshot_count_block, &count);
+	snapshot.blocks = g_new0(fast_snapshot_block_t, count);
+	qemu_ram_foreach_block(fast_snapshot_copy_block, &snapshot.block_count);
+	fast_snapshot_scan(false);
+
+	if(!fast_snapshot_save_devices()){
+		error_setg(errp, "failed to save the device state");
+		return false;
+	}
+	snapshot.stats.device_bytes = snapshot.device_size;
+
+	QEMU_PT_PRINTF(CORE_PREFIX, "Fast snapshot:\t\t%lu KB RAM, %lu bytes device state",
+		snapshot.stats.ram_bytes >> 10, snapshot.stats.device_bytes);
+	snapshot.valid = true;
+	return true;
+}
+
+bool fast_snapshot_restore(void){
+	uint64_t start = get_clock();
+	int ret;
+
+	if(!snapshot.valid){
+		return false;
+	}
+
+	snapshot.stats.pages = fast_snapshot_scan(true);
+
+	/* 
+	 * Runs in the thread of the only vCPU, outside of KVM_RUN and with the BQL
+	 * held: the vCPU is as stopped as vm_stop() would leave it, without the
+	 * cost of a stop / start cycle per execution. qemu_load_device_state()
+	 * writes the loaded registers back to KVM itself.
+	 */
+	cpu_synchronize_all_pre_loadvm();
+	ret = fast_snapshot_load_devices();
+	mem_tlb_flush_all();
+
+	snapshot.stats.restores++;
+	snapshot.stats.nsec = get_clock() - start;
+	if(ret < 0){
+		QEMU_PT_ERROR(CORE_PREFIX, "Fast snapshot restore failed (%d)", ret);
+		snapshot.valid = false;
+		return false;
+	}
+	return true;
+}
+
+bool fast_snapshot_exists(void){
+	return snapshot.valid;
+}
+
+void fast_snapshot_stats(fast_snapshot_stats_t* stats){
+	*stats = snapshot.stats;
+}
@@ -0,0 +1,34 @@
+/*
+ * *
+ * Sergej Schumilo, 2019 <sergej@schumilo.de>
+ * Cornelius Aschermann, 2019 <cornelius.aschermann@rub.de>
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#ifndef FAST_SNAPSHOT_H
+#define FAST_SNAPSHOT_H
+
+#include "qemu/osdep.h"
+
+typedef struct fast_snapshot_stats_s{
+	uint64_t restores;
+	uint64_t pages;			/* restored by the last reset */
+	uint64_t nsec;			/* of the last reset */
+	uint64_t ram_bytes;		/* copied once on creation */
+	uint64_t device_bytes;
+} fast_snapshot_stats_t;
+
+/*
+ * In-memory snapshot for resetting the VM between executions. Creation copies
+ * all migratable RAM and the device state (vCPU included) and starts dirty
+ * logging; each restore copies back only the pages dirtied since and reloads
+ * the device state. Disk contents are not part of the snapshot. Callers hold
+ * the BQL and the vCPU must not be running.
+ */
+bool fast_snapshot_create(Error **errp);
+bool fast_snapshot_restore(void);
+bool fast_snapshot_exists(void);
+void fast_snapshot_stats(fast_snapshot_stats_t* stats);
+
+#endif
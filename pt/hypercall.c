@@ -14,11 +14,13 @@
 #include "qemu-common.h"
 #include "qemu/log.h"
 #include "qemu/main-loop.h"
+#include "qemu/error-report.h"
 #include "qapi/error.h"
 #include "exec/memory.h"
 #include "sysemu/runstate.h"
 #include "sysemu/kvm_int.h"
 #include "sysemu/kvm.h"
+#include "sysemu/hw_accel.h"
 #include "migration/snapshot.h"
 #include "pt.h"
 #include "pt/hypercall.h"
@@ -27,6 +29,8 @@
 #include "pt/printk.h"
 #include "pt/debug.h"
 #include "pt/synchronization.h"
+#include "pt/fast_snapshot.h"
+#include "pt/batch.h"
 
 bool hprintf_enabled = false;
 bool notifiers_enabled = false;
@@ -36,12 +40,14 @@ bool create_snapshot_enabled = true;
 bool hypercall_enabled = false;
 void* payload_buffer = NULL;
 void* payload_buffer_guest = NULL;
+static uint64_t payload_gpa = 0;		/* payload region mapped into the guest, no copies */
 void* program_buffer = NULL;
 char buffer[INFO_SIZE];
 char hprintf_buffer[HPRINTF_SIZE];
 void* argv = NULL;
 
 static bool init_state = true;
+static bool reload_mode = false;
 
 void (*handler)(char, void*) = NULL; 
 void* s = NULL;
@@ -52,7 +58,10 @@ typedef struct Driver_information {
 	uint64_t imagesize;
 } driver_information;
 
-driver_information driver_info = {0, 0xFFFFFFFFFFFFFFFF, 0};
+/* one image per IP filter range */
+driver_information driver_info[INTEL_PT_MAX_RANGES] = {
+	[0 ... INTEL_PT_MAX_RANGES-1] = {0, 0xFFFFFFFFFFFFFFFF, 0}
+};
 
 void pt_setup_disable_create_snapshot(void){
 	create_snapshot_enabled = false;
@@ -91,27 +100,57 @@ void pt_setup_payload(void* ptr){
 	payload_buffer = ptr;
 }
 
+void pt_setup_payload_gpa(uint64_t gpa){
+	payload_gpa = gpa;
+}
+
+/* the length prefix and the input it describes, the rest of the region is stale */
+static uint64_t payload_used_size(void){
+	uint32_t len;
+
+	memcpy(&len, payload_buffer, PAYLOAD_LEN_SIZE);
+	return MIN((uint64_t)len + PAYLOAD_LEN_SIZE, PAYLOAD_SIZE);
+}
+
+/* 
+ * args: range start, range end, KAFL_IP_FILTER_ID(0 - INTEL_PT_MAX_RANGES-1).
+ * Untagged (legacy two argument) calls configure range 0. All enabled ranges
+ * are decoded in a single pass. A zero range restores the image of that filter.
+ */
 void handle_hypercall_irpt_ip_filtering(struct kvm_run *run, CPUState *cpu) {
 	if(hypercall_enabled){
-		uint8_t filter_id = 0;	//TODO - support multiple filter. 
+		uint64_t filter_id = 0;
 		uint64_t start = run->hypercall.args[0];
 		uint64_t end = run->hypercall.args[1];
+		driver_information* info;
+
+		if((run->hypercall.args[2] & ~0xffffffffULL) == KAFL_IP_FILTER_ID_MAGIC){
+			filter_id = run->hypercall.args[2] & 0xffffffffULL;
+		}
+		if(filter_id >= INTEL_PT_MAX_RANGES){
+			QEMU_PT_ERROR(CORE_PREFIX, "Invalid IP filter id %lu", filter_id);
+			return;
+		}
+		info = &driver_info[filter_id];
 		
 		pt_reset_bitmap();
 		pt_reset_coverage_map();
 
 		if (start && end) {
-			if (driver_info.image)
-				free(driver_info.image);
-			driver_info.image = malloc(end - start + 1);
-			driver_info.imagebase = start;
-			driver_info.imagesize = end-start;
-
-			read_virtual_memory(driver_info.imagebase, driver_info.image, driver_info.imagesize , cpu);
+			if (info->image)
+				free(info->image);
+			info->image = malloc(end - start + 1);
+			info->imagebase = start;
+			info->imagesize = end-start;
+
+			if(read_virtual_memory(info->imagebase, info->image, info->imagesize , cpu)){
+				pt_setup_trace_image(start, end, info->image, info->imagesize);
+			}
 			pt_enable_ip_filtering(cpu, filter_id, start, end, false);
 			return;
 		}
-		write_virtual_memory(driver_info.imagebase, driver_info.image, driver_info.imagesize , cpu);
+		if (info->image)
+			write_virtual_memory(info->imagebase, info->image, info->imagesize , cpu);
 	}
 }
 
@@ -120,8 +159,15 @@ bool handle_hypercall_kafl_next_payload(struct kvm_run *run, CPUState *cpu){
 		if (init_state){
 			synchronization_lock(cpu);
 		} else {
-			synchronization_lock(cpu);
-			if (!write_virtual_memory((uint64_t)payload_buffer_guest, payload_buffer, PAYLOAD_SIZE, cpu))
+			/* inputs of a running batch do not go through the fuzzer */
+			if(!batch_step(cpu, payload_buffer)){
+				/* reloaded: the guest restarts at the snapshot, leave it and PT alone */
+				if(!synchronization_lock(cpu)){
+					return false;
+				}
+				batch_begin(payload_buffer);
+			}
+			if (!payload_gpa && !write_virtual_memory((uint64_t)payload_buffer_guest, payload_buffer, payload_used_size(), cpu))
 				assert(false);
 			return true;
 		}
@@ -145,6 +191,12 @@ void handle_hypercall_get_payload(struct kvm_run *run, CPUState *cpu){
 		if(payload_buffer){
 			QEMU_PT_PRINTF(CORE_PREFIX, "Got payload address:\t%llx", run->hypercall.args[0]);
 			payload_buffer_guest = (void*)run->hypercall.args[0];
+			if(payload_gpa){
+				kafl_payload_desc_t desc = {KAFL_PAYLOAD_DESC_MAGIC, payload_gpa, PAYLOAD_SIZE};
+				QEMU_PT_PRINTF(CORE_PREFIX, "Payload mapped at:\t%lx", payload_gpa);
+				write_virtual_memory((uint64_t)payload_buffer_guest, (uint8_t*)&desc, sizeof(desc), cpu);
+				return;
+			}
 			write_virtual_memory((uint64_t)payload_buffer_guest, payload_buffer, PAYLOAD_SIZE, cpu);
 		}
 	}
@@ -167,6 +219,12 @@ void handle_hypercall_kafl_release(struct kvm_run *run, CPUState *cpu){
 			hypercall_snd_char(KAFL_PROTO_RELEASE);
 		} else {
 			synchronization_disable_pt(cpu);
+			if(reload_mode && fast_snapshot_exists()){
+				/* the vCPU resumes right after the snapshot hypercall */
+				qemu_mutex_lock_iothread();
+				fast_snapshot_restore();
+				qemu_mutex_unlock_iothread();
+			}
 		}
 	}
 }
@@ -176,6 +234,7 @@ void handle_hypercall_kafl_cr3(struct kvm_run *run, CPUState *cpu){
 	if(hypercall_enabled){
 		QEMU_PT_PRINTF(CORE_PREFIX, "Got CR3 address:\t\t%llx", run->hypercall.args[0]);
 		pt_set_cr3(cpu, run->hypercall.args[0], false);
+		mem_tlb_flush(cpu);
 
 		if (cpu->disassembler_word_width == 0) {
 			if (run->hypercall.longmode) {
@@ -222,6 +281,7 @@ void handle_hypercall_kafl_panic(struct kvm_run *run, CPUState *cpu){
 		} else{
 			QEMU_PT_DEBUG(CORE_PREFIX, "Panic in kernel mode!");
 		}
+		batch_abort(KAFL_PROTO_CRASH);
 		hypercall_snd_char(KAFL_PROTO_CRASH);
 	}
 }
@@ -229,6 +289,7 @@ void handle_hypercall_kafl_panic(struct kvm_run *run, CPUState *cpu){
 void handle_hypercall_kafl_timeout(struct kvm_run *run, CPUState *cpu){
 	if(hypercall_enabled){
 		QEMU_PT_DEBUG(CORE_PREFIX, "Timeout detected!");
+		batch_abort(KAFL_PROTO_TIMEOUT);
 		hypercall_snd_char(KAFL_PROTO_TIMEOUT);
 	}
 }
@@ -240,14 +301,16 @@ void handle_hypercall_kafl_kasan(struct kvm_run *run, CPUState *cpu){
 		} else{
 			QEMU_PT_DEBUG(CORE_PREFIX, "ASan notification in kernel mode!");
 		}
+		batch_abort(KAFL_PROTO_KASAN);
 		hypercall_snd_char(KAFL_PROTO_KASAN);
 	}
 }
 
 void handle_hypercall_irpt_lock(struct kvm_run *run, CPUState *cpu){
 	if(hypercall_enabled) {
-		synchronization_lock(cpu);
-		hypercall_snd_char(KAFL_PROTO_LOCK);
+		if(synchronization_lock(cpu)){
+			hypercall_snd_char(KAFL_PROTO_LOCK);
+		}
 	}
 }
 
@@ -277,6 +340,17 @@ void handle_hypercall_kafl_snapshot(struct kvm_run *run, CPUState *cpu){
 		qemu_system_shutdown_request(SHUTDOWN_CAUSE_HOST_SIGNAL);
 	}
 	*/
+	if(reload_mode){
+		Error *err = NULL;
+		QEMU_PT_PRINTF(CORE_PREFIX, "Creating fast snapshot ...");
+		qemu_mutex_lock_iothread();
+		cpu_synchronize_state(cpu);
+		if(!fast_snapshot_create(&err)){
+			error_reportf_err(err, "Error: ");
+		}
+		qemu_mutex_unlock_iothread();
+		return;
+	}
 	printf("kAFL: VM PAUSED - CREATE SNAPSHOT NOW!\n");
 	vm_stop(RUN_STATE_PAUSED);
 }
@@ -302,7 +376,7 @@ void enable_notifies(void){
 }
 
 void enable_reload_mode(void){
-	assert(false);
+	reload_mode = true;
 }
 
 void hprintf(char* msg){
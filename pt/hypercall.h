@@ -16,6 +16,14 @@
 #define KAFL_MODE_32	1
 #define KAFL_MODE_16	2
 
+/* 
+ * Third argument of the IP filter hypercall: agents which pick a range other
+ * than 0 tag the filter id, the register is unspecified for legacy two
+ * argument calls.
+ */
+#define KAFL_IP_FILTER_ID_MAGIC		0x4b41464c00000000ULL	/* "KAFL" << 32 */
+#define KAFL_IP_FILTER_ID(x)		(KAFL_IP_FILTER_ID_MAGIC | (x))
+
 typedef struct{
 	uint64_t ip[4];
 	uint64_t size[4];
@@ -77,6 +85,7 @@ typedef struct{
 
 void pt_setup_program(void* ptr);
 void pt_setup_payload(void* ptr);
+void pt_setup_payload_gpa(uint64_t gpa);
 void pt_setup_snd_handler(void (*tmp)(char, void*), void* tmp_s);
 void pt_setup_enable_hypercalls(void);
 
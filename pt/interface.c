@@ -25,19 +25,28 @@
 #include "sysemu/qtest.h"
 #include "qapi/visitor.h"
 #include "exec/ram_addr.h"
+#include "exec/address-spaces.h"
+#include "qemu/memfd.h"
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/vfs.h>
+#include <linux/magic.h>
 #include "pt.h"
 #include "pt/hypercall.h"
 #include "pt/interface.h"
 #include "pt/debug.h"
 #include "pt/synchronization.h"
 #include "pt/asm_decoder.h"
+#include "pt/doorbell.h"
+#include "pt/batch.h"
 
 #include <time.h>
 
 #define CONVERT_UINT64(x) (uint64_t)(strtoull(x, NULL, 16))
 
+#define KAFL_HUGEPAGE_SIZE	(2ULL << 20)	/* default hugetlb page size of memfd_create() */
+#define KAFL_MAX_SHM_FDS	6
+
 #define TYPE_KAFLMEM "kafl"
 #define KAFLMEM(obj) \
 		OBJECT_CHECK(kafl_mem_state, (obj), TYPE_KAFLMEM)
@@ -58,18 +67,39 @@ typedef struct kafl_mem_state {
 	char* data_bar_fd_2;
 	char* bitmap_file;
 	char* coverage_map_file;
+	char* doorbell_file;
+	char* batch_file;
+	char* payload_gpa;	/* hex, maps shm1 into guest physical memory */
+	char* cfg_cache_dir;
+	char* profile_dir;
 
 	char* ip_filter[4][2];
 
 	bool irq_filter;
+	uint32_t predisasm_threads;
+	uint32_t decode_threads;
 	uint64_t bitmap_size;
 	uint64_t coverage_map_size;
+	uint32_t doorbell_spin;
 
 	bool debug_mode; 	/* support for hprintf */
+	bool async_decode;
+	bool ovf_resync;
 	bool notifier;
 	bool reload_mode;
 	bool disable_snapshot;
 	bool lazy_vAPIC_reset;
+	bool memfd;			/* shared regions are memfds handed out over the chardev */
+	bool hugetlb;
+	bool virgin_map;	/* report new coverage along with each ACQUIRE, see pt_novelty() */
+
+	int shm_fds[KAFL_MAX_SHM_FDS];	/* program, payload, bitmap, coverage map, doorbell, batch (if configured) */
+	int shm_fd_count;
+	bool file_backed;	/* some region lives on a real file system and needs msync */
+
+	MemoryRegion payload_mr;
+	doorbell_t* doorbell;
+	QemuMutex doorbell_mutex;	/* vCPU threads and the main loop share the status ring */
 	
 } kafl_mem_state;
 
@@ -78,6 +108,13 @@ static void kafl_guest_event(void *opaque, QEMUChrEvent event){
 
 static void send_char(char val, void* tmp_s){
 	kafl_mem_state *s = tmp_s;
+
+	if(s->doorbell){
+		qemu_mutex_lock(&s->doorbell_mutex);
+		doorbell_push(&s->doorbell->status, val, s->doorbell_spin);
+		qemu_mutex_unlock(&s->doorbell_mutex);
+		return;
+	}
 	qemu_chr_fe_write(&s->chr, (const uint8_t *) &val, 1);
 }
 
@@ -103,7 +140,6 @@ static void kafl_guest_receive(void *opaque, const uint8_t * buf, int size){
 				break;
 
 			case KAFL_PROTO_RELOAD:
-				assert(false);
 				synchronization_reload_vm();
 				break;
 
@@ -112,24 +148,112 @@ static void kafl_guest_receive(void *opaque, const uint8_t * buf, int size){
 				synchronization_disable_pt(qemu_get_cpu(0));
 				send_char('F', s);
 				break;
+
+			/* the reply carries the memfds of all regions, none in file mode */
+			case KAFL_PROTO_SHM_FDS:
+				if(s->shm_fd_count){
+					qemu_chr_fe_set_msgfds(&s->chr, s->shm_fds, s->shm_fd_count);
+				}
+				qemu_chr_fe_write(&s->chr, &buf[i], 1);
+				break;
 		}
 	}
 }
 
-static int kafl_guest_create_memory_bar(kafl_mem_state *s, int region_num, uint64_t bar_size, const char* file, Error **errp){
+/* 
+ * Maps a region shared with the fuzzer: the given file (created if needed) or,
+ * with memfd=on, an anonymous memfd named after it which the fuzzer receives
+ * with KAFL_PROTO_SHM_FDS. Only regions on a disk backed file system need
+ * msync(), see pt_setup_shared_memory().
+ */
+static void* kafl_guest_map_region(kafl_mem_state *s, const char* file, uint64_t size, Error **errp){
 	void * ptr;
-	int fd;
+	int fd = -1;
 	struct stat st;
-	
-	fd = open(file, O_CREAT|O_RDWR, S_IRWXU|S_IRWXG|S_IRWXO);
-	assert(ftruncate(fd, bar_size) == 0);
-	stat(file, &st);
-	QEMU_PT_DEBUG(INTERFACE_PREFIX, "new shm file: (max size: %lx) %lx", bar_size, st.st_size);
-	
-	assert(bar_size >= st.st_size);
-	ptr = mmap(0, bar_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	struct statfs fs;
+	uint64_t map_size = size;
+
+	if(s->memfd){
+		Error *err = NULL;
+
+		assert(s->shm_fd_count < KAFL_MAX_SHM_FDS);
+		if(s->hugetlb){
+			map_size = ROUND_UP(size, KAFL_HUGEPAGE_SIZE);
+			fd = qemu_memfd_create(file, map_size, true, 0, 0, &err);
+			if(fd < 0){
+				warn_report_err(err);
+				err = NULL;
+				map_size = size;
+			}
+		}
+		if(!s->hugetlb || fd < 0){
+			fd = qemu_memfd_create(file, map_size, false, 0, 0, &err);
+		}
+		if(fd < 0){
+			error_propagate(errp, err);
+			return NULL;
+		}
+	} else {
+		fd = open(file, O_CREAT|O_RDWR, S_IRWXU|S_IRWXG|S_IRWXO);
+		if(fd < 0 || ftruncate(fd, size) || fstat(fd, &st)){
+			error_setg_errno(errp, errno, "Failed to set up %s", file);
+			if(fd >= 0){
+				close(fd);
+			}
+			return NULL;
+		}
+		QEMU_PT_DEBUG(INTERFACE_PREFIX, "new shm file: (max size: %lx) %lx", size, st.st_size);
+		assert(size == st.st_size);
+		if(fstatfs(fd, &fs) || (fs.f_type != TMPFS_MAGIC && fs.f_type != HUGETLBFS_MAGIC)){
+			s->file_backed = true;
+		}
+	}
+
+	ptr = mmap(0, map_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
 	if (ptr == MAP_FAILED) {
 		error_setg_errno(errp, errno, "Failed to mmap memory");
+		return NULL;
+	}
+	if(s->memfd){
+		s->shm_fds[s->shm_fd_count++] = fd;
+	}
+	return ptr;
+}
+
+/* 
+ * Read-only RAM in a hole of the guest physical address space, e.g. above the
+ * end of RAM: the agent maps it once and sees each input as soon as the
+ * fuzzer wrote it. The region is not migratable, so snapshot restores leave
+ * the current input alone.
+ */
+static int kafl_guest_map_payload(kafl_mem_state *s, void* ptr, const char* gpa_str, Error **errp){
+	MemoryRegionSection section;
+	uint64_t gpa;
+
+	if(qemu_strtou64(gpa_str, NULL, 16, &gpa) || !QEMU_IS_ALIGNED(gpa, qemu_real_host_page_size) ||
+	   gpa + PAYLOAD_SIZE < gpa){
+		error_setg(errp, "payload_gpa %s is not a page aligned guest physical address", gpa_str);
+		return -1;
+	}
+	/* would shadow RAM or a device the guest relies on */
+	section = memory_region_find(get_system_memory(), gpa, PAYLOAD_SIZE);
+	if(section.mr){
+		error_setg(errp, "payload_gpa %s overlaps %s", gpa_str, memory_region_name(section.mr));
+		memory_region_unref(section.mr);
+		return -1;
+	}
+
+	memory_region_init_ram_ptr(&s->payload_mr, OBJECT(s), "kafl-payload", PAYLOAD_SIZE, ptr);
+	memory_region_set_readonly(&s->payload_mr, true);
+	memory_region_add_subregion(get_system_memory(), gpa, &s->payload_mr);
+	pt_setup_payload_gpa(gpa);
+	return 0;
+}
+
+static int kafl_guest_create_memory_bar(kafl_mem_state *s, int region_num, uint64_t bar_size, const char* file, Error **errp){
+	void * ptr = kafl_guest_map_region(s, file, bar_size, errp);
+
+	if (!ptr) {
 		return -1;
 	}
 
@@ -137,6 +261,8 @@ static int kafl_guest_create_memory_bar(kafl_mem_state *s, int region_num, uint6
 		case 1:	pt_setup_program((void*)ptr);
 				break;
 		case 2:	pt_setup_payload((void*)ptr);
+				if(s->payload_gpa && kafl_guest_map_payload(s, ptr, s->payload_gpa, errp) < 0)
+					return -1;
 				break;
 	}
 
@@ -146,17 +272,9 @@ static int kafl_guest_create_memory_bar(kafl_mem_state *s, int region_num, uint6
 }
 
 static int kafl_guest_setup_bitmap(kafl_mem_state *s, uint32_t bitmap_size, Error **errp){
-	void * ptr;
-	int fd;
-	struct stat st;
-	
-	fd = open(s->bitmap_file, O_CREAT|O_RDWR, S_IRWXU|S_IRWXG|S_IRWXO);
-	assert(ftruncate(fd, bitmap_size) == 0);
-	stat(s->bitmap_file, &st);
-	assert(bitmap_size == st.st_size);
-	ptr = mmap(0, bitmap_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
-	if (ptr == MAP_FAILED) {
-		error_setg_errno(errp, errno, "Failed to mmap memory");
+	void * ptr = kafl_guest_map_region(s, s->bitmap_file, bitmap_size, errp);
+
+	if (!ptr) {
 		return -1;
 	}
 	pt_setup_bitmap((void*)ptr);
@@ -165,17 +283,9 @@ static int kafl_guest_setup_bitmap(kafl_mem_state *s, uint32_t bitmap_size, Erro
 }
 
 static int kafl_guest_setup_coverage_map(kafl_mem_state *s, uint32_t coverage_map_size, Error **errp){
-	void * ptr;
-	int fd;
-	struct stat st;
-	
-	fd = open(s->coverage_map_file, O_CREAT|O_RDWR, S_IRWXU|S_IRWXG|S_IRWXO);
-	assert(ftruncate(fd, coverage_map_size) == 0);
-	stat(s->coverage_map_file, &st);
-	assert(coverage_map_size == st.st_size);
-	ptr = mmap(0, coverage_map_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
-	if (ptr == MAP_FAILED) {
-		error_setg_errno(errp, errno, "Failed to mmap memory");
+	void * ptr = kafl_guest_map_region(s, s->coverage_map_file, coverage_map_size, errp);
+
+	if (!ptr) {
 		return -1;
 	}
 	pt_setup_coverage_map((void*)ptr);
@@ -183,6 +293,38 @@ static int kafl_guest_setup_coverage_map(kafl_mem_state *s, uint32_t coverage_ma
 	return 0;
 }
 
+/* the fuzzer polls the magic and must ignore the rings until it is set */
+static int kafl_guest_setup_doorbell(kafl_mem_state *s, Error **errp){
+	void * ptr = kafl_guest_map_region(s, s->doorbell_file, DOORBELL_SIZE, errp);
+
+	if (!ptr) {
+		return -1;
+	}
+	s->doorbell = (doorbell_t*)ptr;
+	doorbell_init(s->doorbell);
+	qemu_mutex_init(&s->doorbell_mutex);
+
+	/* the other side cannot make progress while we spin on a single CPU */
+	if(sysconf(_SC_NPROCESSORS_ONLN) < 2){
+		s->doorbell_spin = 0;
+	}
+	synchronization_setup_doorbell(s->doorbell, s->doorbell_spin);
+
+	return 0;
+}
+
+/* as for the doorbell, the fuzzer waits for the magic before it queues inputs */
+static int kafl_guest_setup_batch(kafl_mem_state *s, Error **errp){
+	void * ptr = kafl_guest_map_region(s, s->batch_file, BATCH_SIZE, errp);
+
+	if (!ptr) {
+		return -1;
+	}
+	batch_init((batch_t*)ptr);
+
+	return 0;
+}
+
 static void pci_kafl_guest_realize(DeviceState *dev, Error **errp){
 	kafl_mem_state *s = KAFLMEM(dev);
 
@@ -207,6 +349,26 @@ static void pci_kafl_guest_realize(DeviceState *dev, Error **errp){
 		kafl_guest_setup_bitmap(s, irpt_bitmap_size, errp);
 	if(s->coverage_map_file)
 		kafl_guest_setup_coverage_map(s, irpt_coverage_map_size, errp);
+	if(s->doorbell_file)
+		kafl_guest_setup_doorbell(s, errp);
+	if(s->batch_file)
+		kafl_guest_setup_batch(s, errp);
+	if(!s->file_backed)
+		pt_setup_shared_memory();
+	if(s->virgin_map)
+		pt_setup_virgin_map();
+	if(s->cfg_cache_dir)
+		pt_setup_cfg_cache(s->cfg_cache_dir);
+	if(s->profile_dir)
+		pt_setup_timing_profile(s->profile_dir);
+	if(s->predisasm_threads)
+		pt_setup_predisassembly(s->predisasm_threads);
+	if(s->decode_threads)
+		pt_setup_parallel_decode(s->decode_threads);
+	if(s->async_decode)
+		pt_setup_async_decode();
+	if(s->ovf_resync)
+		pt_setup_ovf_resync();
 
 	if(s->irq_filter){
 	}
@@ -242,6 +404,11 @@ static Property kafl_guest_properties[] = {
 	DEFINE_PROP_STRING("shm1", kafl_mem_state, data_bar_fd_1),
 	DEFINE_PROP_STRING("bitmap", kafl_mem_state, bitmap_file),
 	DEFINE_PROP_STRING("coverage_map", kafl_mem_state, coverage_map_file),
+	DEFINE_PROP_STRING("doorbell", kafl_mem_state, doorbell_file),
+	DEFINE_PROP_STRING("batch", kafl_mem_state, batch_file),
+	DEFINE_PROP_STRING("payload_gpa", kafl_mem_state, payload_gpa),
+	DEFINE_PROP_STRING("cfg_cache", kafl_mem_state, cfg_cache_dir),
+	DEFINE_PROP_STRING("timing_profile", kafl_mem_state, profile_dir),
 	/* 
 	 * Since DEFINE_PROP_UINT64 is somehow broken (signed/unsigned madness),
 	 * let's use DEFINE_PROP_STRING and post-process all values via strtol...
@@ -257,9 +424,24 @@ static Property kafl_guest_properties[] = {
 	DEFINE_PROP_STRING("ip3_b", kafl_mem_state, ip_filter[3][1]),
 	*/
 	DEFINE_PROP_BOOL("irq_filter", kafl_mem_state, irq_filter, false),
+	DEFINE_PROP_UINT32("predisasm_threads", kafl_mem_state, predisasm_threads, 0),
+	/* 
+	 * decode_threads: large ToPA buffers are split at PSBs and decoded in
+	 * parallel. Each segment starts without the state the previous one ended
+	 * in, so the edges around segment boundaries are approximate compared to
+	 * decode_threads=0. Build with PARALLEL_DECODE_VERIFY to measure the
+	 * difference.
+	 */
+	DEFINE_PROP_UINT32("decode_threads", kafl_mem_state, decode_threads, 0),
 	DEFINE_PROP_UINT64("bitmap_size", kafl_mem_state, bitmap_size, DEFAULT_IRPT_BITMAP_SIZE),
 	DEFINE_PROP_UINT64("coverage_map_size", kafl_mem_state, coverage_map_size, DEFAULT_IRPT_COVERAGE_MAP_SIZE),
+	DEFINE_PROP_UINT32("doorbell_spin", kafl_mem_state, doorbell_spin, DOORBELL_SPIN_DEFAULT),
 	DEFINE_PROP_BOOL("debug_mode", kafl_mem_state, debug_mode, false),
+	DEFINE_PROP_BOOL("async_decode", kafl_mem_state, async_decode, false),
+	DEFINE_PROP_BOOL("ovf_resync", kafl_mem_state, ovf_resync, false),
+	DEFINE_PROP_BOOL("memfd", kafl_mem_state, memfd, false),
+	DEFINE_PROP_BOOL("hugetlb", kafl_mem_state, hugetlb, false),
+	DEFINE_PROP_BOOL("virgin_map", kafl_mem_state, virgin_map, false),
 	DEFINE_PROP_BOOL("crash_notifier", kafl_mem_state, notifier, true),
 	DEFINE_PROP_BOOL("reload_mode", kafl_mem_state, reload_mode, true),
 	DEFINE_PROP_BOOL("disable_snapshot", kafl_mem_state, disable_snapshot, false),
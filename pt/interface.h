@@ -17,6 +17,7 @@
 
 #define PROGRAM_SIZE				(128 << 18) /* 32MB Application Data */
 #define PAYLOAD_SIZE				0x10000 	
+#define PAYLOAD_LEN_SIZE			sizeof(uint32_t)	/* the fuzzer prefixes each input with its length */
 #define INFO_SIZE					(128 << 10)	/* 128KB Info Data */
 #define HPRINTF_SIZE				0x1000 		/* 4KB hprintf Data */
 
@@ -43,9 +44,31 @@
 #define KAFL_PROTO_PT_TRASHED_KASAN		'N'
 
 #define KAFL_PROTO_PT_ABORT				'H'
+#define KAFL_PROTO_PT_PARTIAL			'P'	/* ACQUIRE, but the trace had OVF gaps */
 
 /* kirasys */
 #define KAFL_PROTO_LOCK              'l'
 #define KAFL_PROTO_COVER_ON          'o'
 #define KAFL_PROTO_COVER_OFF         'x'
+#define KAFL_PROTO_SHM_FDS           'S'	/* request / reply with the memfds of all regions */
+/* with doorbell=..., every reply except SHM_FDS goes through the rings of pt/doorbell.h */
+
+/* 
+ * With payload_gpa=..., GET_PAYLOAD stores this descriptor at the start of the
+ * agent's buffer instead of a copy of the payload. The payload region is then
+ * mapped read-only at gpa in guest physical memory and inputs are never copied.
+ * gpa has to be page aligned and must not overlap RAM or MMIO.
+ */
+#define KAFL_PAYLOAD_DESC_MAGIC		0x5041594c4f414453ULL	/* "SDAOLYAP" */
+
+typedef struct kafl_payload_desc_s{
+	uint64_t magic;
+	uint64_t gpa;
+	uint64_t size;
+} kafl_payload_desc_t;
+
+/* with virgin_map=on, ACQUIRE and PT_PARTIAL are followed by one of these */
+#define KAFL_PROTO_NOVELTY_NONE      '0'
+#define KAFL_PROTO_NOVELTY_COUNTS    '1'	/* new hit count buckets only */
+#define KAFL_PROTO_NOVELTY_EDGES     '2'
 #endif
@@ -9,59 +9,194 @@
 #include "memory_access.h"
 #include "hypercall.h"
 #include "debug.h"
+#include "cpu.h"
+#include "qemu/atomic.h"
+#include "qemu/rcu.h"
+#include "qemu/thread.h"
+#include "exec/memory.h"
+#include "exec/address-spaces.h"
+#include "sysemu/runstate.h"
+
+/*
+ * Soft-TLB of guest virtual pages backed by guest RAM, one per vCPU. A hit
+ * saves the software page walk and the MemoryRegion lookup; the data is then
+ * copied from / to guest RAM directly. Entries are tagged with CR3, so other
+ * address spaces simply miss. Page table updates within one address space are
+ * not tracked: the TLB of a vCPU is flushed when its agent submits CR3, all
+ * of them whenever the VM is resumed (e.g. after a snapshot was restored) or
+ * the memory map changes (BAR remap, hotplug, the payload_gpa subregion).
+ * Cached host pointers are only used within the RCU read section of the
+ * access which looked them up, so the RAM behind them cannot go away.
+ */
+#define MEM_TLB_BITS		8
+#define MEM_TLB_SIZE		(1 << MEM_TLB_BITS)
+
+typedef struct mem_tlb_entry_s{
+	uint64_t vpage;
+	uint64_t cr3;
+	uint32_t generation;	/* valid while it matches mem_tlb_generation */
+	bool writable;
+	uint8_t* host;
+	MemoryRegion* mr;
+	hwaddr mr_offset;		/* of the page, for dirty tracking */
+} mem_tlb_entry_t;
+
+typedef struct mem_tlb_s{
+	QemuSpin lock;			/* vCPU thread and asynchronous decoder */
+	mem_tlb_entry_t entries[MEM_TLB_SIZE];
+	uint64_t hits;
+	uint64_t misses;
+} mem_tlb_t;
+
+static uint32_t mem_tlb_generation = 1;
+
+static void mem_tlb_vm_state_change(void *opaque, int running, RunState state){
+	if(running){
+		mem_tlb_flush_all();
+	}
+}
+
+/* any change of the memory map may have moved or dropped cached RAM pages */
+static void mem_tlb_memory_commit(MemoryListener *listener){
+	mem_tlb_flush_all();
+}
+
+static MemoryListener mem_tlb_listener = {
+	.commit = mem_tlb_memory_commit,
+};
+
+/* once, before the first vCPU is created */
+void mem_tlb_setup(void){
+	qemu_add_vm_change_state_handler(mem_tlb_vm_state_change, NULL);
+	memory_listener_register(&mem_tlb_listener, &address_space_memory);
+}
+
+void* mem_tlb_new(void){
+	mem_tlb_t* tlb = malloc(sizeof(mem_tlb_t));
+
+	memset(tlb, 0x00, sizeof(mem_tlb_t));
+	qemu_spin_init(&tlb->lock);
+	return tlb;
+}
+
+void mem_tlb_flush(CPUState *cpu){
+	mem_tlb_t* tlb = cpu->pt_tlb;
+
+	if(tlb){
+		qemu_spin_lock(&tlb->lock);
+		for(int i = 0; i < MEM_TLB_SIZE; i++){
+			tlb->entries[i].generation = 0;
+		}
+		qemu_spin_unlock(&tlb->lock);
+	}
+}
+
+void mem_tlb_flush_all(void){
+	atomic_inc(&mem_tlb_generation);
+}
+
+void mem_tlb_stats(CPUState *cpu, uint64_t* hits, uint64_t* misses){
+	mem_tlb_t* tlb = cpu->pt_tlb;
+
+	*hits = tlb ? tlb->hits : 0;
+	*misses = tlb ? tlb->misses : 0;
+}
+
+static inline uint64_t mem_cr3(CPUState *cpu){
+	return X86_CPU(cpu)->env.cr[3];
+}
+
+/*
+ * Translates a guest virtual page, false if it is not mapped. page->host is
+ * set for guest RAM which may be accessed directly, *phys / *asidx otherwise.
+ * The caller holds the RCU read lock until it is done with page->host.
+ */
+static bool mem_translate(CPUState *cpu, uint64_t vpage, bool is_write, mem_tlb_entry_t* page, hwaddr* phys, int* asidx){
+	mem_tlb_t* tlb = cpu->pt_tlb;
+	mem_tlb_entry_t* entry = NULL;
+	uint32_t generation = atomic_read(&mem_tlb_generation);
+	uint64_t cr3 = mem_cr3(cpu);
+	MemTxAttrs attrs = MEMTXATTRS_UNSPECIFIED;
+	MemoryRegion* mr;
+	hwaddr xlat, len = x86_64_PAGE_SIZE;
+
+	if(tlb){
+		entry = &tlb->entries[(vpage >> 12) & (MEM_TLB_SIZE - 1)];
+		qemu_spin_lock(&tlb->lock);
+		if(entry->generation == generation && entry->vpage == vpage && entry->cr3 == cr3 && (entry->writable || !is_write)){
+			*page = *entry;
+			tlb->hits++;
+			qemu_spin_unlock(&tlb->lock);
+			return true;
+		}
+		tlb->misses++;
+		qemu_spin_unlock(&tlb->lock);
+	}
+
+	*phys = cpu_get_phys_page_attrs_debug(cpu, vpage, &attrs);
+	if(*phys == -1){
+		return false;
+	}
+	*asidx = cpu_asidx_from_attrs(cpu, attrs);
+
+	memset(page, 0x00, sizeof(mem_tlb_entry_t));
+	mr = address_space_translate(cpu_get_address_space(cpu, *asidx), *phys, &xlat, &len, is_write, attrs);
+	if(len < x86_64_PAGE_SIZE || !memory_region_is_ram(mr) || memory_region_is_ram_device(mr)){
+		return true;
+	}
+	page->vpage = vpage;
+	page->cr3 = cr3;
+	page->generation = generation;
+	page->writable = memory_access_is_direct(mr, true);
+	page->host = (uint8_t*)memory_region_get_ram_ptr(mr) + xlat;
+	page->mr = mr;
+	page->mr_offset = xlat;
+	if(!page->writable && is_write){
+		page->host = NULL;
+		return true;
+	}
+	if(entry){
+		qemu_spin_lock(&tlb->lock);
+		*entry = *page;
+		qemu_spin_unlock(&tlb->lock);
+	}
+	return true;
+}
 
 bool read_virtual_memory(uint64_t address, uint8_t* data, uint32_t size, CPUState *cpu){
-	uint8_t tmp_buf[x86_64_PAGE_SIZE];
-	MemTxAttrs attrs;
+	mem_tlb_entry_t page;
 	hwaddr phys_addr;
 	int asidx;
 	bool ret = true;
-  uint64_t amount_copied = 0;
-	
+	uint64_t amount_copied = 0;
+
 	//cpu_synchronize_state(cpu);
-	kvm_cpu_synchronize_state(cpu);
+	/* the asynchronous decoder thread uses the last synchronized state */
+	if (qemu_cpu_is_self(cpu))
+		kvm_cpu_synchronize_state(cpu);
 
+	RCU_READ_LOCK_GUARD();
 	/* copy per page */
 	while(amount_copied < size){
-		uint64_t len_to_copy = (size - amount_copied);
-    if(len_to_copy > x86_64_PAGE_SIZE)
-      len_to_copy = x86_64_PAGE_SIZE;
-
-		asidx = cpu_asidx_from_attrs(cpu, MEMTXATTRS_UNSPECIFIED);
-		attrs = MEMTXATTRS_UNSPECIFIED;
-		phys_addr = cpu_get_phys_page_attrs_debug(cpu, (address & x86_64_PAGE_MASK), &attrs);
-
-    if (phys_addr == -1){
-      uint64_t next_page = (address & x86_64_PAGE_MASK) + x86_64_PAGE_SIZE;
-      uint64_t len_skipped =next_page-address;  
-      if(len_skipped > size-amount_copied){
-        len_skipped = size-amount_copied;
-      }
-
-      QEMU_PT_PRINTF(MEM_PREFIX, "Warning, read from unmapped memory: %lx, skipping to %lx", address, next_page);
-	  memset( data+amount_copied, 0x90,  len_skipped); // fill with NOPs
-      address += len_skipped;
-      amount_copied += len_skipped;
-      ret = false;
-      continue;
-    }
-		
-		phys_addr += (address & ~x86_64_PAGE_MASK);
-    uint64_t remaining_on_page = x86_64_PAGE_SIZE - (address & ~x86_64_PAGE_MASK);
-    if(len_to_copy > remaining_on_page){
-      len_to_copy = remaining_on_page;
-    }
-		MemTxResult txt = address_space_rw(cpu_get_address_space(cpu, asidx), phys_addr, MEMTXATTRS_UNSPECIFIED, tmp_buf, len_to_copy, 0);
-    if(txt){
-      QEMU_PT_PRINTF(MEM_PREFIX, "Warning, read failed:\t%lx", address);
-    }
-		
-		memcpy(data+amount_copied, tmp_buf, len_to_copy);
-		
+		uint64_t offset = address & ~x86_64_PAGE_MASK;
+		uint64_t len_to_copy = MIN(size - amount_copied, x86_64_PAGE_SIZE - offset);
+
+		if(!mem_translate(cpu, address & x86_64_PAGE_MASK, false, &page, &phys_addr, &asidx)){
+			QEMU_PT_PRINTF(MEM_PREFIX, "Warning, read from unmapped memory: %lx, skipping to %lx", address, (address & x86_64_PAGE_MASK) + x86_64_PAGE_SIZE);
+			memset(data + amount_copied, 0x90, len_to_copy); // fill with NOPs
+			ret = false;
+		}
+		else if(page.host){
+			memcpy(data + amount_copied, page.host + offset, len_to_copy);
+		}
+		else if(address_space_rw(cpu_get_address_space(cpu, asidx), phys_addr + offset, MEMTXATTRS_UNSPECIFIED, data + amount_copied, len_to_copy, false)){
+			QEMU_PT_PRINTF(MEM_PREFIX, "Warning, read failed:\t%lx", address);
+		}
+
 		address += len_to_copy;
 		amount_copied += len_to_copy;
 	}
-	
+
 	return ret;
 }
 
@@ -76,41 +211,33 @@ bool is_addr_mapped(uint64_t address, CPUState *cpu){
 
 bool write_virtual_memory(uint64_t address, uint8_t* data, uint32_t size, CPUState *cpu)
 {
+	mem_tlb_entry_t page;
+	hwaddr phys_addr;
 	int asidx;
-	MemTxAttrs attrs;
-    hwaddr phys_addr;
-    MemTxResult res;
-
-    uint64_t counter, l, i;
-
-    counter = size;
-	while(counter != 0){
-		l = x86_64_PAGE_SIZE;
-        if (l > counter)
-            l = counter;
+	uint64_t counter = size;
 
 	kvm_cpu_synchronize_state(cpu);
-        //cpu_synchronize_state(cpu);
-        asidx = cpu_asidx_from_attrs(cpu, MEMTXATTRS_UNSPECIFIED);
-        attrs = MEMTXATTRS_UNSPECIFIED;
-        phys_addr = cpu_get_phys_page_attrs_debug(cpu, (address & x86_64_PAGE_MASK), &attrs);
+	RCU_READ_LOCK_GUARD();
+	while(counter != 0){
+		uint64_t offset = address & ~x86_64_PAGE_MASK;
+		uint64_t l = MIN(counter, x86_64_PAGE_SIZE - offset);
 
-        if (phys_addr == -1){
-        	QEMU_PT_PRINTF(MEM_PREFIX, "phys_addr == -1:\t%lx", address);
-            return false;
-        }
-        
-        phys_addr += (address & ~x86_64_PAGE_MASK);   
-        res = address_space_rw(cpu_get_address_space(cpu, asidx), phys_addr, MEMTXATTRS_UNSPECIFIED, data, l, true);
-        if (res != MEMTX_OK){
-        	QEMU_PT_PRINTF(MEM_PREFIX, "!MEMTX_OK:\t%lx", address);
-            return false;
-        }   
+		if(!mem_translate(cpu, address & x86_64_PAGE_MASK, true, &page, &phys_addr, &asidx)){
+			QEMU_PT_PRINTF(MEM_PREFIX, "phys_addr == -1:\t%lx", address);
+			return false;
+		}
+		if(page.host){
+			memcpy(page.host + offset, data, l);
+			memory_region_set_dirty(page.mr, page.mr_offset + offset, l);
+		}
+		else if(address_space_rw(cpu_get_address_space(cpu, asidx), phys_addr + offset, MEMTXATTRS_UNSPECIFIED, data, l, true) != MEMTX_OK){
+			QEMU_PT_PRINTF(MEM_PREFIX, "!MEMTX_OK:\t%lx", address);
+			return false;
+		}
 
-        i++;
-        data += l;
-        address += l;
-        counter -= l;
+		data += l;
+		address += l;
+		counter -= l;
 	}
 
 	return true;
@@ -23,4 +23,10 @@ bool write_virtual_memory(uint64_t address, uint8_t* data, uint32_t size, CPUSta
 void hexdump_virtual_memory(uint64_t address, uint32_t size, CPUState *cpu);
 bool write_virtual_shadow_memory(uint64_t address, uint8_t* data, uint32_t size, CPUState *cpu);
 bool is_addr_mapped(uint64_t address, CPUState *cpu);
+
+void mem_tlb_setup(void);
+void* mem_tlb_new(void);
+void mem_tlb_flush(CPUState *cpu);
+void mem_tlb_flush_all(void);
+void mem_tlb_stats(CPUState *cpu, uint64_t* hits, uint64_t* misses);
 #endif
@@ -0,0 +1,146 @@
+/*
+ * *
+ * Sergej Schumilo, 2019 <sergej@schumilo.de>
+ * Cornelius Aschermann, 2019 <cornelius.aschermann@rub.de>
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/host-utils.h"
+#include "pt/novelty.h"
+#include "pt/disassembler.h"
+
+static uint8_t count_class[256];
+
+static void __attribute__((constructor)) init_count_class(void){
+	for(uint32_t i = 1; i < 256; i++){
+		if(i < 3){
+			count_class[i] = i;
+		}
+		else if(i < 32){
+			/* 3, 4-7, 8-15, 16-31 */
+			count_class[i] = (i == 3) ? 4 : 1 << (32 - clz32(i));
+		}
+		else {
+			count_class[i] = (i < 128) ? 64 : 128;
+		}
+	}
+}
+
+static inline uint8_t novelty_byte(uint8_t* virgin, uint8_t count){
+	uint8_t bucket = count_class[count];
+	uint8_t res = NOVELTY_NONE;
+
+	if(bucket & *virgin){
+		res = (*virgin == 0xff) ? NOVELTY_NEW_EDGES : NOVELTY_NEW_COUNTS;
+		*virgin &= ~bucket;
+	}
+	return res;
+}
+
+/* most lines only hold a few hit edges: skip empty qwords */
+static uint8_t novelty_line_scalar(uint8_t* virgin, const uint8_t* trace, uint32_t len){
+	uint8_t res = NOVELTY_NONE;
+	uint32_t i = 0;
+
+	for(; i + 8 <= len; i += 8){
+		uint64_t counts;
+		memcpy(&counts, trace + i, sizeof(counts));
+		if(!counts){
+			continue;
+		}
+		for(uint32_t j = i; j < i + 8; j++){
+			res = MAX(res, novelty_byte(&virgin[j], trace[j]));
+		}
+	}
+	for(; i < len; i++){
+		res = MAX(res, novelty_byte(&virgin[i], trace[i]));
+	}
+	return res;
+}
+
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
+
+/*
+ * Buckets 32 counts at once: counts below 16 are looked up by their low
+ * nibble, all others by their high nibble alone.
+ */
+static inline __m256i count_class_avx2(__m256i v){
+	const __m256i nibble = _mm256_set1_epi8(0x0f);
+	const __m256i lut_lo = _mm256_setr_epi8(0, 1, 2, 4, 8, 8, 8, 8, 16, 16, 16, 16, 16, 16, 16, 16,
+											0, 1, 2, 4, 8, 8, 8, 8, 16, 16, 16, 16, 16, 16, 16, 16);
+	const __m256i lut_hi = _mm256_setr_epi8(0, 32, 64, 64, 64, 64, 64, 64, -128, -128, -128, -128, -128, -128, -128, -128,
+											0, 32, 64, 64, 64, 64, 64, 64, -128, -128, -128, -128, -128, -128, -128, -128);
+	__m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble);
+	__m256i lo = _mm256_shuffle_epi8(lut_lo, _mm256_and_si256(v, nibble));
+	__m256i hi_zero = _mm256_cmpeq_epi8(hi, _mm256_setzero_si256());
+
+	return _mm256_or_si256(_mm256_shuffle_epi8(lut_hi, hi), _mm256_and_si256(lo, hi_zero));
+}
+
+static uint8_t novelty_line_avx2(uint8_t* virgin, const uint8_t* trace, uint32_t len){
+	__m256i lo, hi;
+
+	if(len != EDGE_LINE_SIZE){
+		return novelty_line_scalar(virgin, trace, len);
+	}
+	lo = _mm256_and_si256(count_class_avx2(_mm256_loadu_si256((__m256i *)trace)), _mm256_loadu_si256((__m256i *)virgin));
+	hi = _mm256_and_si256(count_class_avx2(_mm256_loadu_si256((__m256i *)(trace + 32))), _mm256_loadu_si256((__m256i *)(virgin + 32)));
+	lo = _mm256_or_si256(lo, hi);
+	if(likely(_mm256_testz_si256(lo, lo))){
+		return NOVELTY_NONE;
+	}
+	return novelty_line_scalar(virgin, trace, len);
+}
+#pragma GCC pop_options
+#endif /* CONFIG_AVX2_OPT */
+
+static uint8_t (*novelty_line_accel)(uint8_t*, const uint8_t*, uint32_t) = novelty_line_scalar;
+
+#ifdef CONFIG_AVX2_OPT
+#include "qemu/cpuid.h"
+
+static void __attribute__((constructor)) init_novelty_accel(void){
+	int max = __get_cpuid_max(0, NULL);
+	int a, b, c, d;
+
+	/* AVX has to be usable, not just available */
+	if (max >= 7) {
+		__cpuid(1, a, b, c, d);
+		if ((c & bit_OSXSAVE) && (c & bit_AVX)) {
+			int bv;
+			__asm("xgetbv" : "=a"(bv), "=d"(d) : "c"(0));
+			__cpuid_count(7, 0, a, b, c, d);
+			if ((bv & 0x6) == 0x6 && (b & bit_AVX2)) {
+				novelty_line_accel = novelty_line_avx2;
+			}
+		}
+	}
+}
+#endif
+
+uint8_t* novelty_virgin_new(uint32_t size){
+	uint8_t* virgin = g_malloc(size);
+	memset(virgin, 0xff, size);
+	return virgin;
+}
+
+uint8_t novelty_compare(uint8_t* virgin, const uint8_t* trace, const uint64_t* dirty, uint32_t size){
+	uint8_t res = NOVELTY_NONE;
+
+	for(uint32_t i = 0; i < edge_dirty_words(size); i++){
+		uint64_t lines = dirty[i];
+		while(lines){
+			uint32_t offset = ((i << 6) + ctz64(lines)) << EDGE_LINE_BITS;
+			if(offset < size){
+				res = MAX(res, novelty_line_accel(virgin + offset, trace + offset, MIN(EDGE_LINE_SIZE, size - offset)));
+			}
+			lines &= lines - 1;
+		}
+	}
+	return res;
+}
@@ -0,0 +1,33 @@
+/*
+ * *
+ * Sergej Schumilo, 2019 <sergej@schumilo.de>
+ * Cornelius Aschermann, 2019 <cornelius.aschermann@rub.de>
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#ifndef NOVELTY_H
+#define NOVELTY_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* verdicts, ordered by interest */
+#define NOVELTY_NONE		0
+#define NOVELTY_NEW_COUNTS	1	/* a known edge hit a new hit count bucket */
+#define NOVELTY_NEW_EDGES	2	/* an edge which was never hit before */
+
+/*
+ * The virgin map holds one byte per bitmap entry with a bit set for every hit
+ * count bucket (1, 2, 3, 4-7, 8-15, 16-31, 32-127, 128+) not seen so far, the
+ * same layout AFL uses. It starts out as all-ones, release it with g_free().
+ */
+uint8_t* novelty_virgin_new(uint32_t size);
+
+/*
+ * Buckets the hit counts of all cache lines of trace marked in dirty, clears
+ * the buckets it finds in virgin and returns the most interesting verdict.
+ */
+uint8_t novelty_compare(uint8_t* virgin, const uint8_t* trace, const uint64_t* dirty, uint32_t size);
+
+#endif
@@ -15,7 +15,11 @@
 #include "sysemu/sysemu.h"
 #include "sysemu/runstate.h"
 #include "sysemu/kvm.h"
+#include "qemu/main-loop.h"
 #include "pt.h"
+#include "pt/novelty.h"
+#include "pt/fast_snapshot.h"
+#include "pt/batch.h"
 
 pthread_mutex_t synchronization_lock_mutex = PTHREAD_MUTEX_INITIALIZER;
 pthread_cond_t synchronization_lock_condition = PTHREAD_COND_INITIALIZER;
@@ -24,6 +28,44 @@ pthread_mutex_t synchronization_disable_pt_mutex = PTHREAD_MUTEX_INITIALIZER;
 volatile bool synchronization_reload_pending = false;
 volatile bool synchronization_kvm_loop_waiting = false;
 
+/* RELEASE and friends arrive over the command ring instead of the chardev */
+static doorbell_t* synchronization_doorbell = NULL;
+static uint32_t synchronization_doorbell_spin = 0;
+
+void synchronization_setup_doorbell(doorbell_t* bell, uint32_t spin){
+	synchronization_doorbell = bell;
+	synchronization_doorbell_spin = spin;
+}
+
+/* handles the commands the fuzzer queued up to and including its RELEASE, false on RELOAD */
+static bool synchronization_wait_doorbell(void){
+	while(true){
+		switch(doorbell_pop(&synchronization_doorbell->command, synchronization_doorbell_spin)){
+			case KAFL_PROTO_RELEASE:
+				hypercall_reset_hprintf_counter();
+				return true;
+
+			case KAFL_PROTO_COVER_ON:
+				pt_turn_on_coverage_map();
+				break;
+
+			case KAFL_PROTO_COVER_OFF:
+				pt_turn_off_coverage_map();
+				break;
+
+			/* the vCPU is parked right here, no need to stop the VM */
+			case KAFL_PROTO_RELOAD:
+				synchronization_disable_pt(qemu_get_cpu(0));
+				qemu_mutex_lock_iothread();
+				fast_snapshot_restore();
+				qemu_mutex_unlock_iothread();
+				hypercall_reset_hprintf_counter();
+				hypercall_snd_char(KAFL_PROTO_RELOAD);
+				return false;
+		}
+	}
+}
+
 void synchronization_check_reload_pending(CPUState *cpu){
 	bool value;
 	pthread_mutex_lock(&synchronization_lock_mutex);
@@ -41,8 +83,28 @@ void synchronization_unlock(void){
 	pthread_mutex_unlock(&synchronization_lock_mutex);
 }	
 
-void synchronization_lock(CPUState *cpu){
+static void synchronization_snd_novelty(void){
+	uint8_t verdict;
+
+	if(pt_novelty(&verdict)){
+		switch(verdict){
+			case NOVELTY_NEW_EDGES:		hypercall_snd_char(KAFL_PROTO_NOVELTY_EDGES); break;
+			case NOVELTY_NEW_COUNTS:	hypercall_snd_char(KAFL_PROTO_NOVELTY_COUNTS); break;
+			default:					hypercall_snd_char(KAFL_PROTO_NOVELTY_NONE); break;
+		}
+	}
+}
+
+/* 
+ * Reports the last run and waits for the fuzzer. Returns false if the VM was
+ * reloaded meanwhile: the guest then resumes at the snapshot, so the caller
+ * must neither touch guest memory nor start tracing.
+ */
+bool synchronization_lock(CPUState *cpu){
+	bool released;
 
+	/* intel_pt_run_trashed and the bitmap are final once all chunks are decoded */
+	pt_decode_fence(cpu);
 	pthread_mutex_lock(&synchronization_lock_mutex);
 	if(!synchronization_reload_pending){
 		synchronization_kvm_loop_waiting = true;
@@ -52,23 +114,39 @@ void synchronization_lock(CPUState *cpu){
 			hypercall_snd_char(KAFL_PROTO_PT_TRASHED);
 			cpu->intel_pt_run_trashed = false;
 		} 
+		else if(cpu->intel_pt_run_gaps){
+			/* coverage up to and after each OVF is valid, only the gaps are missing */
+			hypercall_snd_char(KAFL_PROTO_PT_PARTIAL);
+			synchronization_snd_novelty();
+		}
 		else {
 			hypercall_snd_char(KAFL_PROTO_ACQUIRE);
+			synchronization_snd_novelty();
 		}
+		cpu->intel_pt_run_gaps = 0;
 	}
 	else{
 		atomic_set(&cpu->kvm_run->immediate_exit, 1);
 		pthread_mutex_unlock(&synchronization_lock_mutex);
-		return;
+		return false;
+	}
+	if(synchronization_doorbell){
+		pthread_mutex_unlock(&synchronization_lock_mutex);
+		released = synchronization_wait_doorbell();
+		pthread_mutex_lock(&synchronization_lock_mutex);
+	}
+	else {
+		pthread_cond_wait(&synchronization_lock_condition, &synchronization_lock_mutex);
+		/* synchronization_reload_vm() wakes us up as well */
+		released = !synchronization_reload_pending;
 	}
-	pthread_cond_wait(&synchronization_lock_condition, &synchronization_lock_mutex);
 	synchronization_kvm_loop_waiting = false;
 	pthread_mutex_unlock(&synchronization_lock_mutex);
+	return released;
 }	
 
 void synchronization_reload_vm(void){
 	CPUState *cpu = qemu_get_cpu(0);
-	assert(false);
 
 	pthread_mutex_lock(&synchronization_lock_mutex);
 	synchronization_reload_pending = true;
@@ -85,7 +163,10 @@ void synchronization_reload_vm(void){
 
 	pthread_mutex_lock(&synchronization_lock_mutex);
 
-	//fast_loadvm();
+	batch_cancel();
+	if(fast_snapshot_exists()){
+		fast_snapshot_restore();
+	}
 
 	synchronization_reload_pending = false;
 	synchronization_kvm_loop_waiting = false;
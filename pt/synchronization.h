@@ -10,9 +10,11 @@
 
 #include "qemu/osdep.h"
 #include <linux/kvm.h>
+#include "pt/doorbell.h"
 
 void synchronization_check_reload_pending(CPUState *cpu);
 void synchronization_unlock(void);
-void synchronization_lock(CPUState *cpu);
+bool synchronization_lock(CPUState *cpu);
 void synchronization_reload_vm(void);
 void synchronization_disable_pt(CPUState *cpu);
+void synchronization_setup_doorbell(doorbell_t* bell, uint32_t spin);
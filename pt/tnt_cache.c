@@ -8,7 +8,6 @@
 
 #include "tnt_cache.h"
 #include <assert.h>
-#include <sys/mman.h>
 #include <string.h>
 
 #define BIT(x)				(1ULL << (x))
@@ -18,64 +17,92 @@ static inline uint8_t asm_bsr(uint64_t x){
 	return x;
 }
 
-uint8_t process_tnt_cache(tnt_cache_t* self){
-	uint8_t result;
-	if (self->tnt){
-		result = self->tnt_memory[self->pos];
-		self->tnt--;
-		self->pos = (self->pos + 1) % BUF_SIZE;
-		return result;
+/* reclaim consumed words or grow the buffer so that n more bits fit */
+static void tnt_cache_make_room(tnt_cache_t* self, uint8_t n){
+	uint64_t first_word = self->head >> 6;
+
+	if (first_word){
+		memmove(self->bits, self->bits + first_word, (((self->tail + 63) >> 6) - first_word) * sizeof(uint64_t));
+		self->head -= first_word << 6;
+		self->tail -= first_word << 6;
+	}
+
+	while (self->tail + n > self->size){
+		self->size <<= 1;
+		self->bits = realloc(self->bits, self->size >> 3);
+		assert(self->bits);
+	}
+}
+
+/* appends n bits of data (oldest in bit n-1, upper bits cleared) */
+static inline void tnt_cache_push(tnt_cache_t* self, uint64_t data, uint8_t n){
+	uint64_t* word;
+	uint8_t off;
+
+	if (self->head == self->tail){
+		self->head = 0;
+		self->tail = 0;
 	}
-	return TNT_EMPTY;
+	if (__builtin_expect(self->tail + n > self->size, 0)){
+		tnt_cache_make_room(self, n);
+	}
+
+	word = &self->bits[self->tail >> 6];
+	off = self->tail & 63;
+	data <<= (64 - n);
+
+	if (!off){
+		word[0] = data;
+	} else {
+		word[0] |= data >> off;
+		if (off + n > 64){
+			word[1] = data << (64 - off);
+		}
+	}
+	self->tail += n;
 }
 
 void append_tnt_cache(tnt_cache_t* self, uint8_t data){
 	uint8_t bits = asm_bsr(data)-SHORT_TNT_OFFSET;
-	for(uint8_t i = SHORT_TNT_OFFSET; i < bits+SHORT_TNT_OFFSET; i++){
-		self->tnt_memory[((self->max+bits-i)%BUF_SIZE)] = ((data) & BIT(i)) >> i;
+	if (bits){
+		tnt_cache_push(self, (data >> SHORT_TNT_OFFSET) & (BIT(bits) - 1), bits);
 	}
-
-	self->tnt += bits;
-	self->max = (self->max + bits) % BUF_SIZE;
 }	
 
+/* data is the 48 bit payload of a long TNT packet (header bytes stripped) */
 void append_tnt_cache_ltnt(tnt_cache_t* self, uint64_t data){
-	uint8_t bits = asm_bsr(data)-LONG_TNT_MAX_BITS;
-	for(uint8_t i = LONG_TNT_MAX_BITS; i < bits+LONG_TNT_MAX_BITS; i++){
-		self->tnt_memory[((self->max+bits-i)%BUF_SIZE)] = ((data) & BIT(i)) >> i;
+	uint8_t bits;
+	if (data){
+		bits = asm_bsr(data);
+		if (bits){
+			tnt_cache_push(self, data & (BIT(bits) - 1), bits);
+		}
 	}
-
-	self->tnt += bits;
-	self->max = (self->max + bits) % BUF_SIZE;
 }	
 
 bool is_empty_tnt_cache(tnt_cache_t* self){
-	return (bool)!!(self->tnt);
+	return self->head == self->tail;
 }
 
 int count_tnt(tnt_cache_t* self){
-	return self->tnt;
+	return self->tail - self->head;
 }
 
 tnt_cache_t* tnt_cache_init(void){
 	tnt_cache_t* self = malloc(sizeof(tnt_cache_t));
-	self->tnt_memory = (uint8_t*)mmap(NULL, BUF_SIZE, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, 0, 0);
-	self->max = 0;
-	self->pos = 0;
-	self->tnt = 0;
+	self->size = TNT_CACHE_INIT_SIZE;
+	self->bits = malloc(self->size >> 3);
+	self->head = 0;
+	self->tail = 0;
 	return self;
 }
 
 void tnt_cache_flush(tnt_cache_t* self){
-	self->max = 0;
-	self->pos = 0;
-	self->tnt = 0;
+	self->head = 0;
+	self->tail = 0;
 }
 
 void tnt_cache_destroy(tnt_cache_t* self){
-	munmap(self->tnt_memory, BUF_SIZE);
-	self->max = 0;
-	self->pos = 0;
-	self->tnt = 0;
+	free(self->bits);
+	free(self);
 }
-
@@ -24,13 +24,18 @@
 #define LONG_TNT_OFFSET		16
 #define LONG_TNT_MAX_BITS	64-1-LONG_TNT_OFFSET
 
-#define BUF_SIZE 0x1000000      /* 16777216 slots */
+#define TNT_CACHE_INIT_SIZE	(0x1000 * 8)	/* 4KB (in bits), grows on demand */
 
+/*
+ * TNT bits are kept packed in 64-bit words in the order they were traced.
+ * Within a word the oldest bit is the MSB, so a peeked window can be scanned
+ * with clz/popcnt. Bits behind tail are always zero.
+ */
 typedef struct tnt_cache_s{
-	uint8_t* tnt_memory;
-	uint64_t pos;
-	uint64_t max;
-	uint64_t tnt;
+	uint64_t* bits;
+	uint64_t head;		/* read position (in bits) */
+	uint64_t tail;		/* write position (in bits) */
+	uint64_t size;		/* capacity (in bits) */
 } tnt_cache_t;
 
 tnt_cache_t* tnt_cache_init(void);
@@ -40,9 +45,41 @@ void tnt_cache_flush(tnt_cache_t* self);
 
 bool is_empty_tnt_cache(tnt_cache_t* self);
 int count_tnt(tnt_cache_t* self);
-uint8_t process_tnt_cache(tnt_cache_t* self);
 
 void append_tnt_cache(tnt_cache_t* self, uint8_t data);
 void append_tnt_cache_ltnt(tnt_cache_t* self, uint64_t data);
 
+static inline uint8_t process_tnt_cache(tnt_cache_t* self){
+	uint64_t pos;
+	if (__builtin_expect(self->head == self->tail, 0)){
+		return TNT_EMPTY;
+	}
+	pos = self->head++;
+	return (self->bits[pos >> 6] >> (63 - (pos & 63))) & 1;
+}
+
+/* returns up to 64 pending bits (oldest in bit 63) without consuming them */
+static inline uint64_t peek_tnt_cache(tnt_cache_t* self, uint8_t* count){
+	uint64_t avail = self->tail - self->head;
+	uint8_t off = self->head & 63;
+	uint64_t idx = self->head >> 6;
+	uint64_t v;
+
+	if (!avail){
+		*count = 0;
+		return 0;
+	}
+	v = self->bits[idx] << off;
+	if (off && (uint64_t)(64 - off) < avail){
+		v |= self->bits[idx + 1] >> (64 - off);
+	}
+	*count = avail > 64 ? 64 : avail;
+	return v;
+}
+
+/* consumes n bits, n must not exceed the count returned by peek_tnt_cache() */
+static inline void drop_tnt_cache(tnt_cache_t* self, uint8_t n){
+	self->head += n;
+}
+
 #endif